@@ -0,0 +1,168 @@
+/**
+ * @file BoundedQueue.h
+ * Fixed-capacity multi-producer multi-consumer queue, for handing work
+ * between the stages of a pipeline.
+ *
+ * The queue is a ring of cells, each with its own sequence number, so
+ * producers and consumers claim cells with a single compare-and-swap and
+ * never take a lock (Vyukov's bounded MPMC queue). A full queue makes
+ * push wait, which is what keeps a fast stage from running ahead of a slow
+ * one; once the producers call close(), pop drains what is left and then
+ * returns false.
+ */
+
+#ifndef CS221_BOUNDEDQUEUE_H_
+#define CS221_BOUNDEDQUEUE_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <thread>
+#include <utility>
+
+namespace cs221util {
+  template <typename T>
+  class BoundedQueue {
+  public:
+    /**
+     * Creates an empty queue holding at most capacity items, rounded up to
+     * a power of two (and to at least 2).
+     */
+    explicit BoundedQueue(size_t capacity)
+      : mask_(roundUp(capacity) - 1), cells_(new Cell[mask_ + 1]),
+        head_(0), tail_(0), closed_(false) {
+      for (size_t i = 0; i <= mask_; i++) {
+        cells_[i].sequence.store(i, std::memory_order_relaxed);
+      }
+    }
+
+    BoundedQueue(const BoundedQueue &) = delete;
+    BoundedQueue & operator=(const BoundedQueue &) = delete;
+
+    /** The number of items the queue can hold. */
+    size_t capacity() const {
+      return mask_ + 1;
+    }
+
+    /**
+     * Adds item to the queue, if there is room.
+     * @return false, and leaves item alone, if the queue is full
+     */
+    bool tryPush(T & item) {
+      size_t pos = tail_.load(std::memory_order_relaxed);
+      for (;;) {
+        Cell & cell = cells_[pos & mask_];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        ptrdiff_t diff = (ptrdiff_t)sequence - (ptrdiff_t)pos;
+        if (diff == 0) {
+          if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            cell.item = std::move(item);
+            cell.sequence.store(pos + 1, std::memory_order_release);
+            return true;
+          }
+        } else if (diff < 0) {
+          return false;
+        } else {
+          pos = tail_.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    /**
+     * Removes the oldest item from the queue into item, if there is one.
+     * @return false if the queue is empty
+     */
+    bool tryPop(T & item) {
+      size_t pos = head_.load(std::memory_order_relaxed);
+      for (;;) {
+        Cell & cell = cells_[pos & mask_];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        ptrdiff_t diff = (ptrdiff_t)sequence - (ptrdiff_t)(pos + 1);
+        if (diff == 0) {
+          if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+            item = std::move(cell.item);
+            cell.sequence.store(pos + mask_ + 1, std::memory_order_release);
+            return true;
+          }
+        } else if (diff < 0) {
+          return false;
+        } else {
+          pos = head_.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    /**
+     * Adds item to the queue, waiting for room if it is full.
+     * @pre close() has not been called
+     */
+    void push(T item) {
+      for (unsigned spins = 0; !tryPush(item); spins++) {
+        backOff(spins);
+      }
+    }
+
+    /**
+     * Removes the oldest item from the queue into item, waiting for one if
+     * the queue is empty.
+     * @return false if the queue is closed and has been drained
+     */
+    bool pop(T & item) {
+      for (unsigned spins = 0; !tryPop(item); spins++) {
+        if (closed_.load(std::memory_order_acquire)) {
+          // An item pushed just before close() is visible now
+          return tryPop(item);
+        }
+        backOff(spins);
+      }
+      return true;
+    }
+
+    /**
+     * Marks the end of the input: once the queue is empty, pop returns false
+     * instead of waiting. Called once all producers are done pushing.
+     */
+    void close() {
+      closed_.store(true, std::memory_order_release);
+    }
+
+  private:
+    struct Cell {
+      std::atomic<size_t> sequence;
+      T item;
+    };
+
+    static size_t roundUp(size_t capacity) {
+      size_t size = 2;
+      while (size < capacity) {
+        size <<= 1;
+      }
+      return size;
+    }
+
+    // Spins briefly, then yields, then sleeps, so a stage waiting on a slow
+    // neighbour does not take its core away from it
+    static void backOff(unsigned spins) {
+      if (spins < 16) {
+        return;
+      } else if (spins < 64) {
+        std::this_thread::yield();
+      } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+      }
+    }
+
+    // Head and tail are written by different threads; the padding keeps them
+    // on separate cache lines
+    const size_t mask_;
+    std::unique_ptr<Cell[]> cells_;
+    char padHead_[64];
+    std::atomic<size_t> head_;
+    char padTail_[64];
+    std::atomic<size_t> tail_;
+    std::atomic<bool> closed_;
+  };
+}
+
+#endif
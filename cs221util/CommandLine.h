@@ -0,0 +1,29 @@
+/**
+ * @file CommandLine.h
+ * Helpers the command line tools share for parsing their arguments.
+ */
+
+#ifndef CS221_COMMANDLINE_H_
+#define CS221_COMMANDLINE_H_
+
+#include <cstdlib>
+#include <string>
+
+namespace cs221util {
+  /**
+   * Parses a decimal unsigned value in [low, high] into value; false, and
+   * value left alone, if text is empty, has anything after the number or
+   * is out of range.
+   */
+  inline bool parseUnsigned(const std::string & text, unsigned int low, unsigned int high, unsigned int & value) {
+    char * end;
+    unsigned long parsed = strtoul(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0' || parsed < low || parsed > high) {
+      return false;
+    }
+    value = parsed;
+    return true;
+  }
+}
+
+#endif
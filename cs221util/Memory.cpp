@@ -0,0 +1,121 @@
+/**
+ * @file Memory.cpp
+ * Implementation of the memory accounting.
+ */
+
+#include <algorithm>
+#include <atomic>
+
+#include "Memory.h"
+
+namespace cs221util {
+  static const char * const kCategoryNames[kMemoryCategories] = { "nodes", "images", "lodepng" };
+
+  // Process-wide figures; the last entry of each is the total
+  static std::atomic<long long> liveBytes[kMemoryCategories + 1];
+  static std::atomic<long long> peakBytes[kMemoryCategories + 1];
+
+  // What the calling thread allocated minus what it freed, and the most that
+  // has been since the innermost MemoryScope began
+  static MemoryUsage & threadUsage() {
+    static thread_local MemoryUsage usage;
+    return usage;
+  }
+
+  static void raisePeak(std::atomic<long long> & peak, long long live) {
+    long long seen = peak.load(std::memory_order_relaxed);
+    while (live > seen && !peak.compare_exchange_weak(seen, live, std::memory_order_relaxed)) { }
+  }
+
+  // Adds delta bytes of category to the process and thread figures
+  static void account(MemoryCategory category, long long delta) {
+    raisePeak(peakBytes[category], liveBytes[category].fetch_add(delta, std::memory_order_relaxed) + delta);
+    raisePeak(peakBytes[kMemoryCategories],
+              liveBytes[kMemoryCategories].fetch_add(delta, std::memory_order_relaxed) + delta);
+
+    MemoryUsage & usage = threadUsage();
+    usage.live[category] += delta;
+    usage.peak[category] = std::max(usage.peak[category], usage.live[category]);
+    usage.totalLive += delta;
+    usage.totalPeak = std::max(usage.totalPeak, usage.totalLive);
+  }
+
+  std::ostream & operator<<(std::ostream & out, MemoryUsage const & usage) {
+    out << "peak KB";
+    for (int c = 0; c < kMemoryCategories; c++) {
+      out << (c == 0 ? " " : ", ") << kCategoryNames[c] << " " << usage.peak[c] / 1024.0;
+    }
+    out << ", total " << usage.totalPeak / 1024.0 << "; live KB";
+    for (int c = 0; c < kMemoryCategories; c++) {
+      out << (c == 0 ? " " : ", ") << kCategoryNames[c] << " " << usage.live[c] / 1024.0;
+    }
+    out << ", total " << usage.totalLive / 1024.0;
+    return out;
+  }
+
+  const char * memoryCategoryName(MemoryCategory category) {
+    return category < kMemoryCategories ? kCategoryNames[category] : "";
+  }
+
+  bool memoryCompiled() {
+#ifdef CS221_MEMORY
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  void memoryAllocated(MemoryCategory category, size_t bytes) {
+    account(category, (long long)bytes);
+  }
+
+  void memoryFreed(MemoryCategory category, size_t bytes) {
+    account(category, -(long long)bytes);
+  }
+
+  MemoryUsage memoryUsage() {
+    MemoryUsage usage;
+    for (int c = 0; c < kMemoryCategories; c++) {
+      usage.live[c] = liveBytes[c].load(std::memory_order_relaxed);
+      usage.peak[c] = peakBytes[c].load(std::memory_order_relaxed);
+    }
+    usage.totalLive = liveBytes[kMemoryCategories].load(std::memory_order_relaxed);
+    usage.totalPeak = peakBytes[kMemoryCategories].load(std::memory_order_relaxed);
+    return usage;
+  }
+
+  void memoryResetPeaks() {
+    for (int c = 0; c <= kMemoryCategories; c++) {
+      peakBytes[c].store(liveBytes[c].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+  }
+
+  MemoryScope::MemoryScope() : start_(threadUsage()) {
+    MemoryUsage & usage = threadUsage();
+    for (int c = 0; c < kMemoryCategories; c++) {
+      usage.peak[c] = usage.live[c];
+    }
+    usage.totalPeak = usage.totalLive;
+  }
+
+  MemoryScope::~MemoryScope() {
+    // the enclosing scope's peak covers this one's
+    MemoryUsage & usage = threadUsage();
+    for (int c = 0; c < kMemoryCategories; c++) {
+      usage.peak[c] = std::max(usage.peak[c], start_.peak[c]);
+    }
+    usage.totalPeak = std::max(usage.totalPeak, start_.totalPeak);
+  }
+
+  MemoryUsage MemoryScope::usage() const {
+    MemoryUsage & now = threadUsage();
+    MemoryUsage usage;
+    for (int c = 0; c < kMemoryCategories; c++) {
+      usage.live[c] = now.live[c] - start_.live[c];
+      usage.peak[c] = now.peak[c] - start_.live[c];
+    }
+    usage.totalLive = now.totalLive - start_.totalLive;
+    usage.totalPeak = now.totalPeak - start_.totalLive;
+    return usage;
+  }
+}
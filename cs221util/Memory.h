@@ -0,0 +1,114 @@
+/**
+ * @file Memory.h
+ * Accounting of the memory held by QTree nodes, PNG pixel buffers and
+ * lodepng, with high-water marks.
+ *
+ * The library reports its allocations with CS221_MEMORY_ALLOC and
+ * CS221_MEMORY_FREE; lodepng_malloc, lodepng_realloc and lodepng_free report
+ * theirs. This is only compiled in when CS221_MEMORY is defined
+ * (e.g. -DCS221_MEMORY); otherwise the macros compile to nothing and every
+ * figure stays at zero.
+ *
+ * memoryUsage() gives the live and peak bytes of the whole process. To see
+ * how much one operation needed, create a MemoryScope before it:
+ *
+ *     cs221util::MemoryScope scope;
+ *     QTree tree(img);
+ *     cout << scope.usage() << endl;
+ */
+
+#ifndef CS221_MEMORY_H_
+#define CS221_MEMORY_H_
+
+#include <cstddef>
+#include <iostream>
+
+namespace cs221util {
+  /** What the accounted memory holds. */
+  enum MemoryCategory {
+    kMemoryNodes,
+    kMemoryImages,
+    kMemoryLodepng,
+    kMemoryCategories
+  };
+
+  struct MemoryUsage {
+    /** Bytes allocated and not yet freed, per category. */
+    long long live[kMemoryCategories] = { };
+    /** The most live bytes there have been, per category. */
+    long long peak[kMemoryCategories] = { };
+    /** live summed over the categories. */
+    long long totalLive = 0;
+    /** The most totalLive there has been; at most the sum of peak. */
+    long long totalPeak = 0;
+  };
+
+  /**
+   * Writes the peak and live bytes of each category on one line, in KB.
+   */
+  std::ostream & operator<<(std::ostream & out, MemoryUsage const & usage);
+
+  /**
+   * The name of category: nodes, images or lodepng.
+   */
+  const char * memoryCategoryName(MemoryCategory category);
+
+  /**
+   * Whether the library was built with CS221_MEMORY, i.e. whether the
+   * figures mean anything.
+   */
+  bool memoryCompiled();
+
+  /**
+   * Accounts for bytes allocated or freed by the calling thread.
+   * Used through CS221_MEMORY_ALLOC and CS221_MEMORY_FREE.
+   */
+  void memoryAllocated(MemoryCategory category, size_t bytes);
+  void memoryFreed(MemoryCategory category, size_t bytes);
+
+  /**
+   * Live and peak bytes of the whole process, since it started or since
+   * the last memoryResetPeaks().
+   */
+  MemoryUsage memoryUsage();
+
+  /**
+   * Lowers every peak to the current live bytes.
+   */
+  void memoryResetPeaks();
+
+  /**
+   * Measures the memory the calling thread allocates during the scope's
+   * lifetime. Memory that other threads allocate for it, e.g. lodepng's
+   * worker threads, is not included. Scopes may be nested.
+   */
+  class MemoryScope {
+  public:
+    MemoryScope();
+    ~MemoryScope();
+
+    /**
+     * live: bytes the calling thread allocated and did not free since the
+     * scope was created (negative if it freed more). peak: the most that
+     * ever was, so the extra memory the operation needed at its high point.
+     */
+    MemoryUsage usage() const;
+
+    MemoryScope(MemoryScope const &) = delete;
+    MemoryScope & operator=(MemoryScope const &) = delete;
+
+  private:
+    MemoryUsage start_;
+  };
+}
+
+#ifdef CS221_MEMORY
+/** Accounts for bytes of category, e.g. CS221_MEMORY_ALLOC(kMemoryNodes, sizeof(Node)). */
+#define CS221_MEMORY_ALLOC(category, bytes) cs221util::memoryAllocated(cs221util::category, (bytes))
+#define CS221_MEMORY_FREE(category, bytes) cs221util::memoryFreed(cs221util::category, (bytes))
+#else
+#define CS221_MEMORY_ALLOC(category, bytes) ((void)sizeof(bytes))
+#define CS221_MEMORY_FREE(category, bytes) ((void)sizeof(bytes))
+#endif
+
+#endif
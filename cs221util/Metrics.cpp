@@ -0,0 +1,314 @@
+/**
+ * @file Metrics.cpp
+ * Implementation of the image quality metrics.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "Metrics.h"
+#include "Trace.h"
+#include "lodepng/lodepng.h"
+
+#ifdef LODEPNG_COMPILE_SIMD
+#include <emmintrin.h>
+#endif
+
+namespace cs221util {
+  // Rows each thread takes at a time when measuring the error
+  static const unsigned kBandRows = 16;
+
+  // SSIM window size and the distance between windows
+  static const unsigned kWindow = 8;
+  static const unsigned kWindowStep = 4;
+
+  // SSIM's stabilizing constants, for 8-bit channels
+  static const double kC1 = (0.01 * 255) * (0.01 * 255);
+  static const double kC2 = (0.03 * 255) * (0.03 * 255);
+
+  std::ostream & operator<<(std::ostream & out, ImageMetrics const & metrics) {
+    out << "mse " << metrics.mse << ", psnr " << metrics.psnr << " dB, ssim " << metrics.ssim
+        << ", max error " << metrics.maxError;
+    return out;
+  }
+
+  double psnr(double mse) {
+    if (mse <= 0) {
+      return std::numeric_limits<double>::infinity();
+    }
+    return 10 * std::log10(255.0 * 255.0 / mse);
+  }
+
+  void parallelFor(size_t count, unsigned threads, std::function<void(size_t)> const & work) {
+    std::atomic<size_t> next(0);
+    auto run = [&] {
+      for (size_t i = next++; i < count; i = next++) {
+        work(i);
+      }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads && t < count; t++) {
+      // if a thread can't be started, the ones that did pick up its share
+      try {
+        pool.push_back(std::thread(run));
+      } catch (std::system_error const &) {
+        break;
+      }
+    }
+    run();
+    for (std::thread & thread : pool) {
+      thread.join();
+    }
+  }
+
+  // Luma weights, in thousandths, so that the SSIM sums are exact integers
+  static const int kLumaR = 299;
+  static const int kLumaG = 587;
+  static const int kLumaB = 114;
+
+  static inline unsigned luma(RGBAPixel const & pixel) {
+    return kLumaR * pixel.r + kLumaG * pixel.g + kLumaB * pixel.b;
+  }
+
+#ifdef LODEPNG_COMPILE_SIMD
+  // SSE2 versions of the loops over a row's pixels, used as lodepng uses
+  // its filter kernels: when lodepng_get_simd_level() is at least 1. They
+  // take 4 pixels at a time, each 16 bytes: r, g, b, padding, then alpha as
+  // a double at byte 8. Both give the same sums as the portable loops
+  static_assert(sizeof(RGBAPixel) == 16 && offsetof(RGBAPixel, a) == 8,
+                "the SSE2 metrics expect r, g, b at bytes 0-2 and alpha at byte 8");
+
+  // The r, g and b bytes of 4 pixels, one pixel to a 32-bit lane, with the
+  // top byte 0
+  static inline __m128i rgbLanes(RGBAPixel const * pixels) {
+    __m128i p0 = _mm_loadu_si128((__m128i const *)&pixels[0]);
+    __m128i p1 = _mm_loadu_si128((__m128i const *)&pixels[1]);
+    __m128i p2 = _mm_loadu_si128((__m128i const *)&pixels[2]);
+    __m128i p3 = _mm_loadu_si128((__m128i const *)&pixels[3]);
+    __m128i rgb = _mm_unpacklo_epi64(_mm_unpacklo_epi32(p0, p1), _mm_unpacklo_epi32(p2, p3));
+    return _mm_and_si128(rgb, _mm_set1_epi32(0x00ffffff));
+  }
+
+  // rgbLanes with alphaByte of each pixel in the top byte
+  static inline __m128i rgbaLanes(RGBAPixel const * pixels) {
+    __m128d scale = _mm_set1_pd(255);
+    __m128d a01 = _mm_set_pd(pixels[1].a, pixels[0].a);
+    __m128d a23 = _mm_set_pd(pixels[3].a, pixels[2].a);
+    __m128i alpha = _mm_unpacklo_epi64(_mm_cvttpd_epi32(_mm_mul_pd(a01, scale)),
+                                       _mm_cvttpd_epi32(_mm_mul_pd(a23, scale)));
+    return _mm_or_si128(rgbLanes(pixels), _mm_slli_epi32(alpha, 24));
+  }
+
+  // The luma of the 4 pixels of rgbLanes
+  static inline __m128i lumaLanes(__m128i rgb) {
+    __m128i rb = _mm_madd_epi16(_mm_and_si128(rgb, _mm_set1_epi32(0x00ff00ff)),
+                                _mm_set1_epi32((kLumaB << 16) | kLumaR));
+    __m128i g = _mm_madd_epi16(_mm_and_si128(_mm_srli_epi32(rgb, 8), _mm_set1_epi32(0xff)),
+                               _mm_set1_epi32(kLumaG));
+    return _mm_add_epi32(rb, g);
+  }
+
+  // rowErrors of the first width - width % 4 pixels of a row
+  static void rowErrorsSSE2(RGBAPixel const * rowA, RGBAPixel const * rowB, unsigned width,
+                            unsigned long long & error, int & maxError) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i sum = zero;
+    __m128i largest = zero;
+    for (unsigned x = 0; x + 4 <= width; x += 4) {
+      __m128i a = rgbaLanes(rowA + x);
+      __m128i b = rgbaLanes(rowB + x);
+      __m128i diff = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+      largest = _mm_max_epu8(largest, diff);
+      diff = _mm_and_si128(diff, _mm_set1_epi32(0x00ffffff));
+      __m128i lo = _mm_unpacklo_epi8(diff, zero);
+      __m128i hi = _mm_unpackhi_epi8(diff, zero);
+      __m128i squares = _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi));
+      sum = _mm_add_epi64(sum, _mm_add_epi64(_mm_unpacklo_epi32(squares, zero), _mm_unpackhi_epi32(squares, zero)));
+    }
+    unsigned long long sums[2];
+    unsigned char bytes[16];
+    _mm_storeu_si128((__m128i *)sums, sum);
+    _mm_storeu_si128((__m128i *)bytes, largest);
+    error += sums[0] + sums[1];
+    for (int i = 0; i < 16; i++) {
+      maxError = std::max(maxError, (int)bytes[i]);
+    }
+  }
+
+  // Adds the lumas, their squares and products of the first
+  // width - width % 4 pixels of a row to the column sums
+  static void columnSumsSSE2(RGBAPixel const * rowA, RGBAPixel const * rowB, unsigned width,
+                             unsigned * sa, unsigned * sb, unsigned long long * saa,
+                             unsigned long long * sbb, unsigned long long * sab) {
+    __m128i zero = _mm_setzero_si128();
+    for (unsigned x = 0; x + 4 <= width; x += 4) {
+      __m128i la = lumaLanes(rgbLanes(rowA + x));
+      __m128i lb = lumaLanes(rgbLanes(rowB + x));
+      _mm_storeu_si128((__m128i *)&sa[x], _mm_add_epi32(_mm_loadu_si128((__m128i *)&sa[x]), la));
+      _mm_storeu_si128((__m128i *)&sb[x], _mm_add_epi32(_mm_loadu_si128((__m128i *)&sb[x]), lb));
+      // the lumas as 64-bit lanes, 2 pixels at a time
+      __m128i halves[2][2] = {
+        { _mm_unpacklo_epi32(la, zero), _mm_unpacklo_epi32(lb, zero) },
+        { _mm_unpackhi_epi32(la, zero), _mm_unpackhi_epi32(lb, zero) } };
+      for (unsigned h = 0; h < 2; h++) {
+        __m128i a = halves[h][0];
+        __m128i b = halves[h][1];
+        __m128i * aa = (__m128i *)&saa[x + 2 * h];
+        __m128i * bb = (__m128i *)&sbb[x + 2 * h];
+        __m128i * ab = (__m128i *)&sab[x + 2 * h];
+        _mm_storeu_si128(aa, _mm_add_epi64(_mm_loadu_si128(aa), _mm_mul_epu32(a, a)));
+        _mm_storeu_si128(bb, _mm_add_epi64(_mm_loadu_si128(bb), _mm_mul_epu32(b, b)));
+        _mm_storeu_si128(ab, _mm_add_epi64(_mm_loadu_si128(ab), _mm_mul_epu32(a, b)));
+      }
+    }
+  }
+#endif
+
+  // Sum of squared r, g and b differences of rows [y0, y1), and the largest
+  // difference of any channel
+  static void rowErrors(PNG const & a, PNG const & b, unsigned y0, unsigned y1,
+                        unsigned long long & error, unsigned & maxError) {
+    unsigned long long sum = 0;
+    int largest = 0;
+#ifdef LODEPNG_COMPILE_SIMD
+    bool simd = lodepng_get_simd_level() >= 1;
+#endif
+    for (unsigned y = y0; y < y1; y++) {
+      const RGBAPixel * rowA = a.getPixel(0, y);
+      const RGBAPixel * rowB = b.getPixel(0, y);
+      unsigned start = 0;
+#ifdef LODEPNG_COMPILE_SIMD
+      if (simd) {
+        rowErrorsSSE2(rowA, rowB, a.width(), sum, largest);
+        start = a.width() - a.width() % 4;
+      }
+#endif
+      for (unsigned x = start; x < a.width(); x++) {
+        int dr = std::abs(rowA[x].r - rowB[x].r);
+        int dg = std::abs(rowA[x].g - rowB[x].g);
+        int db = std::abs(rowA[x].b - rowB[x].b);
+        int da = std::abs(alphaByte(rowA[x].a) - alphaByte(rowB[x].a));
+        sum += dr * dr + dg * dg + db * db;
+        largest = std::max(largest, std::max(std::max(dr, dg), std::max(db, da)));
+      }
+    }
+    error = sum;
+    maxError = largest;
+  }
+
+  // Sum of the SSIM of the windows whose top row is y, each width x height
+  static double windowRowSSIM(PNG const & a, PNG const & b, unsigned y, unsigned width, unsigned height) {
+    // per column, the sums over the window's rows of each luma, its square,
+    // and their product, all in integers so that they are exact
+    unsigned w = a.width();
+    std::vector<unsigned> lumaSums(2 * w, 0);
+    std::vector<unsigned long long> productSums(3 * w, 0);
+    unsigned * sa = &lumaSums[0];
+    unsigned * sb = sa + w;
+    unsigned long long * saa = &productSums[0];
+    unsigned long long * sbb = saa + w;
+    unsigned long long * sab = sbb + w;
+#ifdef LODEPNG_COMPILE_SIMD
+    bool simd = lodepng_get_simd_level() >= 1;
+#endif
+    for (unsigned row = y; row < y + height; row++) {
+      const RGBAPixel * rowA = a.getPixel(0, row);
+      const RGBAPixel * rowB = b.getPixel(0, row);
+      unsigned start = 0;
+#ifdef LODEPNG_COMPILE_SIMD
+      if (simd) {
+        columnSumsSSE2(rowA, rowB, w, sa, sb, saa, sbb, sab);
+        start = w - w % 4;
+      }
+#endif
+      for (unsigned x = start; x < w; x++) {
+        unsigned long long la = luma(rowA[x]);
+        unsigned long long lb = luma(rowB[x]);
+        sa[x] += la;
+        sb[x] += lb;
+        saa[x] += la * la;
+        sbb[x] += lb * lb;
+        sab[x] += la * lb;
+      }
+    }
+
+    // n^2 times the variances and covariance, exact, then scaled back from
+    // thousandths
+    long long n = (long long)width * height;
+    double scale = 1000.0 * n;
+    double total = 0;
+    for (unsigned x0 = 0; x0 + width <= w; x0 += kWindowStep) {
+      long long ta = 0, tb = 0, taa = 0, tbb = 0, tab = 0;
+      for (unsigned x = x0; x < x0 + width; x++) {
+        ta += sa[x];
+        tb += sb[x];
+        taa += saa[x];
+        tbb += sbb[x];
+        tab += sab[x];
+      }
+      double ma = ta / scale;
+      double mb = tb / scale;
+      double va = (n * taa - ta * ta) / (scale * scale);
+      double vb = (n * tbb - tb * tb) / (scale * scale);
+      double cov = (n * tab - ta * tb) / (scale * scale);
+      total += ((2 * ma * mb + kC1) * (2 * cov + kC2)) / ((ma * ma + mb * mb + kC1) * (va + vb + kC2));
+    }
+    return total;
+  }
+
+  bool compareImages(PNG const & a, PNG const & b, ImageMetrics & metrics, unsigned threads) {
+    if (a.width() != b.width() || a.height() != b.height()) {
+      return false;
+    }
+    CS221_TRACE("compareImages");
+
+    ImageMetrics result;
+    unsigned w = a.width();
+    unsigned h = a.height();
+    if (w == 0 || h == 0) {
+      metrics = result;
+      return true;
+    }
+
+    // each band and window row is summed on its own, and the sums are
+    // added up in order, so the figures don't depend on the threads
+    size_t bands = (h + kBandRows - 1) / kBandRows;
+    std::vector<unsigned long long> errors(bands);
+    std::vector<unsigned> maxErrors(bands);
+    parallelFor(bands, threads, [&](size_t band) {
+      unsigned y0 = band * kBandRows;
+      rowErrors(a, b, y0, std::min(h, y0 + kBandRows), errors[band], maxErrors[band]);
+    });
+
+    // images smaller than a window have one window of their own size
+    unsigned width = std::min(w, kWindow);
+    unsigned height = std::min(h, kWindow);
+    size_t windowRows = (h - height) / kWindowStep + 1;
+    size_t windowColumns = (w - width) / kWindowStep + 1;
+    std::vector<double> ssims(windowRows);
+    parallelFor(windowRows, threads, [&](size_t row) {
+      ssims[row] = windowRowSSIM(a, b, row * kWindowStep, width, height);
+    });
+
+    unsigned long long error = 0;
+    for (size_t band = 0; band < bands; band++) {
+      error += errors[band];
+      result.maxError = std::max(result.maxError, maxErrors[band]);
+    }
+    result.mse = (double)error / (3.0 * w * h);
+    result.psnr = psnr(result.mse);
+    double ssim = 0;
+    for (double rowSSIM : ssims) {
+      ssim += rowSSIM;
+    }
+    result.ssim = ssim / (windowRows * windowColumns);
+    metrics = result;
+    return true;
+  }
+}
@@ -0,0 +1,80 @@
+/**
+ * @file Metrics.h
+ * Image quality metrics: mean squared error, PSNR, SSIM and the largest
+ * channel error between two images.
+ *
+ * PNG::operator== only tells whether two images are alike to within a
+ * small slack. compareImages measures by how much they differ, e.g. a
+ * rendered QTree from the image it was built from:
+ *
+ *     cs221util::ImageMetrics metrics;
+ *     cs221util::compareImages(original, tree.Render(1), metrics, 4);
+ *     cout << metrics << endl;
+ *
+ * QTree::Compare gives the same figures, except SSIM, straight from the
+ * tree's leaves without rendering it.
+ */
+
+#ifndef CS221_METRICS_H_
+#define CS221_METRICS_H_
+
+#include <cstddef>
+#include <functional>
+#include <iostream>
+#include <limits>
+
+#include "PNG.h"
+
+namespace cs221util {
+  struct ImageMetrics {
+    /** Mean squared error over the r, g and b channels of every pixel. */
+    double mse = 0;
+    /** Peak signal-to-noise ratio of mse, in dB; infinite if mse is 0. */
+    double psnr = std::numeric_limits<double>::infinity();
+    /**
+     * Mean structural similarity of the luma (0.299 r + 0.587 g + 0.114 b)
+     * over 8x8 windows, 4 pixels apart; 1 for equal images. NaN where it
+     * is not computed.
+     */
+    double ssim = 1;
+    /** Largest difference of any channel of any pixel, alpha scaled to 0-255. */
+    unsigned int maxError = 0;
+  };
+
+  /**
+   * Writes the metrics on one line.
+   */
+  std::ostream & operator<<(std::ostream & out, ImageMetrics const & metrics);
+
+  /**
+   * The PSNR, in dB, of a mean squared error of 8-bit channels; infinite
+   * if mse is 0.
+   */
+  double psnr(double mse);
+
+  /**
+   * The alpha of a pixel as it is written to a file, from 0 to 255.
+   */
+  inline unsigned char alphaByte(double alpha) {
+    return (unsigned char)(alpha * 255);
+  }
+
+  /**
+   * Measures how much b differs from a. Alpha only counts towards
+   * maxError. The result does not depend on the number of threads.
+   *
+   * @param threads number of threads to measure on; 1 measures on the
+   *        calling thread only
+   * @return false, leaving metrics unchanged, if the images differ in size
+   */
+  bool compareImages(PNG const & a, PNG const & b, ImageMetrics & metrics, unsigned threads = 1);
+
+  /**
+   * Runs work(i) for every i in [0, count), on up to threads threads,
+   * including the calling thread, and returns when all are done. Each
+   * thread takes the next i not yet taken.
+   */
+  void parallelFor(size_t count, unsigned threads, std::function<void(size_t)> const & work);
+}
+
+#endif
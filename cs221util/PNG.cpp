@@ -6,6 +6,7 @@
  * @version 2018r1
  */
 
+#include <fstream>
 #include <iostream>
 #include <string>
 #include <algorithm>
@@ -13,17 +14,22 @@
 #include <cassert>
 #include "lodepng/lodepng.h"
 #include "PNG.h"
+#include "Memory.h"
+#include "Stats.h"
+#include "Trace.h"
 //#include "RGB_HSL.h"
 
 namespace cs221util {
   void PNG::_copy(PNG const & other) {
     // Clear self
+    CS221_MEMORY_FREE(kMemoryImages, sizeof(RGBAPixel) * width_ * height_);
     delete[] imageData_;
 
     // Copy `other` to self
     width_ = other.width_;
     height_ = other.height_;
     imageData_ = new RGBAPixel[width_ * height_];
+    CS221_MEMORY_ALLOC(kMemoryImages, sizeof(RGBAPixel) * width_ * height_);
     for (unsigned i = 0; i < width_ * height_; i++) {
       imageData_[i] = other.imageData_[i];
     }
@@ -39,6 +45,7 @@ namespace cs221util {
     width_ = width;
     height_ = height;
     imageData_ = new RGBAPixel[width * height];
+    CS221_MEMORY_ALLOC(kMemoryImages, sizeof(RGBAPixel) * width_ * height_);
   }
 
   PNG::PNG(PNG const & other) {
@@ -47,6 +54,7 @@ namespace cs221util {
   }
 
   PNG::~PNG() {
+    CS221_MEMORY_FREE(kMemoryImages, sizeof(RGBAPixel) * width_ * height_);
     delete[] imageData_;
   }
 
@@ -98,16 +106,43 @@ namespace cs221util {
   }
 
   bool PNG::readFromFile(string const & fileName) {
+    return readFromFile(fileName, PNGReadOptions());
+  }
+
+  bool PNG::readFromFile(string const & fileName, PNGReadOptions const & options) {
+    vector<unsigned char> fileData;
+    unsigned error = lodepng::load_file(fileData, fileName);
+    if (error) {
+      cerr << "PNG decoder error " << error << ": " << lodepng_error_text(error) << endl;
+      return false;
+    }
+    return readFromMemory(fileData, options);
+  }
+
+  bool PNG::readFromMemory(vector<unsigned char> const & fileData, PNGReadOptions const & options) {
+    CS221_TIME(decodeNs);
+    CS221_TRACE("PNG::decode");
     vector<unsigned char> byteData;
-    unsigned error = lodepng::decode(byteData, width_, height_, fileName);
+    lodepng::State state;
+    state.decoder.ignore_crc = options.trustedInput;
+    state.decoder.zlibsettings.ignore_adler32 = options.trustedInput;
+    if (options.context) {
+      state.decoder.zlibsettings.context = options.context->get();
+    }
 
+    unsigned width, height;
+    unsigned error = lodepng::decode(byteData, width, height, state, fileData);
     if (error) {
       cerr << "PNG decoder error " << error << ": " << lodepng_error_text(error) << endl;
       return false;
     }
 
+    CS221_MEMORY_FREE(kMemoryImages, sizeof(RGBAPixel) * width_ * height_);
     delete[] imageData_;
+    width_ = width;
+    height_ = height;
     imageData_ = new RGBAPixel[width_ * height_];
+    CS221_MEMORY_ALLOC(kMemoryImages, sizeof(RGBAPixel) * width_ * height_);
 
     for (unsigned i = 0; i < byteData.size(); i += 4) {
       RGBAPixel & pixel = imageData_[i/4];
@@ -137,7 +172,59 @@ namespace cs221util {
     return true;
   }
 
+  /**
+   * Copies the PNGWriteOptions onto the encoder settings of a lodepng state;
+   * false if they are not valid.
+   */
+  static bool setEncoderOptions(lodepng::State & state, PNGWriteOptions const & options) {
+    lodepng_compress_settings_set_level(&state.encoder.zlibsettings, options.level);
+    state.encoder.zlibsettings.strategy = options.autoRunLength ? LMS_AUTO : LMS_HASH;
+    state.encoder.zlibsettings.numthreads = options.threads;
+    state.encoder.filter_threads = options.threads;
+    switch (options.filter) {
+      case PNGFilterStrategy::MinSum:
+        state.encoder.filter_strategy = LFS_MINSUM;
+        break;
+      case PNGFilterStrategy::Entropy:
+        state.encoder.filter_strategy = LFS_ENTROPY;
+        state.encoder.filter_palette_zero = 0;
+        break;
+      case PNGFilterStrategy::BruteForce:
+        state.encoder.filter_strategy = LFS_BRUTE_FORCE;
+        state.encoder.filter_palette_zero = 0;
+        break;
+    }
+    if (options.context) {
+      state.encoder.zlibsettings.context = options.context->get();
+    }
+    if (options.chunks) {
+      for (PNGChunk const & chunk : *options.chunks) {
+        if (chunk.type.size() != 4) {
+          cerr << "PNG chunk type \"" << chunk.type << "\" is not 4 letters" << endl;
+          return false;
+        }
+        // lodepng writes unknown_chunks_data[1] between PLTE and IDAT
+        unsigned error = lodepng_chunk_create(&state.info_png.unknown_chunks_data[1], &state.info_png.unknown_chunks_size[1],
+                                              chunk.data.size(), chunk.type.c_str(), chunk.data.data());
+        if (error) {
+          cerr << "PNG encoding error " << error << ": " << lodepng_error_text(error) << endl;
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
   bool PNG::writeToFile(string const & fileName) {
+    return writeToFile(fileName, PNGWriteOptions());
+  }
+
+  bool PNG::writeToFile(string const & fileName, PNGWriteOptions const & options) const {
+    lodepng::State state;
+    if (!setEncoderOptions(state, options)) {
+      return false;
+    }
+
     unsigned char *byteData = new unsigned char[width_ * height_ * 4];
 /*
     for (unsigned i = 0; i < width_ * height_; i++) {
@@ -162,7 +249,16 @@ namespace cs221util {
       byteData[(i * 4) + 3] = imageData_[i].a * 255;
     }
 
-    unsigned error = lodepng::encode(fileName, byteData, width_, height_);
+    vector<unsigned char> fileData;
+    unsigned error;
+    {
+      CS221_TIME(encodeNs);
+      CS221_TRACE("PNG::encode");
+      error = lodepng::encode(fileData, byteData, width_, height_, state);
+    }
+    if (!error) {
+      error = lodepng::save_file(fileData, fileName);
+    }
     if (error) {
       cerr << "PNG encoding error " << error << ": " << lodepng_error_text(error) << endl;
     }
@@ -171,6 +267,229 @@ namespace cs221util {
     return (error == 0);
   }
 
+  bool readFromFiles(vector<string> const & fileNames, vector<PNG> & images,
+                     PNGReadOptions const & options) {
+    lodepng::DecoderContext context;
+    PNGReadOptions batchOptions = options;
+    if (!batchOptions.context) {
+      batchOptions.context = &context;
+    }
+
+    images.resize(fileNames.size());
+    bool allRead = true;
+    for (size_t i = 0; i < fileNames.size(); i++) {
+      allRead = images[i].readFromFile(fileNames[i], batchOptions) && allRead;
+    }
+    return allRead;
+  }
+
+  bool writeToFiles(vector<PNG> const & images, vector<string> const & fileNames,
+                    PNGWriteOptions const & options) {
+    if (images.size() != fileNames.size()) {
+      cerr << "writeToFiles: " << images.size() << " images but " << fileNames.size() << " file names" << endl;
+      return false;
+    }
+
+    lodepng::EncoderContext context;
+    PNGWriteOptions batchOptions = options;
+    if (!batchOptions.context) {
+      batchOptions.context = &context;
+    }
+
+    bool allWritten = true;
+    for (size_t i = 0; i < images.size(); i++) {
+      allWritten = images[i].writeToFile(fileNames[i], batchOptions) && allWritten;
+    }
+    return allWritten;
+  }
+
+  /**
+   * Passed to lodepng_encode_rows: asks fill for each row and converts it
+   * to the PNG's color mode.
+   */
+  struct RowWriter {
+    std::function<void(unsigned int, RGBAPixel *)> const * fillPixels;
+    std::function<void(unsigned int, unsigned char *)> const * fillIndices;
+    vector<RGBAPixel> pixels;
+    vector<unsigned char> indices;
+    unsigned bitdepth;   // of the indices
+    unsigned channels;   // 3 or 4 bytes per pixel
+  };
+
+  static unsigned writePixelRow(unsigned char * row, unsigned y, void * userdata) {
+    RowWriter & writer = *static_cast<RowWriter *>(userdata);
+    (*writer.fillPixels)(y, writer.pixels.data());
+    unsigned char * out = row;
+    for (RGBAPixel const & pixel : writer.pixels) {
+      out[0] = pixel.r;
+      out[1] = pixel.g;
+      out[2] = pixel.b;
+      if (writer.channels == 4) { out[3] = pixel.a * 255; }
+      out += writer.channels;
+    }
+    return 0;
+  }
+
+  static unsigned writeIndexRow(unsigned char * row, unsigned y, void * userdata) {
+    RowWriter & writer = *static_cast<RowWriter *>(userdata);
+    (*writer.fillIndices)(y, writer.indices.data());
+    if (writer.bitdepth == 8) {
+      std::copy(writer.indices.begin(), writer.indices.end(), row);
+      return 0;
+    }
+    unsigned perByte = 8 / writer.bitdepth;
+    std::fill(row, row + (writer.indices.size() + perByte - 1) / perByte, 0);
+    for (size_t i = 0; i < writer.indices.size(); i++) {
+      unsigned shift = 8 - writer.bitdepth * (1 + i % perByte);
+      row[i / perByte] |= (unsigned char)(writer.indices[i] << shift);
+    }
+    return 0;
+  }
+
+  /**
+   * Encodes the rows produced by writer into out. The rows are produced as
+   * the encoder asks for them, so the encode time includes producing them.
+   */
+  static bool encodeRowsWith(vector<unsigned char> & out, unsigned int width, unsigned int height,
+                             lodepng::State & state, LodePNGRowCallback callback, RowWriter & writer) {
+    CS221_TIME(encodeNs);
+    CS221_TRACE("PNG::encodeRows");
+    out.clear();
+    unsigned error = lodepng::encode_rows(out, callback, &writer, width, height, state);
+    if (error) {
+      cerr << "PNG encoding error " << error << ": " << lodepng_error_text(error) << endl;
+    }
+    return (error == 0);
+  }
+
+  bool writeFile(vector<unsigned char> const & fileData, string const & fileName) {
+    unsigned error = lodepng::save_file(fileData, fileName);
+    if (error) {
+      cerr << "PNG encoding error " << error << ": " << lodepng_error_text(error) << endl;
+    }
+    return (error == 0);
+  }
+
+  bool writeRowsToFile(string const & fileName, unsigned int width, unsigned int height, bool alpha,
+                       std::function<void(unsigned int y, RGBAPixel * row)> const & fill,
+                       PNGWriteOptions const & options) {
+    vector<unsigned char> fileData;
+    return encodeRows(fileData, width, height, alpha, fill, options) && writeFile(fileData, fileName);
+  }
+
+  bool encodeRows(vector<unsigned char> & out, unsigned int width, unsigned int height, bool alpha,
+                  std::function<void(unsigned int y, RGBAPixel * row)> const & fill,
+                  PNGWriteOptions const & options) {
+    lodepng::State state;
+    if (!setEncoderOptions(state, options)) {
+      return false;
+    }
+    state.info_png.color.colortype = alpha ? LCT_RGBA : LCT_RGB;
+    state.info_png.color.bitdepth = 8;
+
+    RowWriter writer;
+    writer.fillPixels = &fill;
+    writer.pixels.resize(width);
+    writer.channels = alpha ? 4 : 3;
+    return encodeRowsWith(out, width, height, state, writePixelRow, writer);
+  }
+
+  bool writeIndexedRowsToFile(string const & fileName, unsigned int width, unsigned int height,
+                              vector<RGBAPixel> const & palette,
+                              std::function<void(unsigned int y, unsigned char * indices)> const & fill,
+                              PNGWriteOptions const & options) {
+    vector<unsigned char> fileData;
+    return encodeIndexedRows(fileData, width, height, palette, fill, options) && writeFile(fileData, fileName);
+  }
+
+  bool encodeIndexedRows(vector<unsigned char> & out, unsigned int width, unsigned int height,
+                         vector<RGBAPixel> const & palette,
+                         std::function<void(unsigned int y, unsigned char * indices)> const & fill,
+                         PNGWriteOptions const & options) {
+    if (palette.empty() || palette.size() > 256) {
+      cerr << "encodeIndexedRows: palette has " << palette.size() << " colors, expected 1 to 256" << endl;
+      return false;
+    }
+
+    lodepng::State state;
+    if (!setEncoderOptions(state, options)) {
+      return false;
+    }
+
+    // Use the smallest bit depth that holds every index, as the automatic
+    // color choice would for a palette of this size.
+    unsigned bitdepth = 8;
+    if (palette.size() <= 2) { bitdepth = 1; }
+    else if (palette.size() <= 4) { bitdepth = 2; }
+    else if (palette.size() <= 16) { bitdepth = 4; }
+
+    // The rows already have the output color mode, so lodepng neither
+    // analyzes nor converts the pixels; PLTE and tRNS come from the palette.
+    state.info_png.color.colortype = LCT_PALETTE;
+    state.info_png.color.bitdepth = bitdepth;
+    for (size_t i = 0; i < palette.size(); i++) {
+      lodepng_palette_add(&state.info_png.color, palette[i].r, palette[i].g, palette[i].b,
+                          (unsigned char)(palette[i].a * 255));
+    }
+
+    RowWriter writer;
+    writer.fillIndices = &fill;
+    writer.indices.resize(width);
+    writer.bitdepth = bitdepth;
+    return encodeRowsWith(out, width, height, state, writeIndexRow, writer);
+  }
+
+  bool writeIndexedToFile(string const & fileName, unsigned int width, unsigned int height,
+                          vector<RGBAPixel> const & palette, vector<unsigned char> const & indices,
+                          PNGWriteOptions const & options) {
+    if (indices.size() != (size_t)width * height) {
+      cerr << "writeIndexedToFile: " << indices.size() << " indices for a " << width << "x" << height << " image" << endl;
+      return false;
+    }
+
+    return writeIndexedRowsToFile(fileName, width, height, palette,
+        [&](unsigned int y, unsigned char * row) {
+          std::copy(indices.begin() + (size_t)y * width, indices.begin() + (size_t)(y + 1) * width, row);
+        }, options);
+  }
+
+  bool readChunkFromFile(string const & fileName, string const & type, vector<unsigned char> & data) {
+    static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    ifstream file(fileName.c_str(), std::ios::binary);
+    unsigned char header[8];
+    if (!file.read((char *)header, 8) || !std::equal(header, header + 8, signature)) {
+      cerr << "readChunkFromFile: " << fileName << " is not a PNG file" << endl;
+      return false;
+    }
+
+    // each chunk is its data length, type, data and CRC
+    while (file.read((char *)header, 8)) {
+      unsigned length = lodepng_chunk_length(header);
+      if (length > 0x7FFFFFFFu) {
+        break;
+      }
+      if (type.size() == 4 && lodepng_chunk_type_equals(header, type.c_str())) {
+        vector<unsigned char> chunk(header, header + 8);
+        chunk.resize(length + 12);
+        if (!file.read((char *)&chunk[8], length + 4)) {
+          break;
+        }
+        if (lodepng_chunk_check_crc(chunk.data())) {
+          cerr << "readChunkFromFile: " << type << " chunk of " << fileName << " is corrupt" << endl;
+          return false;
+        }
+        data.assign(chunk.begin() + 8, chunk.begin() + 8 + length);
+        return true;
+      }
+      if (lodepng_chunk_type_equals(header, "IEND")) {
+        return false;
+      }
+      file.seekg(length + 4, std::ios::cur);
+    }
+    cerr << "readChunkFromFile: " << fileName << " is truncated or corrupt" << endl;
+    return false;
+  }
+
   unsigned int PNG::width() const {
     return width_;
   }
@@ -182,6 +501,7 @@ namespace cs221util {
   void PNG::resize(unsigned int newWidth, unsigned int newHeight) {
     // Create a new vector to store the image data for the new (resized) image
     RGBAPixel * newImageData = new RGBAPixel[newWidth * newHeight];
+    CS221_MEMORY_ALLOC(kMemoryImages, sizeof(RGBAPixel) * newWidth * newHeight);
 
     // Copy the current data to the new image data, using the existing pixel
     // for coordinates within the bounds of the old image size
@@ -196,6 +516,7 @@ namespace cs221util {
     }
 
     // Clear the existing image
+    CS221_MEMORY_FREE(kMemoryImages, sizeof(RGBAPixel) * width_ * height_);
     delete[] imageData_;
 
     // Update the image to reflect the new image size and data
@@ -8,14 +8,106 @@
 #ifndef CS221_PNG_H_
 #define CS221_PNG_H_
 
+#include <functional>
 #include <string>
+#include <utility>
 #include <vector>
 //#include "HSLAPixel.h"
 #include "RGBAPixel.h"
 
 using namespace std;
 
+namespace lodepng {
+  class DecoderContext;
+  class EncoderContext;
+}
+
 namespace cs221util {
+  /**
+   * Options controlling how PNG::readFromFile decodes a file.
+   */
+  struct PNGReadOptions {
+    /**
+     * Skips chunk CRC and zlib Adler-32 verification. Only meant for files
+     * from a trusted producer; structurally broken files are still rejected.
+     */
+    bool trustedInput = false;
+
+    /**
+     * Memory kept between reads (Huffman tables, IDAT and scanline
+     * buffers), so a batch of files doesn't allocate it again for each one.
+     * Not owned; must not be shared by concurrent reads. nullptr allocates
+     * per read.
+     */
+    lodepng::DecoderContext * context = nullptr;
+  };
+
+  /**
+   * How the encoder picks the filter of each scanline.
+   */
+  enum class PNGFilterStrategy {
+    MinSum,     /*< Smallest sum of absolute values; lodepng's default */
+    Entropy,    /*< Smallest Shannon entropy */
+    BruteForce  /*< Trial-compresses every filter; slowest */
+  };
+
+  /**
+   * A chunk written into the file as it is, such as a private ancillary
+   * chunk carrying data of the program that wrote the image.
+   */
+  struct PNGChunk {
+    std::string type;  /*< 4 letters; their case gives the chunk's properties */
+    std::vector<unsigned char> data;
+  };
+
+  /**
+   * Options controlling how PNG::writeToFile encodes a file.
+   */
+  struct PNGWriteOptions {
+    /**
+     * zlib style compression level, from 0 (store, fastest) to 9 (smallest).
+     * 1 is greedy matching with a single hash probe; 6 is lodepng's default.
+     */
+    unsigned level = 6;
+
+    /**
+     * Lets the encoder switch to its run-length/row-repeat match finder when
+     * nearly every byte repeats its left or upper neighbour, as in rendered
+     * and upscaled QTree output. Other images are encoded as before.
+     */
+    bool autoRunLength = true;
+
+    /**
+     * Scanline filter selection. MinSum keeps lodepng's rule of not
+     * filtering palette images; Entropy and BruteForce filter those too.
+     * The filters are chosen on `threads` threads, with the same result as
+     * choosing them serially.
+     */
+    PNGFilterStrategy filter = PNGFilterStrategy::MinSum;
+
+    /**
+     * Number of threads used to choose filters and deflate the image data.
+     * Large images are compressed as independent blocks in parallel; 1
+     * encodes serially.
+     */
+    unsigned threads = 1;
+
+    /**
+     * Scratch memory kept between writes (hash tables, filter and scanline
+     * buffers), so a batch of images doesn't allocate it again for each one.
+     * Not owned; must not be shared by concurrent writes. nullptr allocates
+     * per write.
+     */
+    lodepng::EncoderContext * context = nullptr;
+
+    /**
+     * Extra chunks, written in order after PLTE/tRNS and before the image
+     * data, so readers find them without going past it. Not owned; nullptr
+     * writes none.
+     */
+    std::vector<PNGChunk> const * chunks = nullptr;
+  };
+
   class PNG {
   public:
     /**
@@ -73,6 +165,25 @@ namespace cs221util {
       */
     bool readFromFile(string const & fileName);
 
+    /**
+      * Reads in a PNG image from a file using the given decode options.
+      * Overwrites any current image content in the PNG.
+      * @param fileName Name of the file to be read from.
+      * @param options Decoder options, see PNGReadOptions.
+      * @return true, if the image was successfully read and loaded.
+      */
+    bool readFromFile(string const & fileName, PNGReadOptions const & options);
+
+    /**
+      * Decodes a PNG image from the contents of a PNG file that is already
+      * in memory. Overwrites any current image content in the PNG.
+      * @param fileData The bytes of the file.
+      * @param options Decoder options, see PNGReadOptions.
+      * @return true, if the image was successfully decoded.
+      */
+    bool readFromMemory(vector<unsigned char> const & fileData,
+                        PNGReadOptions const & options = PNGReadOptions());
+
     /**
       * Writes a PNG image to a file.
       * @param fileName Name of the file to be written.
@@ -80,6 +191,14 @@ namespace cs221util {
       */
     bool writeToFile(string const & fileName);
 
+    /**
+      * Writes a PNG image to a file using the given encode options.
+      * @param fileName Name of the file to be written.
+      * @param options Encoder options, see PNGWriteOptions.
+      * @return true, if the image was successfully written.
+      */
+    bool writeToFile(string const & fileName, PNGWriteOptions const & options) const;
+
     /**
       * Pixel access operator. Gets a pointer to the pixel at the given
       * coordinates in the image. (0,0) is the upper left corner.
@@ -128,6 +247,118 @@ namespace cs221util {
      void _copy(PNG const & other);
   };
 
+  /**
+    * Reads every file into the image at the same index, reusing one decoder
+    * context for the whole batch unless options already has one.
+    * @param fileNames Names of the files to be read from.
+    * @param images Receives one image per file name.
+    * @param options Decoder options, see PNGReadOptions.
+    * @return true, if every image was successfully read and loaded.
+    */
+  bool readFromFiles(vector<string> const & fileNames, vector<PNG> & images,
+                     PNGReadOptions const & options = PNGReadOptions());
+
+  /**
+    * Writes each image to the file name at the same index, reusing one
+    * encoder context for the whole batch unless options already has one.
+    * @param images The images to write.
+    * @param fileNames Names of the files to be written, one per image.
+    * @param options Encoder options, see PNGWriteOptions.
+    * @return true, if every image was successfully written.
+    */
+  bool writeToFiles(vector<PNG> const & images, vector<string> const & fileNames,
+                    PNGWriteOptions const & options = PNGWriteOptions());
+
+  /**
+    * Writes an image that is produced a row at a time instead of being held
+    * in memory: fill(y, row) stores the width pixels of row y, and is called
+    * for every y from 0 to height - 1, in order. Each row is filtered and
+    * compressed before the next one is asked for.
+    * @param fileName Name of the file to be written.
+    * @param width Width of the image.
+    * @param height Height of the image.
+    * @param alpha Whether to write RGBA; false writes RGB and ignores alpha.
+    * @param fill Stores the pixels of a row.
+    * @param options Encoder options, see PNGWriteOptions.
+    * @return true, if the image was successfully written.
+    */
+  bool writeRowsToFile(string const & fileName, unsigned int width, unsigned int height, bool alpha,
+                       std::function<void(unsigned int y, RGBAPixel * row)> const & fill,
+                       PNGWriteOptions const & options = PNGWriteOptions());
+
+  /**
+    * Like writeRowsToFile, for a palette image: fill(y, indices) stores one
+    * palette index per pixel of row y. As with writeIndexedToFile, PLTE/tRNS
+    * come straight from palette and the bit depth is the smallest that
+    * holds palette.size() entries.
+    * @param fileName Name of the file to be written.
+    * @param width Width of the image.
+    * @param height Height of the image.
+    * @param palette The colors, 1 to 256 of them.
+    * @param fill Stores the palette indices of a row.
+    * @param options Encoder options, see PNGWriteOptions.
+    * @return true, if the image was successfully written.
+    */
+  bool writeIndexedRowsToFile(string const & fileName, unsigned int width, unsigned int height,
+                              vector<RGBAPixel> const & palette,
+                              std::function<void(unsigned int y, unsigned char * indices)> const & fill,
+                              PNGWriteOptions const & options = PNGWriteOptions());
+
+  /**
+    * Like writeRowsToFile, but stores the encoded file in out instead of
+    * writing it, e.g. to write it later or elsewhere.
+    * @param out Receives the bytes of the PNG file, replacing its contents.
+    * @return true, if the image was successfully encoded.
+    */
+  bool encodeRows(vector<unsigned char> & out, unsigned int width, unsigned int height, bool alpha,
+                  std::function<void(unsigned int y, RGBAPixel * row)> const & fill,
+                  PNGWriteOptions const & options = PNGWriteOptions());
+
+  /**
+    * Like writeIndexedRowsToFile, but stores the encoded file in out.
+    * @param out Receives the bytes of the PNG file, replacing its contents.
+    * @return true, if the image was successfully encoded.
+    */
+  bool encodeIndexedRows(vector<unsigned char> & out, unsigned int width, unsigned int height,
+                         vector<RGBAPixel> const & palette,
+                         std::function<void(unsigned int y, unsigned char * indices)> const & fill,
+                         PNGWriteOptions const & options = PNGWriteOptions());
+
+  /**
+    * Writes bytes, such as those from encodeRows, to a file.
+    * @param fileData The bytes to be written.
+    * @param fileName Name of the file to be written.
+    * @return true, if the file was successfully written.
+    */
+  bool writeFile(vector<unsigned char> const & fileData, string const & fileName);
+
+  /**
+    * Writes a palette image without analyzing its colors: the PLTE (and,
+    * for translucent entries, tRNS) chunks come straight from palette, and
+    * the bit depth is the smallest that holds palette.size() entries.
+    * @param fileName Name of the file to be written.
+    * @param width Width of the image.
+    * @param height Height of the image.
+    * @param palette The colors, 1 to 256 of them.
+    * @param indices One palette index per pixel, row by row.
+    * @param options Encoder options, see PNGWriteOptions.
+    * @return true, if the image was successfully written.
+    */
+  bool writeIndexedToFile(string const & fileName, unsigned int width, unsigned int height,
+                          vector<RGBAPixel> const & palette, vector<unsigned char> const & indices,
+                          PNGWriteOptions const & options = PNGWriteOptions());
+
+  /**
+    * Finds the first chunk of the given type in a PNG file and copies its
+    * data. Only chunk headers are read on the way to it: other chunks,
+    * including the image data, are skipped without being decompressed.
+    * @param fileName Name of the file to be read.
+    * @param type The chunk type, 4 letters.
+    * @param data Receives the chunk data.
+    * @return true, if the chunk was found and its CRC is correct.
+    */
+  bool readChunkFromFile(string const & fileName, string const & type, vector<unsigned char> & data);
+
   std::ostream & operator<<(std::ostream & out, PNG const & pixel);
   std::stringstream & operator<<(std::stringstream & out, PNG const & pixel);
 }
@@ -7,6 +7,7 @@
  */
 
 #include "RGBAPixel.h"
+#include "Stats.h"
 #include <cmath>
 #include <iostream>
 using namespace std;
@@ -87,6 +88,8 @@ namespace cs221util {
    * @param other the other RGBAPixel to compare to this one
    */
   double RGBAPixel::distanceTo(RGBAPixel other) {
+      CS221_COUNT(distanceCalls, 1);
+
       // this pixel's color channels
       double r_this = (r / 255.0) * a;
       double g_this = (g / 255.0) * a;
@@ -0,0 +1,103 @@
+/**
+ * @file RangeCoder.cpp
+ * Implementation of the adaptive binary range coder.
+ */
+
+#include "RangeCoder.h"
+
+namespace cs221util {
+  static const unsigned kProbabilityBits = 11;
+  static const unsigned kAdaptShift = 5;
+  static const uint32_t kRangeTop = 1u << 24;
+
+  RangeEncoder::RangeEncoder(std::vector<unsigned char> & out)
+    : out_(out), low_(0), range_(0xFFFFFFFFu), cache_(0), cacheSize_(1) { }
+
+  void RangeEncoder::encodeBit(Probability & p, unsigned bit) {
+    uint32_t bound = (range_ >> kProbabilityBits) * p;
+    if (bit == 0) {
+      range_ = bound;
+      p += ((1u << kProbabilityBits) - p) >> kAdaptShift;
+    } else {
+      low_ += bound;
+      range_ -= bound;
+      p -= p >> kAdaptShift;
+    }
+    while (range_ < kRangeTop) {
+      range_ <<= 8;
+      shiftLow();
+    }
+  }
+
+  void RangeEncoder::encodeBitTree(Probability * probs, unsigned numBits, unsigned value) {
+    unsigned node = 1;
+    for (unsigned i = numBits; i-- > 0;) {
+      unsigned bit = (value >> i) & 1;
+      encodeBit(probs[node], bit);
+      node = (node << 1) | bit;
+    }
+  }
+
+  void RangeEncoder::finish() {
+    for (int i = 0; i < 5; i++) {
+      shiftLow();
+    }
+  }
+
+  // Emits the top byte of low_, holding back runs of 0xFF until it is known
+  // whether a carry will ripple into them
+  void RangeEncoder::shiftLow() {
+    if ((uint32_t)low_ < 0xFF000000u || (low_ >> 32) != 0) {
+      unsigned char carry = (unsigned char)(low_ >> 32);
+      unsigned char byte = cache_;
+      do {
+        out_.push_back((unsigned char)(byte + carry));
+        byte = 0xFF;
+      } while (--cacheSize_ != 0);
+      cache_ = (unsigned char)((uint32_t)low_ >> 24);
+    }
+    cacheSize_++;
+    low_ = (low_ & 0x00FFFFFFu) << 8;
+  }
+
+  RangeDecoder::RangeDecoder(const unsigned char * in, size_t size)
+    : in_(in), size_(size), pos_(0), range_(0xFFFFFFFFu), code_(0) {
+    for (int i = 0; i < 5; i++) {
+      code_ = (code_ << 8) | (pos_ < size_ ? in_[pos_] : 0);
+      pos_++;
+    }
+  }
+
+  unsigned RangeDecoder::decodeBit(Probability & p) {
+    uint32_t bound = (range_ >> kProbabilityBits) * p;
+    unsigned bit;
+    if (code_ < bound) {
+      range_ = bound;
+      p += ((1u << kProbabilityBits) - p) >> kAdaptShift;
+      bit = 0;
+    } else {
+      code_ -= bound;
+      range_ -= bound;
+      p -= p >> kAdaptShift;
+      bit = 1;
+    }
+    while (range_ < kRangeTop) {
+      range_ <<= 8;
+      code_ = (code_ << 8) | (pos_ < size_ ? in_[pos_] : 0);
+      pos_++;
+    }
+    return bit;
+  }
+
+  unsigned RangeDecoder::decodeBitTree(Probability * probs, unsigned numBits) {
+    unsigned node = 1;
+    for (unsigned i = 0; i < numBits; i++) {
+      node = (node << 1) | decodeBit(probs[node]);
+    }
+    return node - (1u << numBits);
+  }
+
+  bool RangeDecoder::overrun() const {
+    return pos_ > size_;
+  }
+}
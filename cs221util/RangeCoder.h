@@ -0,0 +1,90 @@
+/**
+ * @file RangeCoder.h
+ * Adaptive binary range coder, as used by LZMA.
+ *
+ * Every bit is coded with a Probability, owned by the caller, that adapts to
+ * the bits coded with it; giving each kind of bit its own Probability (its
+ * context) is what makes the coder compress.
+ */
+
+#ifndef CS221_RANGECODER_H_
+#define CS221_RANGECODER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace cs221util {
+  /** Probability that the next bit is 0, in 1/2048ths. */
+  typedef uint16_t Probability;
+
+  /** Initial value for every Probability: 0 and 1 equally likely. */
+  const Probability kProbabilityHalf = 1024;
+
+  class RangeEncoder {
+  public:
+    /**
+     * Creates an encoder that appends its output to out.
+     */
+    RangeEncoder(std::vector<unsigned char> & out);
+
+    /**
+     * Codes one bit in the context p, and adapts p to it.
+     */
+    void encodeBit(Probability & p, unsigned bit);
+
+    /**
+     * Codes the low numBits bits of value, most significant first; each bit
+     * is coded in the context of the bits above it, so probs must hold
+     * 1 << numBits Probabilities (probs[0] is not used).
+     */
+    void encodeBitTree(Probability * probs, unsigned numBits, unsigned value);
+
+    /**
+     * Writes out the remaining state. Must be called once, after the last bit.
+     */
+    void finish();
+
+  private:
+    void shiftLow();
+
+    std::vector<unsigned char> & out_;
+    uint64_t low_;
+    uint32_t range_;
+    unsigned char cache_;
+    uint64_t cacheSize_;
+  };
+
+  class RangeDecoder {
+  public:
+    /**
+     * Creates a decoder that reads the output of RangeEncoder from in.
+     */
+    RangeDecoder(const unsigned char * in, size_t size);
+
+    /**
+     * Decodes one bit in the context p, and adapts p to it.
+     */
+    unsigned decodeBit(Probability & p);
+
+    /**
+     * Decodes a value coded by RangeEncoder::encodeBitTree.
+     */
+    unsigned decodeBitTree(Probability * probs, unsigned numBits);
+
+    /**
+     * Whether the decoder has needed more bytes than it was given; the bits
+     * decoded since are not meaningful.
+     */
+    bool overrun() const;
+
+  private:
+    const unsigned char * in_;
+    size_t size_;
+    size_t pos_;
+    uint32_t range_;
+    uint32_t code_;
+  };
+}
+
+#endif
@@ -0,0 +1,94 @@
+/**
+ * @file Stats.cpp
+ * Implementation of the QTree and PNG I/O counters.
+ */
+
+#include "Stats.h"
+
+namespace cs221util {
+  Stats & Stats::operator+=(Stats const & other) {
+    nodesAllocated += other.nodesAllocated;
+    nodesPruned += other.nodesPruned;
+    validPruneVisits += other.validPruneVisits;
+    distanceCalls += other.distanceCalls;
+    pixelsRendered += other.pixelsRendered;
+    bytesInflated += other.bytesInflated;
+    bytesDeflated += other.bytesDeflated;
+    decodeNs += other.decodeNs;
+    buildNs += other.buildNs;
+    pruneNs += other.pruneNs;
+    renderNs += other.renderNs;
+    encodeNs += other.encodeNs;
+    return *this;
+  }
+
+  Stats Stats::operator-(Stats const & other) const {
+    Stats diff;
+    diff.nodesAllocated = nodesAllocated - other.nodesAllocated;
+    diff.nodesPruned = nodesPruned - other.nodesPruned;
+    diff.validPruneVisits = validPruneVisits - other.validPruneVisits;
+    diff.distanceCalls = distanceCalls - other.distanceCalls;
+    diff.pixelsRendered = pixelsRendered - other.pixelsRendered;
+    diff.bytesInflated = bytesInflated - other.bytesInflated;
+    diff.bytesDeflated = bytesDeflated - other.bytesDeflated;
+    diff.decodeNs = decodeNs - other.decodeNs;
+    diff.buildNs = buildNs - other.buildNs;
+    diff.pruneNs = pruneNs - other.pruneNs;
+    diff.renderNs = renderNs - other.renderNs;
+    diff.encodeNs = encodeNs - other.encodeNs;
+    return diff;
+  }
+
+  std::ostream & operator<<(std::ostream & out, Stats const & stats) {
+    out << "nodes allocated " << stats.nodesAllocated
+        << ", nodes pruned " << stats.nodesPruned
+        << ", ValidPrune leaf visits " << stats.validPruneVisits
+        << ", distanceTo calls " << stats.distanceCalls
+        << ", pixels rendered " << stats.pixelsRendered
+        << ", bytes inflated " << stats.bytesInflated
+        << ", bytes deflated " << stats.bytesDeflated
+        << "; ms: decode " << stats.decodeNs / 1e6
+        << ", build " << stats.buildNs / 1e6
+        << ", prune " << stats.pruneNs / 1e6
+        << ", render " << stats.renderNs / 1e6
+        << ", encode " << stats.encodeNs / 1e6;
+    return out;
+  }
+
+  bool statsEnabled() {
+#ifdef CS221_STATS
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  Stats & threadStats() {
+    static thread_local Stats stats;
+    return stats;
+  }
+
+  StatsScope::StatsScope() : start_(threadStats()) { }
+
+  // the innermost timer running on the calling thread
+  static thread_local ScopedTimer * currentTimer = nullptr;
+
+  ScopedTimer::ScopedTimer(unsigned long long Stats::* phase)
+    : phase_(phase), start_(std::chrono::steady_clock::now()), outer_(currentTimer), innerNs_(0) {
+    currentTimer = this;
+  }
+
+  ScopedTimer::~ScopedTimer() {
+    unsigned long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start_).count();
+    threadStats().*phase_ += ns - innerNs_;
+    if (outer_ != nullptr) {
+      outer_->innerNs_ += ns;
+    }
+    currentTimer = outer_;
+  }
+
+  Stats StatsScope::stats() const {
+    return threadStats() - start_;
+  }
+}
@@ -0,0 +1,125 @@
+/**
+ * @file Stats.h
+ * Counters and phase timers for QTree and PNG I/O.
+ *
+ * The library bumps the counters and times its phases with the CS221_COUNT
+ * and CS221_TIME macros. They are only compiled in when CS221_STATS is
+ * defined (e.g. -DCS221_STATS); otherwise they compile to nothing, their
+ * arguments are not evaluated, and the counters stay at zero.
+ *
+ * Counts go to the Stats of the thread doing the work. To see what one
+ * operation did, create a StatsScope before it and read stats() after:
+ *
+ *     cs221util::StatsScope scope;
+ *     tree.Prune(0.05);
+ *     cout << scope.stats() << endl;
+ */
+
+#ifndef CS221_STATS_H_
+#define CS221_STATS_H_
+
+#include <chrono>
+#include <iostream>
+
+namespace cs221util {
+  struct Stats {
+    /** Tree nodes created, by building, copying, loading or decoding. */
+    unsigned long long nodesAllocated = 0;
+    /** Tree nodes freed by Prune. */
+    unsigned long long nodesPruned = 0;
+    /** Leaves compared against a candidate color by Prune. */
+    unsigned long long validPruneVisits = 0;
+    /** Calls to RGBAPixel::distanceTo. */
+    unsigned long long distanceCalls = 0;
+    /** Pixels written by QTree rendering, including rows rendered for encoding. */
+    unsigned long long pixelsRendered = 0;
+    /** Bytes produced by zlib decompression. */
+    unsigned long long bytesInflated = 0;
+    /** Bytes given to zlib compression. */
+    unsigned long long bytesDeflated = 0;
+
+    /**
+     * Time spent in each phase, in nanoseconds. A phase timed within
+     * another, such as the rows EncodePNG renders while encoding, counts
+     * only towards the inner one.
+     */
+    unsigned long long decodeNs = 0;
+    unsigned long long buildNs = 0;
+    unsigned long long pruneNs = 0;
+    unsigned long long renderNs = 0;
+    unsigned long long encodeNs = 0;
+
+    Stats & operator+=(Stats const & other);
+    Stats operator-(Stats const & other) const;
+  };
+
+  /**
+   * Writes every field of stats on one line, times in ms.
+   */
+  std::ostream & operator<<(std::ostream & out, Stats const & stats);
+
+  /**
+   * Whether the library was built with CS221_STATS, i.e. whether the
+   * counters mean anything.
+   */
+  bool statsEnabled();
+
+  /**
+   * The counters of the calling thread, since it started.
+   */
+  Stats & threadStats();
+
+  /**
+   * Measures what the calling thread counts during the scope's lifetime.
+   */
+  class StatsScope {
+  public:
+    StatsScope();
+
+    /**
+     * What the calling thread has counted since the scope was created.
+     */
+    Stats stats() const;
+
+  private:
+    Stats start_;
+  };
+
+  /**
+   * Adds the time from its creation to its destruction to one phase of
+   * the calling thread's Stats, less the time of the timers created while
+   * it runs. Used through CS221_TIME.
+   */
+  class ScopedTimer {
+  public:
+    explicit ScopedTimer(unsigned long long Stats::* phase);
+    ~ScopedTimer();
+
+    ScopedTimer(ScopedTimer const &) = delete;
+    ScopedTimer & operator=(ScopedTimer const &) = delete;
+
+  private:
+    unsigned long long Stats::* phase_;
+    std::chrono::steady_clock::time_point start_;
+    ScopedTimer * outer_;            // the timer running when this one was created
+    unsigned long long innerNs_;     // time of the timers created while this one runs
+  };
+}
+
+#define CS221_STATS_CONCAT_(a, b) a##b
+#define CS221_STATS_CONCAT(a, b) CS221_STATS_CONCAT_(a, b)
+
+#ifdef CS221_STATS
+/** Adds n to the counter of the calling thread's Stats. */
+#define CS221_COUNT(counter, n) (cs221util::threadStats().counter += (n))
+/** Times the rest of the enclosing block as phase, e.g. CS221_TIME(pruneNs). */
+#define CS221_TIME(phase) \
+  cs221util::ScopedTimer CS221_STATS_CONCAT(cs221Timer, __LINE__)(&cs221util::Stats::phase)
+#else
+// sizeof keeps variables used only for counting from being reported as
+// unused, without evaluating n
+#define CS221_COUNT(counter, n) ((void)sizeof(n))
+#define CS221_TIME(phase) ((void)0)
+#endif
+
+#endif
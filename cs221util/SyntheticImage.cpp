@@ -0,0 +1,169 @@
+/**
+ * @file SyntheticImage.cpp
+ * Implementation of the deterministic test image generator.
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "SyntheticImage.h"
+
+namespace cs221util {
+  static const char * const kPatternNames[kSyntheticPatterns] = {
+    "flat", "gradient", "noise", "pixelart", "alpha", "mixed"
+  };
+
+  // Side of the blocks pixel art is drawn in, and of its sprites in blocks
+  static const unsigned kBlockSize = 4;
+  static const unsigned kSpriteBlocks = 16;
+
+  // Side of the tiles of kSyntheticAlpha
+  static const unsigned kAlphaTile = 32;
+
+  static unsigned char clampByte(int value) {
+    return (unsigned char)std::min(255, std::max(0, value));
+  }
+
+  SyntheticImage::SyntheticImage(SyntheticPattern pattern, unsigned int width, unsigned int height,
+                                 double entropy, uint32_t seed)
+    : pattern_(pattern), width_(width), height_(height),
+      entropy_(std::min(1.0, std::max(0.0, entropy))), seed_(seed), hasAlpha_(pattern == kSyntheticAlpha) {
+    // from the whole image at entropy 0 down to single pixels at entropy 1
+    double largest = std::max(width, height);
+    flatSize_ = std::max(1u, (unsigned)std::lround(std::pow(largest, 1 - entropy_)));
+    if (pattern == kSyntheticMixed) {
+      for (unsigned region = 0; region < 9; region++) {
+        hasAlpha_ = hasAlpha_ || regionPattern(region) == kSyntheticAlpha;
+      }
+    }
+  }
+
+  unsigned int SyntheticImage::width() const {
+    return width_;
+  }
+
+  unsigned int SyntheticImage::height() const {
+    return height_;
+  }
+
+  bool SyntheticImage::hasAlpha() const {
+    return hasAlpha_;
+  }
+
+  RGBAPixel SyntheticImage::pixel(unsigned int x, unsigned int y) const {
+    if (pattern_ != kSyntheticMixed) {
+      return patternPixel(pattern_, x, y);
+    }
+    // the region boundaries fall at thirds, which are rarely where the
+    // tree splits
+    unsigned region = (unsigned)(3ull * x / width_ + 3 * (3ull * y / height_));
+    return patternPixel(regionPattern(region), x, y);
+  }
+
+  void SyntheticImage::fillRow(unsigned int y, RGBAPixel * row) const {
+    for (unsigned int x = 0; x < width_; x++) {
+      row[x] = pixel(x, y);
+    }
+  }
+
+  PNG SyntheticImage::render() const {
+    PNG img(width_, height_);
+    for (unsigned int y = 0; y < height_; y++) {
+      fillRow(y, img.getPixel(0, y));
+    }
+    return img;
+  }
+
+  bool SyntheticImage::writeToFile(std::string const & fileName, PNGWriteOptions const & options) const {
+    return writeRowsToFile(fileName, width_, height_, hasAlpha(),
+                           [this](unsigned int y, RGBAPixel * row) { fillRow(y, row); }, options);
+  }
+
+  const char * SyntheticImage::patternName(SyntheticPattern pattern) {
+    return pattern < kSyntheticPatterns ? kPatternNames[pattern] : "";
+  }
+
+  bool SyntheticImage::parsePattern(std::string const & name, SyntheticPattern & pattern) {
+    for (int i = 0; i < kSyntheticPatterns; i++) {
+      if (name == kPatternNames[i]) {
+        pattern = (SyntheticPattern)i;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  RGBAPixel SyntheticImage::patternPixel(SyntheticPattern pattern, unsigned int x, unsigned int y) const {
+    switch (pattern) {
+      case kSyntheticFlat: {
+        uint32_t h = hash(x / flatSize_, y / flatSize_, 1);
+        return RGBAPixel(h & 0xFF, (h >> 8) & 0xFF, (h >> 16) & 0xFF);
+      }
+      case kSyntheticGradient: {
+        int amplitude = (int)std::lround(entropy_ * 64);
+        uint32_t h = hash(x, y, 2);
+        int noise = amplitude == 0 ? 0 : (int)(h % (2 * amplitude + 1)) - amplitude;
+        uint64_t w = std::max(1u, width_ - 1), hgt = std::max(1u, height_ - 1);
+        return RGBAPixel(clampByte((int)(255 * x / w) + noise),
+                         clampByte((int)(255 * y / hgt) + noise),
+                         clampByte((int)(255 * ((uint64_t)x + y) / (w + hgt)) - noise));
+      }
+      case kSyntheticNoise: {
+        uint32_t h = hash(x, y, 3);
+        return RGBAPixel(128 + (int)std::lround(((int)(h & 0xFF) - 128) * entropy_),
+                         128 + (int)std::lround(((int)((h >> 8) & 0xFF) - 128) * entropy_),
+                         128 + (int)std::lround(((int)((h >> 16) & 0xFF) - 128) * entropy_));
+      }
+      case kSyntheticPixelArt: {
+        unsigned colors = 2 + (unsigned)std::lround(entropy_ * 14);
+        unsigned bx = x / kBlockSize, by = y / kBlockSize;
+        uint32_t sprite = hash(bx / kSpriteBlocks, by / kSpriteBlocks, 4) % 8;
+        // sprites are mirrored left to right
+        unsigned lx = bx % kSpriteBlocks, ly = by % kSpriteBlocks;
+        lx = std::min(lx, kSpriteBlocks - 1 - lx);
+        uint32_t h = hash(sprite, lx, ly);
+        unsigned index = h % 100 < 30 + entropy_ * 50 ? 1 + (h >> 8) % (colors - 1) : 0;
+        uint32_t color = hash(index, 0, 5);
+        return RGBAPixel(color & 0xFF, (color >> 8) & 0xFF, (color >> 16) & 0xFF);
+      }
+      case kSyntheticAlpha: {
+        RGBAPixel p = patternPixel(kSyntheticGradient, x, y);
+        uint32_t kind = hash(x / kAlphaTile, y / kAlphaTile, 6) % 3;
+        if (kind == 1) {
+          return RGBAPixel(0, 0, 0, 0);
+        } else if (kind == 2) {
+          // a ramp across the tile, noisier with entropy
+          int alpha = (int)((x % kAlphaTile + y % kAlphaTile) * 255 / (2 * kAlphaTile - 2));
+          int amplitude = (int)std::lround(entropy_ * 64);
+          if (amplitude > 0) {
+            alpha += (int)(hash(x, y, 7) % (2 * amplitude + 1)) - amplitude;
+          }
+          p.a = clampByte(alpha) / 255.;
+        }
+        return p;
+      }
+      default:
+        return RGBAPixel();
+    }
+  }
+
+  // The pattern of region (0 to 8, row by row) of a kSyntheticMixed image
+  SyntheticPattern SyntheticImage::regionPattern(unsigned region) const {
+    return (SyntheticPattern)(hash(region, 0, 8) % kSyntheticMixed);
+  }
+
+  // A well mixed 32-bit hash of (a, b, c) and the seed
+  uint32_t SyntheticImage::hash(uint32_t a, uint32_t b, uint32_t c) const {
+    uint32_t h = seed_ * 0x9E3779B1u;
+    const uint32_t values[] = { a, b, c };
+    for (uint32_t v : values) {
+      h ^= v + 0x7F4A7C15u + (h << 6) + (h >> 2);
+      h ^= h >> 16;
+      h *= 0x85EBCA6Bu;
+      h ^= h >> 13;
+      h *= 0xC2B2AE35u;
+      h ^= h >> 16;
+    }
+    return h;
+  }
+}
@@ -0,0 +1,115 @@
+/**
+ * @file SyntheticImage.h
+ * Deterministic generated test images, for benchmarks and stress tests.
+ *
+ * Every pixel is a pure function of its coordinates, the pattern, the
+ * entropy and the seed, so an image can be produced a row or a region at a
+ * time: images far too large to hold as a PNG (up to 32768 x 32768) can be
+ * streamed straight to a file, and the same image comes out on every run
+ * and every machine.
+ */
+
+#ifndef CS221_SYNTHETICIMAGE_H_
+#define CS221_SYNTHETICIMAGE_H_
+
+#include <cstdint>
+#include <string>
+
+#include "PNG.h"
+#include "RGBAPixel.h"
+
+namespace cs221util {
+  /** What a SyntheticImage looks like. */
+  enum SyntheticPattern {
+    /** Solid rectangles; entropy shrinks them from the whole image to single pixels. */
+    kSyntheticFlat,
+    /** Smooth color ramps, with entropy as the amplitude of added noise. */
+    kSyntheticGradient,
+    /** Independent random pixels, with entropy as their spread around grey. */
+    kSyntheticNoise,
+    /** Mirrored sprites of 4x4 blocks on a small palette, like kkkk_nnkm; entropy adds colors and detail. */
+    kSyntheticPixelArt,
+    /** Tiles that are opaque, fully transparent or partially transparent. */
+    kSyntheticAlpha,
+    /** A 3x3 grid of regions, each in one of the patterns above. */
+    kSyntheticMixed,
+    kSyntheticPatterns
+  };
+
+  /** The largest width and height a SyntheticImage may have. */
+  const unsigned int kSyntheticMaxSize = 32768;
+
+  class SyntheticImage {
+  public:
+    /**
+     * Describes a width x height image. Nothing is generated until pixels
+     * are asked for.
+     * @param entropy How much detail, from 0 (flattest) to 1 (noisiest).
+     * @param seed Different seeds give different images of the same kind.
+     * @pre 0 < width, height <= kSyntheticMaxSize
+     */
+    SyntheticImage(SyntheticPattern pattern, unsigned int width, unsigned int height,
+                   double entropy = 0.5, uint32_t seed = 1);
+
+    unsigned int width() const;
+    unsigned int height() const;
+
+    /**
+     * Whether the image may have pixels that are not fully opaque; if
+     * false, none are.
+     */
+    bool hasAlpha() const;
+
+    /**
+     * The pixel at (x, y).
+     */
+    RGBAPixel pixel(unsigned int x, unsigned int y) const;
+
+    /**
+     * Stores row y in row[0 .. width() - 1]; has the signature
+     * writeRowsToFile and encodeRows expect of fill.
+     */
+    void fillRow(unsigned int y, RGBAPixel * row) const;
+
+    /**
+     * The whole image, for sizes that fit in memory.
+     */
+    PNG render() const;
+
+    /**
+     * Writes the image to a PNG file a row at a time, so only one row of
+     * pixels is held at once (the compressed file is still built in memory).
+     * @return true, if the image was successfully written.
+     */
+    bool writeToFile(std::string const & fileName,
+                     PNGWriteOptions const & options = PNGWriteOptions()) const;
+
+    /**
+     * The name of pattern, as used on command lines: flat, gradient, noise,
+     * pixelart, alpha or mixed.
+     */
+    static const char * patternName(SyntheticPattern pattern);
+
+    /**
+     * The pattern called name.
+     * @return false if there is none.
+     */
+    static bool parsePattern(std::string const & name, SyntheticPattern & pattern);
+
+  private:
+    RGBAPixel patternPixel(SyntheticPattern pattern, unsigned int x, unsigned int y) const;
+    SyntheticPattern regionPattern(unsigned region) const;
+    uint32_t hash(uint32_t a, uint32_t b, uint32_t c) const;
+
+    SyntheticPattern pattern_;
+    unsigned int width_;
+    unsigned int height_;
+    double entropy_;
+    uint32_t seed_;
+    // side of the rectangles of kSyntheticFlat
+    unsigned int flatSize_;
+    bool hasAlpha_;
+  };
+}
+
+#endif
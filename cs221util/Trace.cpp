@@ -0,0 +1,144 @@
+/**
+ * @file Trace.cpp
+ * Implementation of the Chrome trace-event recorder.
+ */
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "Trace.h"
+
+namespace cs221util {
+  typedef std::chrono::steady_clock Clock;
+
+  namespace {
+    struct TraceEvent {
+      const char * name;
+      Clock::time_point start;
+      Clock::time_point end;
+    };
+
+    // The events of one thread. Only that thread appends to events; the
+    // buffer outlives the thread, so its events can be written after it
+    // exits. The next thread to start then appends to it, under the same
+    // tid, so threads started for every encode don't add a buffer each
+    struct ThreadBuffer {
+      unsigned tid;
+      const char * name = nullptr;
+      std::vector<TraceEvent> events;
+    };
+
+    // Hands the calling thread's buffer back when the thread exits
+    struct BufferOwner {
+      ThreadBuffer * buffer = nullptr;
+      ~BufferOwner();
+    };
+
+    std::atomic<bool> active(false);
+    Clock::time_point epoch = Clock::now();
+
+    // Every thread's buffer; the lock is only taken when a thread records
+    // its first event, and to start or write a trace
+    std::mutex buffersLock;
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+    // the buffers of exited threads, so there are only ever as many
+    // buffers as threads have recorded at the same time
+    std::vector<ThreadBuffer *> freeBuffers;
+
+    BufferOwner::~BufferOwner() {
+      if (buffer != nullptr) {
+        std::lock_guard<std::mutex> lock(buffersLock);
+        freeBuffers.push_back(buffer);
+      }
+    }
+
+    ThreadBuffer & threadBuffer() {
+      static thread_local BufferOwner owner;
+      if (owner.buffer == nullptr) {
+        std::lock_guard<std::mutex> lock(buffersLock);
+        if (!freeBuffers.empty()) {
+          owner.buffer = freeBuffers.back();
+          freeBuffers.pop_back();
+        } else {
+          buffers.emplace_back(new ThreadBuffer);
+          owner.buffer = buffers.back().get();
+          owner.buffer->tid = buffers.size();
+          owner.buffer->events.reserve(256);
+        }
+      }
+      return *owner.buffer;
+    }
+
+    double micros(Clock::time_point time) {
+      return std::chrono::duration<double, std::micro>(time - epoch).count();
+    }
+  }
+
+  bool traceCompiled() {
+#ifdef CS221_TRACING
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  void traceStart() {
+    std::lock_guard<std::mutex> lock(buffersLock);
+    for (std::unique_ptr<ThreadBuffer> & buffer : buffers) {
+      buffer->events.clear();
+    }
+    epoch = Clock::now();
+    active.store(true, std::memory_order_release);
+  }
+
+  void traceStop() {
+    active.store(false, std::memory_order_release);
+  }
+
+  bool traceActive() {
+    return active.load(std::memory_order_relaxed);
+  }
+
+  void traceThreadName(const char * name) {
+    threadBuffer().name = name;
+  }
+
+  bool traceWrite(std::string const & fileName) {
+    std::ofstream out(fileName);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    const char * separator = "\n";
+    char line[512];
+    std::lock_guard<std::mutex> lock(buffersLock);
+    for (std::unique_ptr<ThreadBuffer> & buffer : buffers) {
+      if (buffer->name != nullptr) {
+        snprintf(line, sizeof(line), "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, "
+                 "\"args\": {\"name\": \"%s\"}}", separator, buffer->tid, buffer->name);
+        out << line;
+        separator = ",\n";
+      }
+      for (TraceEvent const & event : buffer->events) {
+        snprintf(line, sizeof(line), "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, "
+                 "\"ts\": %.3f, \"dur\": %.3f}", separator, event.name, buffer->tid,
+                 micros(event.start), micros(event.end) - micros(event.start));
+        out << line;
+        separator = ",\n";
+      }
+    }
+    out << "\n]}\n";
+    return (bool)out;
+  }
+
+  TraceScope::TraceScope(const char * name)
+    : name_(traceActive() ? name : nullptr), start_(name_ != nullptr ? Clock::now() : Clock::time_point()) { }
+
+  TraceScope::~TraceScope() {
+    if (name_ != nullptr) {
+      TraceEvent event = { name_, start_, Clock::now() };
+      threadBuffer().events.push_back(event);
+    }
+  }
+}
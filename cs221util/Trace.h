@@ -0,0 +1,93 @@
+/**
+ * @file Trace.h
+ * Timeline tracing of QTree, PNG and lodepng work, written as Chrome
+ * trace-event JSON (open it in Perfetto or chrome://tracing).
+ *
+ * The library marks its phases with CS221_TRACE, which records one event
+ * from there to the end of the enclosing block. It is only compiled in when
+ * CS221_TRACING is defined (e.g. -DCS221_TRACING); otherwise it compiles to
+ * nothing. Compiled in, events are only recorded between traceStart() and
+ * traceStop():
+ *
+ *     cs221util::traceStart();
+ *     ... work on any number of threads ...
+ *     cs221util::traceStop();
+ *     cs221util::traceWrite("trace.json");
+ *
+ * Each thread records into a buffer of its own, so recording takes no lock
+ * and threads do not contend. A thread that starts after another has exited
+ * takes over its buffer and tid, so the trace has as many threads as were
+ * recording at once, however many were started.
+ */
+
+#ifndef CS221_TRACE_H_
+#define CS221_TRACE_H_
+
+#include <chrono>
+#include <string>
+
+namespace cs221util {
+  /**
+   * Whether the library was built with CS221_TRACING, i.e. whether traces
+   * will have any events.
+   */
+  bool traceCompiled();
+
+  /**
+   * Drops the events recorded so far and starts recording.
+   * @pre no thread is recording events, e.g. all traced threads are joined
+   */
+  void traceStart();
+
+  /**
+   * Stops recording; events already begun are still recorded when they end.
+   */
+  void traceStop();
+
+  /**
+   * Whether events are being recorded.
+   */
+  bool traceActive();
+
+  /**
+   * Names the calling thread in the trace, e.g. after the pipeline stage it
+   * runs. name must outlive the trace, e.g. be a string literal.
+   */
+  void traceThreadName(const char * name);
+
+  /**
+   * Writes the recorded events to a Chrome trace-event JSON file.
+   * @pre no thread is recording events
+   * @return true, if the file was successfully written.
+   */
+  bool traceWrite(std::string const & fileName);
+
+  /**
+   * Records an event named name from its creation to its destruction, if
+   * tracing was active at its creation. Used through CS221_TRACE.
+   */
+  class TraceScope {
+  public:
+    explicit TraceScope(const char * name);
+    ~TraceScope();
+
+    TraceScope(TraceScope const &) = delete;
+    TraceScope & operator=(TraceScope const &) = delete;
+
+  private:
+    const char * name_;
+    std::chrono::steady_clock::time_point start_;
+  };
+}
+
+#define CS221_TRACE_CONCAT_(a, b) a##b
+#define CS221_TRACE_CONCAT(a, b) CS221_TRACE_CONCAT_(a, b)
+
+#ifdef CS221_TRACING
+/** Records the rest of the enclosing block as an event; name must outlive the trace. */
+#define CS221_TRACE(name) cs221util::TraceScope CS221_TRACE_CONCAT(cs221Trace, __LINE__)(name)
+#else
+#define CS221_TRACE(name) ((void)0)
+#endif
+
+#endif
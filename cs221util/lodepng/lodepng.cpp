@@ -30,10 +30,36 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 
 #include "lodepng.h"
 
+#ifdef __cplusplus
+#include "../Memory.h"
+#include "../Stats.h"
+#include "../Trace.h"
+#else /*__cplusplus*/
+/*the counters, timeline tracing and memory accounting of cs221util are C++, built as C they are off*/
+#define CS221_COUNT(counter, n) ((void)sizeof(n))
+#define CS221_TRACE(name) ((void)0)
+#define CS221_MEMORY_ALLOC(category, bytes) ((void)sizeof(bytes))
+#define CS221_MEMORY_FREE(category, bytes) ((void)sizeof(bytes))
+#endif /*__cplusplus*/
+
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#if defined(LODEPNG_COMPILE_ALLOCATORS) && defined(CS221_MEMORY)
+#include <malloc.h> /*malloc_usable_size*/
+#endif
+
+#ifdef LODEPNG_COMPILE_THREADS
+#include <atomic>
+#include <thread>
+#include <vector>
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+#ifdef LODEPNG_COMPILE_SIMD
+#include <immintrin.h>
+#endif /*LODEPNG_COMPILE_SIMD*/
+
 #if defined(_MSC_VER) && (_MSC_VER >= 1310) /*Visual Studio: A few warning types are not desired here.*/
 #pragma warning( disable : 4244 ) /*implicit conversions: not warned by gcc -Wall -Wextra and requires too much casts*/
 #pragma warning( disable : 4996 ) /*VS does not like fopen, but fopen_s is not standard C so unusable here*/
@@ -60,6 +86,34 @@ lodepng source code. Don't forget to remove "static" if you copypaste them
 from here.*/
 
 #ifdef LODEPNG_COMPILE_ALLOCATORS
+#ifdef CS221_MEMORY
+/*With memory accounting (cs221util/Memory.h), the size of a block is what malloc_usable_size gives for it,
+so blocks are plain malloc blocks that callers of the C API may still release with free(). Those are then
+never reported freed.*/
+static void* lodepng_malloc(size_t size)
+{
+  void* ptr = malloc(size);
+  if(ptr) CS221_MEMORY_ALLOC(kMemoryLodepng, malloc_usable_size(ptr));
+  return ptr;
+}
+
+static void* lodepng_realloc(void* ptr, size_t new_size)
+{
+  size_t old_size = ptr ? malloc_usable_size(ptr) : 0;
+  void* result = realloc(ptr, new_size);
+  if(!result) return 0; /*the old block is still valid and accounted for*/
+  CS221_MEMORY_FREE(kMemoryLodepng, old_size);
+  CS221_MEMORY_ALLOC(kMemoryLodepng, malloc_usable_size(result));
+  return result;
+}
+
+static void lodepng_free(void* ptr)
+{
+  if(!ptr) return;
+  CS221_MEMORY_FREE(kMemoryLodepng, malloc_usable_size(ptr));
+  free(ptr);
+}
+#else /*CS221_MEMORY*/
 static void* lodepng_malloc(size_t size)
 {
   return malloc(size);
@@ -74,6 +128,7 @@ static void lodepng_free(void* ptr)
 {
   free(ptr);
 }
+#endif /*CS221_MEMORY*/
 #else /*LODEPNG_COMPILE_ALLOCATORS*/
 void* lodepng_malloc(size_t size);
 void* lodepng_realloc(void* ptr, size_t new_size);
@@ -374,6 +429,7 @@ static unsigned lodepng_buffer_file(unsigned char* out, size_t size, const char*
 {
   FILE* file;
   size_t readsize;
+  CS221_TRACE("lodepng::load_file");
   file = fopen(filename, "rb");
   if(!file) return 78;
 
@@ -400,6 +456,7 @@ unsigned lodepng_load_file(unsigned char** out, size_t* outsize, const char* fil
 unsigned lodepng_save_file(const unsigned char* buffer, size_t buffersize, const char* filename)
 {
   FILE* file;
+  CS221_TRACE("lodepng::save_file");
   file = fopen(filename, "wb" );
   if(!file) return 79;
   fwrite((char*)buffer , 1 , buffersize, file);
@@ -438,6 +495,36 @@ static void addBitsToStreamReversed(size_t* bitpointer, ucvector* bitstream, uns
   size_t i;
   for(i = 0; i != nbits; ++i) addBitToStream(bitpointer, bitstream, (unsigned char)((value >> (nbits - 1 - i)) & 1));
 }
+
+#ifdef LODEPNG_COMPILE_THREADS
+/*appends the first nbits bits of another bitstream (as made by addBitToStream) at the bitpointer.
+Unused high bits of the last byte of bits must be zero. Return value is error code.*/
+static unsigned addBitStreamToStream(size_t* bitpointer, ucvector* bitstream,
+                                     const unsigned char* bits, size_t nbits)
+{
+  size_t i;
+  size_t numbytes = (nbits + 7) / 8;
+  unsigned shift = (unsigned)((*bitpointer) & 7);
+  if(shift == 0)
+  {
+    size_t oldsize = bitstream->size;
+    if(!ucvector_resize(bitstream, oldsize + numbytes)) return 83; /*alloc fail*/
+    for(i = 0; i != numbytes; ++i) bitstream->data[oldsize + i] = bits[i];
+  }
+  else
+  {
+    for(i = 0; i != numbytes; ++i)
+    {
+      bitstream->data[bitstream->size - 1] |= (unsigned char)(bits[i] << shift);
+      if(!ucvector_push_back(bitstream, (unsigned char)(bits[i] >> (8 - shift)))) return 83; /*alloc fail*/
+    }
+  }
+  *bitpointer += nbits;
+  /*drop the possibly empty byte pushed for the final partial byte*/
+  if(!ucvector_resize(bitstream, (*bitpointer + 7) / 8)) return 83; /*alloc fail*/
+  return 0;
+}
+#endif /*LODEPNG_COMPILE_THREADS*/
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_DECODER
@@ -513,6 +600,7 @@ typedef struct HuffmanTree
   unsigned* lengths; /*the lengths of the codes of the 1d-tree*/
   unsigned maxbitlen; /*maximum number of bits a single code can get*/
   unsigned numcodes; /*number of symbols in the alphabet = number of codes*/
+  size_t capacity; /*number of codes the arrays have room for, so a tree can be rebuilt in place*/
 } HuffmanTree;
 
 /*function used for debug purposes to draw the tree in ascii art with C++*/
@@ -533,6 +621,7 @@ static void HuffmanTree_init(HuffmanTree* tree)
   tree->tree2d = 0;
   tree->tree1d = 0;
   tree->lengths = 0;
+  tree->capacity = 0;
 }
 
 static void HuffmanTree_cleanup(HuffmanTree* tree)
@@ -542,16 +631,28 @@ static void HuffmanTree_cleanup(HuffmanTree* tree)
   lodepng_free(tree->lengths);
 }
 
-/*the tree representation used by the decoder. return value is error*/
+/*makes room for numcodes codes in all arrays of the tree. Arrays that are already big enough are kept,
+so rebuilding a tree for every deflate block doesn't allocate. The contents are not preserved.*/
+static unsigned HuffmanTree_reserve(HuffmanTree* tree, size_t numcodes)
+{
+  if(numcodes <= tree->capacity) return 0;
+  HuffmanTree_cleanup(tree);
+  HuffmanTree_init(tree);
+  tree->tree2d = (unsigned*)lodepng_malloc(numcodes * 2 * sizeof(unsigned));
+  tree->tree1d = (unsigned*)lodepng_malloc(numcodes * sizeof(unsigned));
+  tree->lengths = (unsigned*)lodepng_malloc(numcodes * sizeof(unsigned));
+  if(!tree->tree2d || !tree->tree1d || !tree->lengths) return 83; /*alloc fail*/
+  tree->capacity = numcodes;
+  return 0;
+}
+
+/*the tree representation used by the decoder. The arrays must have room for numcodes codes. return value is error*/
 static unsigned HuffmanTree_make2DTree(HuffmanTree* tree)
 {
   unsigned nodefilled = 0; /*up to which node it is filled*/
   unsigned treepos = 0; /*position in the tree (1 of the numcodes columns)*/
   unsigned n, i;
 
-  tree->tree2d = (unsigned*)lodepng_malloc(tree->numcodes * 2 * sizeof(unsigned));
-  if(!tree->tree2d) return 83; /*alloc fail*/
-
   /*
   convert tree1d[] to tree2d[][]. In the 2D array, a value of 32767 means
   uninited, a value >= numcodes is an address to another bit, a value < numcodes
@@ -605,7 +706,8 @@ static unsigned HuffmanTree_make2DTree(HuffmanTree* tree)
 
 /*
 Second step for the ...makeFromLengths and ...makeFromFrequencies functions.
-numcodes, lengths and maxbitlen must already be filled in correctly. return
+numcodes, lengths and maxbitlen must already be filled in correctly, and the
+arrays must have room for numcodes codes (see HuffmanTree_reserve). return
 value is error.
 */
 static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree)
@@ -618,9 +720,6 @@ static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree)
   uivector_init(&blcount);
   uivector_init(&nextcode);
 
-  tree->tree1d = (unsigned*)lodepng_malloc(tree->numcodes * sizeof(unsigned));
-  if(!tree->tree1d) error = 83; /*alloc fail*/
-
   if(!uivector_resizev(&blcount, tree->maxbitlen + 1, 0)
   || !uivector_resizev(&nextcode, tree->maxbitlen + 1, 0))
     error = 83; /*alloc fail*/
@@ -657,8 +756,8 @@ static unsigned HuffmanTree_makeFromLengths(HuffmanTree* tree, const unsigned* b
                                             size_t numcodes, unsigned maxbitlen)
 {
   unsigned i;
-  tree->lengths = (unsigned*)lodepng_malloc(numcodes * sizeof(unsigned));
-  if(!tree->lengths) return 83; /*alloc fail*/
+  unsigned error = HuffmanTree_reserve(tree, numcodes);
+  if(error) return error;
   for(i = 0; i != numcodes; ++i) tree->lengths[i] = bitlen[i];
   tree->numcodes = (unsigned)numcodes; /*number of symbols*/
   tree->maxbitlen = maxbitlen;
@@ -883,8 +982,8 @@ static unsigned HuffmanTree_makeFromFrequencies(HuffmanTree* tree, const unsigne
   while(!frequencies[numcodes - 1] && numcodes > mincodes) --numcodes; /*trim zeroes*/
   tree->maxbitlen = maxbitlen;
   tree->numcodes = (unsigned)numcodes; /*number of symbols*/
-  tree->lengths = (unsigned*)lodepng_realloc(tree->lengths, numcodes * sizeof(unsigned));
-  if(!tree->lengths) return 83; /*alloc fail*/
+  error = HuffmanTree_reserve(tree, numcodes);
+  if(error) return error;
   /*initialize all lengths to 0*/
   memset(tree->lengths, 0, numcodes * sizeof(unsigned));
 
@@ -979,8 +1078,9 @@ static void getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d)
   generateFixedDistanceTree(tree_d);
 }
 
-/*get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree*/
-static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
+/*get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree,
+which is built in tree_cl*/
+static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d, HuffmanTree* tree_cl,
                                       const unsigned char* in, size_t* bp, size_t inlength)
 {
   /*make sure that length values that aren't filled in will be 0, or a wrong tree will be generated*/
@@ -989,11 +1089,10 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   size_t inbitlength = inlength * 8;
 
   /*see comments in deflateDynamic for explanation of the context and these variables, it is analogous*/
-  unsigned* bitlen_ll = 0; /*lit,len code lengths*/
-  unsigned* bitlen_d = 0; /*dist code lengths*/
+  unsigned bitlen_ll[NUM_DEFLATE_CODE_SYMBOLS]; /*lit,len code lengths*/
+  unsigned bitlen_d[NUM_DISTANCE_SYMBOLS]; /*dist code lengths*/
   /*code length code lengths ("clcl"), the bit lengths of the huffman tree used to compress bitlen_ll and bitlen_d*/
-  unsigned* bitlen_cl = 0;
-  HuffmanTree tree_cl; /*the code tree for code length codes (the huffman tree for compressed huffman trees)*/
+  unsigned bitlen_cl[NUM_CODE_LENGTH_CODES];
 
   if((*bp) + 14 > (inlength << 3)) return 49; /*error: the bit pointer is or will go past the memory*/
 
@@ -1006,28 +1105,20 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 
   if((*bp) + HCLEN * 3 > (inlength << 3)) return 50; /*error: the bit pointer is or will go past the memory*/
 
-  HuffmanTree_init(&tree_cl);
-
   while(!error)
   {
     /*read the code length codes out of 3 * (amount of code length codes) bits*/
 
-    bitlen_cl = (unsigned*)lodepng_malloc(NUM_CODE_LENGTH_CODES * sizeof(unsigned));
-    if(!bitlen_cl) ERROR_BREAK(83 /*alloc fail*/);
-
     for(i = 0; i != NUM_CODE_LENGTH_CODES; ++i)
     {
       if(i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = readBitsFromStream(bp, in, 3);
       else bitlen_cl[CLCL_ORDER[i]] = 0; /*if not, it must stay 0*/
     }
 
-    error = HuffmanTree_makeFromLengths(&tree_cl, bitlen_cl, NUM_CODE_LENGTH_CODES, 7);
+    error = HuffmanTree_makeFromLengths(tree_cl, bitlen_cl, NUM_CODE_LENGTH_CODES, 7);
     if(error) break;
 
     /*now we can use this tree to read the lengths for the tree that this function will return*/
-    bitlen_ll = (unsigned*)lodepng_malloc(NUM_DEFLATE_CODE_SYMBOLS * sizeof(unsigned));
-    bitlen_d = (unsigned*)lodepng_malloc(NUM_DISTANCE_SYMBOLS * sizeof(unsigned));
-    if(!bitlen_ll || !bitlen_d) ERROR_BREAK(83 /*alloc fail*/);
     for(i = 0; i != NUM_DEFLATE_CODE_SYMBOLS; ++i) bitlen_ll[i] = 0;
     for(i = 0; i != NUM_DISTANCE_SYMBOLS; ++i) bitlen_d[i] = 0;
 
@@ -1035,7 +1126,7 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
     i = 0;
     while(i < HLIT + HDIST)
     {
-      unsigned code = huffmanDecodeSymbol(in, bp, &tree_cl, inbitlength);
+      unsigned code = huffmanDecodeSymbol(in, bp, tree_cl, inbitlength);
       if(code <= 15) /*a length code*/
       {
         if(i < HLIT) bitlen_ll[i] = code;
@@ -1119,33 +1210,73 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
     break; /*end of error-while*/
   }
 
-  lodepng_free(bitlen_cl);
-  lodepng_free(bitlen_ll);
-  lodepng_free(bitlen_d);
-  HuffmanTree_cleanup(&tree_cl);
-
   return error;
 }
 
+/*the Huffman trees of the inflator. They are rebuilt for every block, in place.*/
+typedef struct InflateTrees
+{
+  HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
+  HuffmanTree tree_d; /*the huffman tree for distance codes*/
+  HuffmanTree tree_cl; /*the huffman tree for the code lengths of a dynamic block*/
+} InflateTrees;
+
+static void InflateTrees_init(InflateTrees* trees)
+{
+  HuffmanTree_init(&trees->tree_ll);
+  HuffmanTree_init(&trees->tree_d);
+  HuffmanTree_init(&trees->tree_cl);
+}
+
+static void InflateTrees_cleanup(InflateTrees* trees)
+{
+  HuffmanTree_cleanup(&trees->tree_ll);
+  HuffmanTree_cleanup(&trees->tree_d);
+  HuffmanTree_cleanup(&trees->tree_cl);
+}
+
+struct LodePNGDecoderContext
+{
+  InflateTrees trees;
+  ucvector idat; /*the concatenated IDAT chunk data*/
+  ucvector scanlines; /*the inflated, still filtered image*/
+};
+
+LodePNGDecoderContext* lodepng_decoder_context_new(void)
+{
+  LodePNGDecoderContext* context = (LodePNGDecoderContext*)lodepng_malloc(sizeof(LodePNGDecoderContext));
+  if(!context) return 0;
+  InflateTrees_init(&context->trees);
+  ucvector_init_buffer(&context->idat, 0, 0);
+  ucvector_init_buffer(&context->scanlines, 0, 0);
+  return context;
+}
+
+void lodepng_decoder_context_delete(LodePNGDecoderContext* context)
+{
+  if(!context) return;
+  InflateTrees_cleanup(&context->trees);
+  lodepng_free(context->idat.data);
+  lodepng_free(context->scanlines.data);
+  lodepng_free(context);
+}
+
 /*inflate a block with dynamic of fixed Huffman tree*/
-static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size_t* bp,
+static unsigned inflateHuffmanBlock(ucvector* out, InflateTrees* trees, const unsigned char* in, size_t* bp,
                                     size_t* pos, size_t inlength, unsigned btype)
 {
   unsigned error = 0;
-  HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
-  HuffmanTree tree_d; /*the huffman tree for distance codes*/
+  HuffmanTree* tree_ll = &trees->tree_ll;
+  HuffmanTree* tree_d = &trees->tree_d;
   size_t inbitlength = inlength * 8;
 
-  HuffmanTree_init(&tree_ll);
-  HuffmanTree_init(&tree_d);
-
-  if(btype == 1) getTreeInflateFixed(&tree_ll, &tree_d);
-  else if(btype == 2) error = getTreeInflateDynamic(&tree_ll, &tree_d, in, bp, inlength);
+  if(btype == 1) getTreeInflateFixed(tree_ll, tree_d);
+  else if(btype == 2) error = getTreeInflateDynamic(tree_ll, tree_d, &trees->tree_cl, in, bp, inlength);
 
   while(!error) /*decode all symbols until end reached, breaks at end code*/
   {
     /*code_ll is literal, length or end code*/
-    unsigned code_ll = huffmanDecodeSymbol(in, bp, &tree_ll, inbitlength);
+    unsigned code_ll = huffmanDecodeSymbol(in, bp, tree_ll, inbitlength);
     if(code_ll <= 255) /*literal symbol*/
     {
       /*ucvector_push_back would do the same, but for some reason the two lines below run 10% faster*/
@@ -1168,7 +1299,7 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
       length += readBitsFromStream(bp, in, numextrabits_l);
 
       /*part 3: get distance code*/
-      code_d = huffmanDecodeSymbol(in, bp, &tree_d, inbitlength);
+      code_d = huffmanDecodeSymbol(in, bp, tree_d, inbitlength);
       if(code_d > 29)
       {
         if(code_d == (unsigned)(-1)) /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
@@ -1216,9 +1347,6 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
     }
   }
 
-  HuffmanTree_cleanup(&tree_ll);
-  HuffmanTree_cleanup(&tree_d);
-
   return error;
 }
 
@@ -1259,24 +1387,26 @@ static unsigned lodepng_inflatev(ucvector* out,
   unsigned BFINAL = 0;
   size_t pos = 0; /*byte position in the out buffer*/
   unsigned error = 0;
+  InflateTrees localtrees;
+  InflateTrees* trees = settings->context ? &settings->context->trees : &localtrees;
 
-  (void)settings;
+  if(!settings->context) InflateTrees_init(&localtrees);
 
-  while(!BFINAL)
+  while(!BFINAL && !error)
   {
     unsigned BTYPE;
-    if(bp + 2 >= insize * 8) return 52; /*error, bit pointer will jump past memory*/
+    if(bp + 2 >= insize * 8) ERROR_BREAK(52); /*error, bit pointer will jump past memory*/
     BFINAL = readBitFromStream(&bp, in);
     BTYPE = 1u * readBitFromStream(&bp, in);
     BTYPE += 2u * readBitFromStream(&bp, in);
 
-    if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
-    else if(BTYPE == 0) error = inflateNoCompression(out, in, &bp, &pos, insize); /*no compression*/
-    else error = inflateHuffmanBlock(out, in, &bp, &pos, insize, BTYPE); /*compression, BTYPE 01 or 10*/
-
-    if(error) return error;
+    if(BTYPE == 3) ERROR_BREAK(20); /*error: invalid BTYPE*/
+    if(BTYPE == 0) error = inflateNoCompression(out, in, &bp, &pos, insize); /*no compression*/
+    else error = inflateHuffmanBlock(out, trees, in, &bp, &pos, insize, BTYPE); /*compression, BTYPE 01 or 10*/
   }
 
+  if(!settings->context) InflateTrees_cleanup(&localtrees);
+
   return error;
 }
 
@@ -1293,20 +1423,6 @@ unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
   return error;
 }
 
-static unsigned inflate(unsigned char** out, size_t* outsize,
-                        const unsigned char* in, size_t insize,
-                        const LodePNGDecompressSettings* settings)
-{
-  if(settings->custom_inflate)
-  {
-    return settings->custom_inflate(out, outsize, in, insize, settings);
-  }
-  else
-  {
-    return lodepng_inflate(out, outsize, in, insize, settings);
-  }
-}
-
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
@@ -1378,9 +1494,20 @@ typedef struct Hash
   unsigned short* zeros; /*length of zeros streak, used as a second hash chain*/
 } Hash;
 
-static unsigned hash_init(Hash* hash, unsigned windowsize)
+/*(re)initialize the hash table to the empty state*/
+static void hash_reset(Hash* hash, unsigned windowsize)
 {
   unsigned i;
+  for(i = 0; i != HASH_NUM_VALUES; ++i) hash->head[i] = -1;
+  for(i = 0; i != windowsize; ++i) hash->val[i] = -1;
+  for(i = 0; i != windowsize; ++i) hash->chain[i] = i; /*same value as index indicates uninitialized*/
+
+  for(i = 0; i <= MAX_SUPPORTED_DEFLATE_LENGTH; ++i) hash->headz[i] = -1;
+  for(i = 0; i != windowsize; ++i) hash->chainz[i] = i; /*same value as index indicates uninitialized*/
+}
+
+static unsigned hash_init(Hash* hash, unsigned windowsize)
+{
   hash->head = (int*)lodepng_malloc(sizeof(int) * HASH_NUM_VALUES);
   hash->val = (int*)lodepng_malloc(sizeof(int) * windowsize);
   hash->chain = (unsigned short*)lodepng_malloc(sizeof(unsigned short) * windowsize);
@@ -1394,13 +1521,7 @@ static unsigned hash_init(Hash* hash, unsigned windowsize)
     return 83; /*alloc fail*/
   }
 
-  /*initialize hash table*/
-  for(i = 0; i != HASH_NUM_VALUES; ++i) hash->head[i] = -1;
-  for(i = 0; i != windowsize; ++i) hash->val[i] = -1;
-  for(i = 0; i != windowsize; ++i) hash->chain[i] = i; /*same value as index indicates uninitialized*/
-
-  for(i = 0; i <= MAX_SUPPORTED_DEFLATE_LENGTH; ++i) hash->headz[i] = -1;
-  for(i = 0; i != windowsize; ++i) hash->chainz[i] = i; /*same value as index indicates uninitialized*/
+  hash_reset(hash, windowsize);
 
   return 0;
 }
@@ -1416,6 +1537,86 @@ static void hash_cleanup(Hash* hash)
   lodepng_free(hash->chainz);
 }
 
+struct LodePNGEncoderContext
+{
+  Hash hash;
+  unsigned hashwindowsize; /*windowsize the hash tables are allocated for, 0 if not allocated yet*/
+  uivector lz77; /*LZ77 symbols of the block being encoded*/
+  unsigned char* rows; /*filter candidate rows*/
+  size_t rowssize;
+  unsigned char* scanlines; /*the filtered image*/
+  size_t scanlinessize;
+  unsigned char* converted; /*the image converted to the PNG's color type*/
+  size_t convertedsize;
+};
+
+LodePNGEncoderContext* lodepng_encoder_context_new(void)
+{
+  LodePNGEncoderContext* context = (LodePNGEncoderContext*)lodepng_malloc(sizeof(LodePNGEncoderContext));
+  if(!context) return 0;
+  context->hashwindowsize = 0;
+  uivector_init(&context->lz77);
+  context->rows = 0;
+  context->rowssize = 0;
+  context->scanlines = 0;
+  context->scanlinessize = 0;
+  context->converted = 0;
+  context->convertedsize = 0;
+  return context;
+}
+
+void lodepng_encoder_context_delete(LodePNGEncoderContext* context)
+{
+  if(!context) return;
+  if(context->hashwindowsize) hash_cleanup(&context->hash);
+  uivector_cleanup(&context->lz77);
+  lodepng_free(context->rows);
+  lodepng_free(context->scanlines);
+  lodepng_free(context->converted);
+  lodepng_free(context);
+}
+
+/*points *hash at the hash tables of the context, emptied for a new stream*/
+static unsigned encoder_context_hash(Hash** hash, LodePNGEncoderContext* context, unsigned windowsize)
+{
+  if(context->hashwindowsize == windowsize)
+  {
+    hash_reset(&context->hash, windowsize);
+  }
+  else
+  {
+    unsigned error;
+    if(context->hashwindowsize) hash_cleanup(&context->hash);
+    context->hashwindowsize = 0;
+    error = hash_init(&context->hash, windowsize);
+    if(error)
+    {
+      hash_cleanup(&context->hash);
+      return error;
+    }
+    context->hashwindowsize = windowsize;
+  }
+  *hash = &context->hash;
+  return 0;
+}
+
+/*the LZ77 symbol buffer of a block: borrowed from the context if there is one, so its memory is kept*/
+static void lz77_buffer_take(uivector* lz77, const LodePNGCompressSettings* settings)
+{
+  if(settings->context)
+  {
+    *lz77 = settings->context->lz77;
+    lz77->size = 0;
+  }
+  else uivector_init(lz77);
+}
+
+static void lz77_buffer_return(uivector* lz77, const LodePNGCompressSettings* settings)
+{
+  if(settings->context) settings->context->lz77 = *lz77;
+  else uivector_cleanup(lz77);
+}
+
 
 
 static unsigned getHash(const unsigned char* data, size_t size, size_t pos)
@@ -1462,6 +1663,80 @@ static void updateHashChain(Hash* hash, size_t wpos, unsigned hashval, unsigned
   hash->headz[numzeros] = wpos;
 }
 
+#ifdef LODEPNG_COMPILE_THREADS
+/*
+Fills the hash chains with the positions of the window before inpos, so that a block
+encoded on its own can still refer back into the data preceding it, as it would if the
+whole stream was encoded serially. The hash must be freshly reset.
+*/
+static void hash_prime(Hash* hash, const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize)
+{
+  size_t pos = inpos > windowsize ? inpos - windowsize : 0;
+  for(; pos < inpos; ++pos)
+  {
+    unsigned hashval = getHash(in, insize, pos);
+    unsigned numzeros = hashval == 0 ? countZeros(in, insize, pos) : 0;
+    updateHashChain(hash, pos & (windowsize - 1), hashval, (unsigned short)numzeros);
+  }
+}
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+/*a run or row repeat at least this long is taken by LMS_RLE without searching the hash chains*/
+static const unsigned REPEAT_GOOD_LENGTH = 16;
+
+/*
+The two matches the LMS_RLE strategy checks directly: the run of the byte before pos (distance 1,
+which is the zero run that countZeros and the zeros chains look for, but for any byte value) and the
+repeat of the previous row (distance rowstride, 0 to skip). Sets length and offset to the longer one.
+*/
+static void findRepeatMatch(unsigned* length, unsigned* offset, const unsigned char* in, size_t pos,
+                            const unsigned char* lastptr, unsigned rowstride)
+{
+  const unsigned char* start = &in[pos];
+  const unsigned char* foreptr = start;
+  const unsigned char* backptr;
+  if(pos >= 1)
+  {
+    unsigned char value = in[pos - 1];
+    while(foreptr != lastptr && *foreptr == value) ++foreptr;
+    *length = (unsigned)(foreptr - start);
+    *offset = 1;
+  }
+  if(rowstride != 0 && pos >= rowstride && foreptr != lastptr)
+  {
+    foreptr = start;
+    backptr = start - rowstride;
+    while(foreptr != lastptr && *backptr == *foreptr)
+    {
+      ++backptr;
+      ++foreptr;
+    }
+    if((unsigned)(foreptr - start) > *length)
+    {
+      *length = (unsigned)(foreptr - start);
+      *offset = rowstride;
+    }
+  }
+}
+
+/*the distance of the row-repeat matches encodeLZ77 tries: rows longer than the window get none*/
+static unsigned repeatStride(const LodePNGCompressSettings* settings)
+{
+  return settings->rowstride <= settings->windowsize ? settings->rowstride : 0;
+}
+
+/*whether nearly all (15/16) bytes equal the byte before them or the byte one rowstride back, so only
+counting the matches LMS_RLE emits, with rowstride from repeatStride*/
+static unsigned isMostlyRepeats(const unsigned char* in, size_t insize, unsigned rowstride)
+{
+  size_t i, repeats = 0;
+  for(i = 1; i < insize; ++i)
+  {
+    if(in[i] == in[i - 1] || (rowstride != 0 && i >= rowstride && in[i] == in[i - rowstride])) ++repeats;
+  }
+  return repeats >= insize - insize / 16;
+}
+
 /*
 LZ77-encode the data. Return value is error code. The input are raw bytes, the output
 is in the form of unsigned integers with codes representing for example literal bytes, or
@@ -1472,13 +1747,20 @@ the "dictionary". A brute force search through all possible distances would be s
 this hash technique is one out of several ways to speed this up.
 */
 static unsigned encodeLZ77(uivector* out, Hash* hash,
-                           const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize,
-                           unsigned minmatch, unsigned nicematch, unsigned lazymatching)
+                           const unsigned char* in, size_t inpos, size_t insize,
+                           const LodePNGCompressSettings* settings)
 {
   size_t pos;
   unsigned i, error = 0;
+  unsigned windowsize = settings->windowsize;
+  unsigned minmatch = settings->minmatch;
+  unsigned nicematch = settings->nicematch;
+  unsigned lazymatching = settings->lazymatching;
   /*for large window lengths, assume the user wants no compression loss. Otherwise, max hash chain length speedup.*/
-  unsigned maxchainlength = windowsize >= 8192 ? windowsize : windowsize / 8;
+  unsigned maxchainlength = settings->maxchainlength != 0 ? settings->maxchainlength
+                          : windowsize >= 8192 ? windowsize : windowsize / 8;
+  unsigned userepeats = settings->strategy == LMS_RLE;
+  unsigned rowstride = repeatStride(settings);
   unsigned maxlazymatch = windowsize >= 8192 ? MAX_SUPPORTED_DEFLATE_LENGTH : 64;
 
   unsigned usezeros = 1; /*not sure if setting it to false for windowsize < 8192 is better or worse*/
@@ -1526,10 +1808,15 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
 
     lastptr = &in[insize < pos + MAX_SUPPORTED_DEFLATE_LENGTH ? insize : pos + MAX_SUPPORTED_DEFLATE_LENGTH];
 
+    /*LMS_RLE: try the run of the previous byte and the row above first, and only walk the
+    hash chain if neither of them is long enough already*/
+    if(userepeats) findRepeatMatch(&length, &offset, in, pos, lastptr, rowstride);
+
     /*search for the longest string*/
     prev_offset = 0;
     for(;;)
     {
+      if(length >= nicematch || (userepeats && length >= REPEAT_GOOD_LENGTH)) break;
       if(chainlength++ >= maxchainlength) break;
       current_offset = hashpos <= wpos ? wpos - hashpos : wpos - hashpos + windowsize;
 
@@ -1765,7 +2052,7 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   size_t numcodes_ll, numcodes_d, i;
   unsigned HLIT, HDIST, HCLEN;
 
-  uivector_init(&lz77_encoded);
+  lz77_buffer_take(&lz77_encoded, settings);
   HuffmanTree_init(&tree_ll);
   HuffmanTree_init(&tree_d);
   HuffmanTree_init(&tree_cl);
@@ -1782,8 +2069,7 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   {
     if(settings->use_lz77)
     {
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
+      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings);
       if(error) break;
     }
     else
@@ -1952,7 +2238,7 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   }
 
   /*cleanup*/
-  uivector_cleanup(&lz77_encoded);
+  lz77_buffer_return(&lz77_encoded, settings);
   HuffmanTree_cleanup(&tree_ll);
   HuffmanTree_cleanup(&tree_d);
   HuffmanTree_cleanup(&tree_cl);
@@ -1991,11 +2277,10 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
   if(settings->use_lz77) /*LZ77 encoded*/
   {
     uivector lz77_encoded;
-    uivector_init(&lz77_encoded);
-    error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                       settings->minmatch, settings->nicematch, settings->lazymatching);
+    lz77_buffer_take(&lz77_encoded, settings);
+    error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings);
     if(!error) writeLZ77data(bp, out, &lz77_encoded, &tree_ll, &tree_d);
-    uivector_cleanup(&lz77_encoded);
+    lz77_buffer_return(&lz77_encoded, settings);
   }
   else /*no LZ77, but still will be Huffman compressed*/
   {
@@ -2014,16 +2299,151 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
   return error;
 }
 
-static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
+/*defined in the Adler32 section below*/
+static unsigned adler32(const unsigned char* data, unsigned len);
+
+#ifdef LODEPNG_COMPILE_THREADS
+/*Adler-32 of the concatenation of two buffers, given the checksums of both and the length of the second*/
+static unsigned adler32_combine(unsigned adler1, unsigned adler2, size_t len2)
+{
+  const unsigned base = 65521;
+  unsigned rem = (unsigned)(len2 % base);
+  unsigned s1 = adler1 & 0xffff;
+  unsigned s2 = (rem * s1) % base;
+  s1 += (adler2 & 0xffff) + base - 1;
+  s2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) + base - rem;
+  if(s1 >= base) s1 -= base;
+  if(s1 >= base) s1 -= base;
+  if(s2 >= (base << 1)) s2 -= (base << 1);
+  if(s2 >= base) s2 -= base;
+  return (s2 << 16) | s1;
+}
+
+/*one dynamic deflate block, encoded to its own bitstream by deflateParallel*/
+typedef struct DeflateBlockTask
+{
+  size_t start;
+  size_t end;
+  unsigned final;
+  ucvector out; /*the bitstream of this block alone, starting at bit 0*/
+  size_t bp; /*amount of bits in out*/
+  unsigned adler; /*Adler-32 of in[start..end-1]*/
+  unsigned error;
+} DeflateBlockTask;
+
+/*worker loop: takes the next unclaimed block until all are done. Every block starts with an empty
+hash table that is primed with the window before it, so blocks don't depend on each other*/
+static void deflateBlockWorker(DeflateBlockTask* tasks, size_t numtasks, std::atomic<size_t>* next,
+                               const unsigned char* in, const LodePNGCompressSettings* settings)
+{
+  Hash hash;
+  unsigned error = hash_init(&hash, settings->windowsize);
+  unsigned fresh = 1; /*hash_init already reset the table*/
+  for(;;)
+  {
+    size_t i = next->fetch_add(1);
+    DeflateBlockTask* task;
+    if(i >= numtasks) break;
+    task = &tasks[i];
+    if(error)
+    {
+      task->error = error;
+      continue;
+    }
+    CS221_TRACE("lodepng::deflate block");
+    if(!fresh) hash_reset(&hash, settings->windowsize);
+    fresh = 0;
+    hash_prime(&hash, in, task->start, task->end, settings->windowsize);
+    task->error = deflateDynamic(&task->out, &task->bp, &hash, in, task->start, task->end, settings, task->final);
+    task->adler = adler32(&in[task->start], (unsigned)(task->end - task->start));
+  }
+  hash_cleanup(&hash);
+}
+
+/*
+Deflate with btype 2 in the pigz style: the blocks are LZ77 and Huffman encoded on up to
+settings->numthreads threads, then their bitstreams are concatenated in order. The output differs
+from the serial encoder (hash chains don't carry over between blocks beyond the primed window), but
+is an equally valid deflate stream. adler, if not NULL, receives the Adler-32 of the input.
+*/
+static unsigned deflateParallel(ucvector* out, unsigned* adler, const unsigned char* in, size_t insize,
+                                size_t blocksize, size_t numdeflateblocks,
+                                const LodePNGCompressSettings* settings)
+{
+  unsigned error = 0;
+  size_t i;
+  size_t bp = 0; /*the bit pointer*/
+  size_t numthreads = settings->numthreads < numdeflateblocks ? settings->numthreads : numdeflateblocks;
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> threads;
+  LodePNGCompressSettings blocksettings = *settings;
+  DeflateBlockTask* tasks = (DeflateBlockTask*)lodepng_malloc(sizeof(DeflateBlockTask) * numdeflateblocks);
+  if(!tasks) return 83; /*alloc fail*/
+
+  /*a context is single threaded, so every worker uses its own memory*/
+  blocksettings.context = 0;
+
+  for(i = 0; i != numdeflateblocks; ++i)
+  {
+    DeflateBlockTask* task = &tasks[i];
+    task->start = i * blocksize;
+    task->end = task->start + blocksize;
+    if(task->end > insize) task->end = insize;
+    task->final = (i == numdeflateblocks - 1);
+    ucvector_init_buffer(&task->out, 0, 0);
+    task->bp = 0;
+    task->adler = 1;
+    task->error = 0;
+  }
+
+  /*if a thread can't be started, the ones that did (at least this one) pick up its blocks*/
+  for(i = 1; i < numthreads; ++i)
+  {
+    try
+    {
+      threads.push_back(std::thread(deflateBlockWorker, tasks, numdeflateblocks, &next, in, &blocksettings));
+    }
+    catch(...)
+    {
+      break;
+    }
+  }
+  deflateBlockWorker(tasks, numdeflateblocks, &next, in, &blocksettings);
+  for(i = 0; i != threads.size(); ++i) threads[i].join();
+
+  if(adler) *adler = 1;
+  for(i = 0; i != numdeflateblocks; ++i)
+  {
+    DeflateBlockTask* task = &tasks[i];
+    if(!error) error = task->error;
+    if(!error) error = addBitStreamToStream(&bp, out, task->out.data, task->bp);
+    if(!error && adler) *adler = adler32_combine(*adler, task->adler, task->end - task->start);
+    lodepng_free(task->out.data);
+  }
+  lodepng_free(tasks);
+
+  return error;
+}
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+/*adler, if not NULL, receives the Adler-32 of the input*/
+static unsigned lodepng_deflatev(ucvector* out, unsigned* adler, const unsigned char* in, size_t insize,
                                  const LodePNGCompressSettings* settings)
 {
   unsigned error = 0;
   size_t i, blocksize, numdeflateblocks;
   size_t bp = 0; /*the bit pointer*/
-  Hash hash;
+  Hash localhash;
+  Hash* hash = &localhash;
+  LodePNGCompressSettings resolved;
 
   if(settings->btype > 2) return 61;
-  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
+  else if(settings->btype == 0)
+  {
+    error = deflateNoCompression(out, in, insize);
+    if(!error && adler) *adler = adler32(in, (unsigned)insize);
+    return error;
+  }
   else if(settings->btype == 1) blocksize = insize;
   else /*if(settings->btype == 2)*/
   {
@@ -2036,7 +2456,22 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
   numdeflateblocks = (insize + blocksize - 1) / blocksize;
   if(numdeflateblocks == 0) numdeflateblocks = 1;
 
-  error = hash_init(&hash, settings->windowsize);
+  if(settings->strategy == LMS_AUTO)
+  {
+    resolved = *settings;
+    resolved.strategy = isMostlyRepeats(in, insize, repeatStride(settings)) ? LMS_RLE : LMS_HASH;
+    settings = &resolved;
+  }
+
+#ifdef LODEPNG_COMPILE_THREADS
+  if(settings->btype == 2 && settings->numthreads > 1 && numdeflateblocks > 1)
+  {
+    return deflateParallel(out, adler, in, insize, blocksize, numdeflateblocks, settings);
+  }
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+  if(settings->context) error = encoder_context_hash(&hash, settings->context, settings->windowsize);
+  else error = hash_init(hash, settings->windowsize);
   if(error) return error;
 
   for(i = 0; i != numdeflateblocks && !error; ++i)
@@ -2046,11 +2481,13 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
     size_t end = start + blocksize;
     if(end > insize) end = insize;
 
-    if(settings->btype == 1) error = deflateFixed(out, &bp, &hash, in, start, end, settings, final);
-    else if(settings->btype == 2) error = deflateDynamic(out, &bp, &hash, in, start, end, settings, final);
+    if(settings->btype == 1) error = deflateFixed(out, &bp, hash, in, start, end, settings, final);
+    else if(settings->btype == 2) error = deflateDynamic(out, &bp, hash, in, start, end, settings, final);
   }
 
-  hash_cleanup(&hash);
+  if(!settings->context) hash_cleanup(hash);
+
+  if(!error && adler) *adler = adler32(in, (unsigned)insize);
 
   return error;
 }
@@ -2062,23 +2499,32 @@ unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
   unsigned error;
   ucvector v;
   ucvector_init_buffer(&v, *out, *outsize);
-  error = lodepng_deflatev(&v, in, insize, settings);
+  error = lodepng_deflatev(&v, 0, in, insize, settings);
   *out = v.data;
   *outsize = v.size;
   return error;
 }
 
-static unsigned deflate(unsigned char** out, size_t* outsize,
+/*adler receives the Adler-32 of the input, which the built in deflate computes along the way*/
+static unsigned deflate(unsigned char** out, size_t* outsize, unsigned* adler,
                         const unsigned char* in, size_t insize,
                         const LodePNGCompressSettings* settings)
 {
   if(settings->custom_deflate)
   {
-    return settings->custom_deflate(out, outsize, in, insize, settings);
+    unsigned error = settings->custom_deflate(out, outsize, in, insize, settings);
+    if(!error) *adler = adler32(in, (unsigned)insize);
+    return error;
   }
   else
   {
-    return lodepng_deflate(out, outsize, in, insize, settings);
+    unsigned error;
+    ucvector v;
+    ucvector_init_buffer(&v, *out, *outsize);
+    error = lodepng_deflatev(&v, adler, in, insize, settings);
+    *out = v.data;
+    *outsize = v.size;
+    return error;
   }
 }
 
@@ -2123,8 +2569,10 @@ static unsigned adler32(const unsigned char* data, unsigned len)
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                                 size_t insize, const LodePNGDecompressSettings* settings)
+/*lodepng_zlib_decompress into a ucvector: the built in inflator writes into the memory the vector already
+reserved instead of growing a new buffer*/
+static unsigned lodepng_zlib_decompressv(ucvector* out, const unsigned char* in,
+                                         size_t insize, const LodePNGDecompressSettings* settings)
 {
   unsigned error = 0;
   unsigned CM, CINFO, FDICT;
@@ -2155,48 +2603,83 @@ unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const uns
     return 26;
   }
 
-  error = inflate(out, outsize, in + 2, insize - 2, settings);
+  if(settings->custom_inflate)
+  {
+    error = settings->custom_inflate(&out->data, &out->size, in + 2, insize - 2, settings);
+    out->allocsize = out->size;
+  }
+  else error = lodepng_inflatev(out, in + 2, insize - 2, settings);
   if(error) return error;
 
   if(!settings->ignore_adler32)
   {
     unsigned ADLER32 = lodepng_read32bitInt(&in[insize - 4]);
-    unsigned checksum = adler32(*out, (unsigned)(*outsize));
+    unsigned checksum = adler32(out->data, (unsigned)(out->size));
     if(checksum != ADLER32) return 58; /*error, adler checksum not correct, data must be corrupted*/
   }
 
   return 0; /*no error*/
 }
 
+unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
+                                 size_t insize, const LodePNGDecompressSettings* settings)
+{
+  unsigned error;
+  ucvector v;
+  ucvector_init_buffer(&v, *out, *outsize);
+  error = lodepng_zlib_decompressv(&v, in, insize, settings);
+  *out = v.data;
+  *outsize = v.size;
+  return error;
+}
+
 static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
                                 size_t insize, const LodePNGDecompressSettings* settings)
 {
+  unsigned error;
+  CS221_TRACE("lodepng::inflate");
   if(settings->custom_zlib)
   {
-    return settings->custom_zlib(out, outsize, in, insize, settings);
+    error = settings->custom_zlib(out, outsize, in, insize, settings);
+  }
+  else
+  {
+    error = lodepng_zlib_decompress(out, outsize, in, insize, settings);
+  }
+  if(!error) CS221_COUNT(bytesInflated, *outsize);
+  return error;
+}
+
+#ifdef LODEPNG_COMPILE_PNG
+/*like zlib_decompress, but into memory the vector already reserved*/
+static unsigned zlib_decompressv(ucvector* out, const unsigned char* in,
+                                 size_t insize, const LodePNGDecompressSettings* settings)
+{
+  unsigned error;
+  size_t start = out->size;
+  CS221_TRACE("lodepng::inflate");
+  if(settings->custom_zlib)
+  {
+    error = settings->custom_zlib(&out->data, &out->size, in, insize, settings);
+    out->allocsize = out->size;
   }
   else
   {
-    return lodepng_zlib_decompress(out, outsize, in, insize, settings);
+    error = lodepng_zlib_decompressv(out, in, insize, settings);
   }
+  if(!error) CS221_COUNT(bytesInflated, out->size - start);
+  return error;
 }
+#endif /*LODEPNG_COMPILE_PNG*/
 
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
 
-unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                               size_t insize, const LodePNGCompressSettings* settings)
+/*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data.
+This writes the first two bytes.*/
+static void addZlibHeader(ucvector* out)
 {
-  /*initially, *out must be NULL and outsize 0, if you just give some random *out
-  that's pointing to a non allocated buffer, this'll crash*/
-  ucvector outv;
-  size_t i;
-  unsigned error;
-  unsigned char* deflatedata = 0;
-  size_t deflatesize = 0;
-
-  /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
   unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
   unsigned FLEVEL = 0;
   unsigned FDICT = 0;
@@ -2204,17 +2687,31 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
   unsigned FCHECK = 31 - CMFFLG % 31;
   CMFFLG += FCHECK;
 
+  ucvector_push_back(out, (unsigned char)(CMFFLG >> 8));
+  ucvector_push_back(out, (unsigned char)(CMFFLG & 255));
+}
+
+unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
+                               size_t insize, const LodePNGCompressSettings* settings)
+{
+  /*initially, *out must be NULL and outsize 0, if you just give some random *out
+  that's pointing to a non allocated buffer, this'll crash*/
+  ucvector outv;
+  size_t i;
+  unsigned error;
+  unsigned char* deflatedata = 0;
+  size_t deflatesize = 0;
+  unsigned ADLER32 = 1;
+
   /*ucvector-controlled version of the output buffer, for dynamic array*/
   ucvector_init_buffer(&outv, *out, *outsize);
 
-  ucvector_push_back(&outv, (unsigned char)(CMFFLG >> 8));
-  ucvector_push_back(&outv, (unsigned char)(CMFFLG & 255));
+  addZlibHeader(&outv);
 
-  error = deflate(&deflatedata, &deflatesize, in, insize, settings);
+  error = deflate(&deflatedata, &deflatesize, &ADLER32, in, insize, settings);
 
   if(!error)
   {
-    unsigned ADLER32 = adler32(in, (unsigned)insize);
     for(i = 0; i != deflatesize; ++i) ucvector_push_back(&outv, deflatedata[i]);
     lodepng_free(deflatedata);
     lodepng_add32bitInt(&outv, ADLER32);
@@ -2230,6 +2727,8 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
 static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
                               size_t insize, const LodePNGCompressSettings* settings)
 {
+  CS221_TRACE("lodepng::deflate");
+  CS221_COUNT(bytesDeflated, insize);
   if(settings->custom_zlib)
   {
     return settings->custom_zlib(out, outsize, in, insize, settings);
@@ -2240,6 +2739,149 @@ static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsign
   }
 }
 
+#ifdef LODEPNG_COMPILE_PNG
+/*
+Zlib compression of data that arrives piece by piece, for lodepng_encode_rows. Only the last deflate
+window and at most two blocks of the data are kept: every full block is deflated as soon as the next
+byte arrives. The kept data is only ever moved by a multiple of the window size, so the circular hash
+chains stay valid and the result is the same stream lodepng_zlib_compress makes of the whole data with
+btype 2, except that LMS_AUTO decides from the first blocks only.
+*/
+typedef struct ZlibStream
+{
+  ucvector out; /*the zlib data so far*/
+  size_t bp; /*bit pointer in the deflate data*/
+  unsigned adler; /*Adler-32 of the data written so far*/
+  Hash localhash;
+  Hash* hash; /*localhash, or the hash of the settings' context*/
+  unsigned char* buffer; /*the window before pending, then the data not deflated yet*/
+  size_t size; /*bytes in use in buffer*/
+  size_t capacity;
+  size_t pending; /*start of the data not deflated yet*/
+  size_t blocksize;
+  unsigned resolved; /*whether settings.strategy is LMS_HASH or LMS_RLE yet*/
+  LodePNGCompressSettings settings;
+} ZlibStream;
+
+/*totalsize is the amount of data that will be written; it sets the block size, as in lodepng_deflatev*/
+static unsigned zlib_stream_init(ZlibStream* stream, size_t totalsize, const LodePNGCompressSettings* settings)
+{
+  unsigned windowsize = settings->windowsize;
+  unsigned error;
+
+  ucvector_init(&stream->out);
+  stream->bp = 0;
+  stream->adler = 1;
+  stream->hash = 0;
+  stream->buffer = 0;
+  stream->size = 0;
+  stream->pending = 0;
+  stream->resolved = settings->strategy != LMS_AUTO;
+  stream->settings = *settings;
+
+  if(windowsize == 0 || windowsize > 32768) return 60; /*error: windowsize smaller/larger than allowed*/
+  if((windowsize & (windowsize - 1)) != 0) return 90; /*error: must be power of two*/
+
+  stream->blocksize = totalsize / 8 + 8;
+  if(stream->blocksize < 65536) stream->blocksize = 65536;
+  if(stream->blocksize > 262144) stream->blocksize = 262144;
+  stream->capacity = 2 * (size_t)windowsize + 2 * stream->blocksize;
+  stream->buffer = (unsigned char*)lodepng_malloc(stream->capacity);
+  if(!stream->buffer) return 83; /*alloc fail*/
+
+  if(settings->context)
+  {
+    error = encoder_context_hash(&stream->hash, settings->context, windowsize);
+  }
+  else
+  {
+    error = hash_init(&stream->localhash, windowsize);
+    if(error) hash_cleanup(&stream->localhash);
+    else stream->hash = &stream->localhash;
+  }
+  if(error) return error;
+
+  addZlibHeader(&stream->out);
+  return 0;
+}
+
+static void zlib_stream_cleanup(ZlibStream* stream)
+{
+  if(stream->hash == &stream->localhash) hash_cleanup(&stream->localhash);
+  lodepng_free(stream->buffer);
+  ucvector_cleanup(&stream->out);
+}
+
+/*deflates every full block that is followed by more data, or everything as the final block*/
+static unsigned zlib_stream_deflate(ZlibStream* stream, unsigned final)
+{
+  unsigned error = 0;
+  size_t windowsize = stream->settings.windowsize;
+  CS221_TRACE("lodepng::deflate");
+
+  if(!stream->resolved)
+  {
+    stream->settings.strategy = isMostlyRepeats(&stream->buffer[stream->pending], stream->size - stream->pending,
+                                                repeatStride(&stream->settings)) ? LMS_RLE : LMS_HASH;
+    stream->resolved = 1;
+  }
+
+  while(!error && stream->size - stream->pending > stream->blocksize)
+  {
+    error = deflateDynamic(&stream->out, &stream->bp, stream->hash, stream->buffer,
+                           stream->pending, stream->pending + stream->blocksize, &stream->settings, 0);
+    stream->pending += stream->blocksize;
+  }
+  if(!error && final)
+  {
+    error = deflateDynamic(&stream->out, &stream->bp, stream->hash, stream->buffer,
+                           stream->pending, stream->size, &stream->settings, 1);
+    stream->pending = stream->size;
+  }
+
+  /*keep one window before pending, dropping whole window sizes so that wpos doesn't change*/
+  if(stream->pending > windowsize)
+  {
+    size_t shift = (stream->pending - windowsize) & ~(windowsize - 1);
+    memmove(stream->buffer, &stream->buffer[shift], stream->size - shift);
+    stream->size -= shift;
+    stream->pending -= shift;
+  }
+
+  return error;
+}
+
+static unsigned zlib_stream_write(ZlibStream* stream, const unsigned char* data, size_t size)
+{
+  CS221_COUNT(bytesDeflated, size);
+  stream->adler = update_adler32(stream->adler, data, (unsigned)size);
+  while(size)
+  {
+    size_t amount = stream->capacity - stream->size;
+    if(amount == 0)
+    {
+      unsigned error = zlib_stream_deflate(stream, 0);
+      if(error) return error;
+      amount = stream->capacity - stream->size;
+    }
+    if(amount > size) amount = size;
+    memcpy(&stream->buffer[stream->size], data, amount);
+    stream->size += amount;
+    data += amount;
+    size -= amount;
+  }
+  return 0;
+}
+
+/*deflates the rest and appends the Adler-32. The zlib data is left in stream->out.*/
+static unsigned zlib_stream_finish(ZlibStream* stream)
+{
+  unsigned error = zlib_stream_deflate(stream, 1);
+  if(!error) lodepng_add32bitInt(&stream->out, stream->adler);
+  return error;
+}
+#endif /*LODEPNG_COMPILE_PNG*/
+
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #else /*no LODEPNG_COMPILE_ZLIB*/
@@ -2251,6 +2893,39 @@ static unsigned zlib_decompress(unsigned char** out, size_t* outsize, const unsi
   if(!settings->custom_zlib) return 87; /*no custom zlib function provided */
   return settings->custom_zlib(out, outsize, in, insize, settings);
 }
+
+static unsigned zlib_decompressv(ucvector* out, const unsigned char* in,
+                                 size_t insize, const LodePNGDecompressSettings* settings)
+{
+  unsigned error = zlib_decompress(&out->data, &out->size, in, insize, settings);
+  out->allocsize = out->size;
+  return error;
+}
+
+/*without the built in zlib, the context only keeps the PNG level buffers*/
+struct LodePNGDecoderContext
+{
+  ucvector idat; /*the concatenated IDAT chunk data*/
+  ucvector scanlines; /*the inflated, still filtered image*/
+};
+
+LodePNGDecoderContext* lodepng_decoder_context_new(void)
+{
+  LodePNGDecoderContext* context = (LodePNGDecoderContext*)lodepng_malloc(sizeof(LodePNGDecoderContext));
+  if(!context) return 0;
+  context->idat.data = context->scanlines.data = 0;
+  context->idat.size = context->idat.allocsize = 0;
+  context->scanlines.size = context->scanlines.allocsize = 0;
+  return context;
+}
+
+void lodepng_decoder_context_delete(LodePNGDecoderContext* context)
+{
+  if(!context) return;
+  lodepng_free(context->idat.data);
+  lodepng_free(context->scanlines.data);
+  lodepng_free(context);
+}
 #endif /*LODEPNG_COMPILE_DECODER*/
 #ifdef LODEPNG_COMPILE_ENCODER
 static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
@@ -2259,6 +2934,39 @@ static unsigned zlib_compress(unsigned char** out, size_t* outsize, const unsign
   if(!settings->custom_zlib) return 87; /*no custom zlib function provided */
   return settings->custom_zlib(out, outsize, in, insize, settings);
 }
+
+/*without the built in zlib, the context only keeps the PNG level buffers*/
+struct LodePNGEncoderContext
+{
+  unsigned char* rows; /*filter candidate rows*/
+  size_t rowssize;
+  unsigned char* scanlines; /*the filtered image*/
+  size_t scanlinessize;
+  unsigned char* converted; /*the image converted to the PNG's color type*/
+  size_t convertedsize;
+};
+
+LodePNGEncoderContext* lodepng_encoder_context_new(void)
+{
+  LodePNGEncoderContext* context = (LodePNGEncoderContext*)lodepng_malloc(sizeof(LodePNGEncoderContext));
+  if(!context) return 0;
+  context->rows = 0;
+  context->rowssize = 0;
+  context->scanlines = 0;
+  context->scanlinessize = 0;
+  context->converted = 0;
+  context->convertedsize = 0;
+  return context;
+}
+
+void lodepng_encoder_context_delete(LodePNGEncoderContext* context)
+{
+  if(!context) return;
+  lodepng_free(context->rows);
+  lodepng_free(context->scanlines);
+  lodepng_free(context->converted);
+  lodepng_free(context);
+}
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #endif /*LODEPNG_COMPILE_ZLIB*/
@@ -2279,13 +2987,45 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings)
   settings->minmatch = 3;
   settings->nicematch = 128;
   settings->lazymatching = 1;
+  settings->maxchainlength = 0;
+  settings->strategy = LMS_HASH;
+  settings->rowstride = 0;
+  settings->numthreads = 1;
+  settings->context = 0;
 
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, LMS_HASH, 0, 1, 0, 0, 0, 0};
+
+/*btype, windowsize, nicematch, lazymatching and maxchainlength per compression level. Level 6 is
+the default above; its maxchainlength of 0 works out to DEFAULT_WINDOWSIZE / 8.*/
+static const unsigned COMPRESSION_LEVELS[10][5] = {
+  {0,    2048,   0, 0,    0}, /*0: stored*/
+  {2,    2048,  16, 0,    1}, /*1: greedy, single hash probe*/
+  {2,    2048,  32, 0,    4},
+  {2,    2048,  64, 0,   16},
+  {2,    2048,  64, 1,   32},
+  {2,    2048, 128, 1,   64},
+  {2, DEFAULT_WINDOWSIZE, 128, 1, 0}, /*6: the defaults*/
+  {2,    8192, 258, 1,  256},
+  {2,   16384, 258, 1, 1024},
+  {2,   32768, 258, 1, 2048}  /*9: full window*/
+};
+
+void lodepng_compress_settings_set_level(LodePNGCompressSettings* settings, unsigned level)
+{
+  const unsigned* values = COMPRESSION_LEVELS[level > 9 ? 9 : level];
+  settings->btype = values[0];
+  settings->use_lz77 = 1;
+  settings->windowsize = values[1];
+  settings->minmatch = 3;
+  settings->nicematch = values[2];
+  settings->lazymatching = values[3];
+  settings->maxchainlength = values[4];
+}
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -2295,13 +3035,14 @@ const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT
 void lodepng_decompress_settings_init(LodePNGDecompressSettings* settings)
 {
   settings->ignore_adler32 = 0;
+  settings->context = 0;
 
   settings->custom_zlib = 0;
   settings->custom_inflate = 0;
   settings->custom_context = 0;
 }
 
-const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0, 0};
+const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0, 0, 0};
 
 #endif /*LODEPNG_COMPILE_DECODER*/
 
@@ -4058,6 +4799,7 @@ static unsigned unfilter(unsigned char* out, const unsigned char* in, unsigned w
   /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
   size_t bytewidth = (bpp + 7) / 8;
   size_t linebytes = (w * bpp + 7) / 8;
+  CS221_TRACE("lodepng::unfilter");
 
   for(y = 0; y < h; ++y)
   {
@@ -4520,11 +5262,30 @@ static unsigned readChunk_pHYs(LodePNGInfo* info, const unsigned char* data, siz
 }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
+/*a buffer of decodeGeneric: borrowed from the decoder context if there is one (kept is not NULL), so its
+memory is reused by the next file*/
+static void decoder_buffer_take(ucvector* buffer, ucvector* kept)
+{
+  if(kept)
+  {
+    *buffer = *kept;
+    buffer->size = 0;
+  }
+  else ucvector_init(buffer);
+}
+
+static void decoder_buffer_return(ucvector* buffer, ucvector* kept)
+{
+  if(kept) *kept = *buffer;
+  else ucvector_cleanup(buffer);
+}
+
 /*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
 static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
                           LodePNGState* state,
                           const unsigned char* in, size_t insize)
 {
+  LodePNGDecoderContext* context = state->decoder.zlibsettings.context;
   unsigned char IEND = 0;
   const unsigned char* chunk;
   size_t i;
@@ -4554,7 +5315,7 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   bytes with 16-bit RGBA, the rest is room for filter bytes.*/
   if(numpixels > 268435455) CERROR_RETURN(state->error, 92);
 
-  ucvector_init(&idat);
+  decoder_buffer_take(&idat, context ? &context->idat : 0);
   chunk = &in[33]; /*first byte of the first chunk after the header*/
 
   /*loop through the chunks, ignoring unknown chunks and stopping at IEND chunk.
@@ -4678,7 +5439,7 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     if(!IEND) chunk = lodepng_chunk_next_const(chunk);
   }
 
-  ucvector_init(&scanlines);
+  decoder_buffer_take(&scanlines, context ? &context->scanlines : 0);
   /*predict output size, to allocate exact size for output buffer to avoid more dynamic allocation.
   If the decompressed size does not match the prediction, the image must be corrupt.*/
   if(state->info_png.interlace_method == 0)
@@ -4702,11 +5463,10 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   if(!state->error && !ucvector_reserve(&scanlines, predict)) state->error = 83; /*alloc fail*/
   if(!state->error)
   {
-    state->error = zlib_decompress(&scanlines.data, &scanlines.size, idat.data,
-                                   idat.size, &state->decoder.zlibsettings);
+    state->error = zlib_decompressv(&scanlines, idat.data, idat.size, &state->decoder.zlibsettings);
     if(!state->error && scanlines.size != predict) state->error = 91; /*decompressed size doesn't match prediction*/
   }
-  ucvector_cleanup(&idat);
+  decoder_buffer_return(&idat, context ? &context->idat : 0);
 
   if(!state->error)
   {
@@ -4719,7 +5479,7 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     for(i = 0; i < outsize; i++) (*out)[i] = 0;
     state->error = postProcessScanlines(*out, scanlines.data, *w, *h, &state->info_png);
   }
-  ucvector_cleanup(&scanlines);
+  decoder_buffer_return(&scanlines, context ? &context->scanlines : 0);
 }
 
 unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
@@ -4970,21 +5730,6 @@ static unsigned addChunk_tRNS(ucvector* out, const LodePNGColorMode* info)
   return error;
 }
 
-static unsigned addChunk_IDAT(ucvector* out, const unsigned char* data, size_t datasize,
-                              LodePNGCompressSettings* zlibsettings)
-{
-  ucvector zlibdata;
-  unsigned error = 0;
-
-  /*compress with the Zlib compressor*/
-  ucvector_init(&zlibdata);
-  error = zlib_compress(&zlibdata.data, &zlibdata.size, data, datasize, zlibsettings);
-  if(!error) error = addChunk(out, "IDAT", zlibdata.data, zlibdata.size);
-  ucvector_cleanup(&zlibdata);
-
-  return error;
-}
-
 static unsigned addChunk_IEND(ucvector* out)
 {
   unsigned error = 0;
@@ -5143,10 +5888,183 @@ static unsigned addChunk_pHYs(ucvector* out, const LodePNGInfo* info)
 
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
+#ifdef LODEPNG_COMPILE_SIMD
+/*
+SIMD versions of the filters of filterScanline for a scanline that has a previous line (Sub doesn't need it).
+Every output byte only depends on input bytes, so whole vectors are filtered at once. They filter from where the
+bytewidth-wide start ends (0 for Up), as far as whole vectors fit, and return where the portable code continues.
+Paeth works on 16-bit lanes, exactly like paethPredictor.
+*/
+static size_t filterScanlineSSE2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                 size_t length, size_t bytewidth, unsigned char filterType)
+{
+  size_t i = filterType == 2 ? 0 : bytewidth;
+  const __m128i zero = _mm_setzero_si128();
+  for(; i + 16 <= length; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+    __m128i pred;
+    if(filterType == 1) pred = _mm_loadu_si128((const __m128i*)&scanline[i - bytewidth]);
+    else if(filterType == 2) pred = _mm_loadu_si128((const __m128i*)&prevline[i]);
+    else if(filterType == 3)
+    {
+      /*(a + b) >> 1 without overflowing a byte*/
+      __m128i a = _mm_loadu_si128((const __m128i*)&scanline[i - bytewidth]);
+      __m128i b = _mm_loadu_si128((const __m128i*)&prevline[i]);
+      __m128i half = _mm_and_si128(_mm_srli_epi16(_mm_xor_si128(a, b), 1), _mm_set1_epi8(0x7f));
+      pred = _mm_add_epi8(_mm_and_si128(a, b), half);
+    }
+    else
+    {
+      __m128i a8 = _mm_loadu_si128((const __m128i*)&scanline[i - bytewidth]);
+      __m128i b8 = _mm_loadu_si128((const __m128i*)&prevline[i]);
+      __m128i c8 = _mm_loadu_si128((const __m128i*)&prevline[i - bytewidth]);
+      __m128i half[2];
+      unsigned k;
+      for(k = 0; k != 2; ++k)
+      {
+        __m128i a = k == 0 ? _mm_unpacklo_epi8(a8, zero) : _mm_unpackhi_epi8(a8, zero);
+        __m128i b = k == 0 ? _mm_unpacklo_epi8(b8, zero) : _mm_unpackhi_epi8(b8, zero);
+        __m128i c = k == 0 ? _mm_unpacklo_epi8(c8, zero) : _mm_unpackhi_epi8(c8, zero);
+        __m128i bc = _mm_sub_epi16(b, c);
+        __m128i ac = _mm_sub_epi16(a, c);
+        __m128i abc = _mm_add_epi16(bc, ac);
+        __m128i pa = _mm_max_epi16(bc, _mm_sub_epi16(zero, bc));
+        __m128i pb = _mm_max_epi16(ac, _mm_sub_epi16(zero, ac));
+        __m128i pc = _mm_max_epi16(abc, _mm_sub_epi16(zero, abc));
+        __m128i useb = _mm_cmplt_epi16(pb, pa);
+        __m128i usec = _mm_and_si128(_mm_cmplt_epi16(pc, pa), _mm_cmplt_epi16(pc, pb));
+        __m128i ab = _mm_or_si128(_mm_and_si128(useb, b), _mm_andnot_si128(useb, a));
+        half[k] = _mm_or_si128(_mm_and_si128(usec, c), _mm_andnot_si128(usec, ab));
+      }
+      pred = _mm_packus_epi16(half[0], half[1]);
+    }
+    _mm_storeu_si128((__m128i*)&out[i], _mm_sub_epi8(x, pred));
+  }
+  return i;
+}
+
+/*the same as filterScanlineSSE2, 32 bytes at a time*/
+__attribute__((target("avx2")))
+static size_t filterScanlineAVX2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                 size_t length, size_t bytewidth, unsigned char filterType)
+{
+  size_t i = filterType == 2 ? 0 : bytewidth;
+  const __m256i zero = _mm256_setzero_si256();
+  for(; i + 32 <= length; i += 32)
+  {
+    __m256i x = _mm256_loadu_si256((const __m256i*)&scanline[i]);
+    __m256i pred;
+    if(filterType == 1) pred = _mm256_loadu_si256((const __m256i*)&scanline[i - bytewidth]);
+    else if(filterType == 2) pred = _mm256_loadu_si256((const __m256i*)&prevline[i]);
+    else if(filterType == 3)
+    {
+      __m256i a = _mm256_loadu_si256((const __m256i*)&scanline[i - bytewidth]);
+      __m256i b = _mm256_loadu_si256((const __m256i*)&prevline[i]);
+      __m256i half = _mm256_and_si256(_mm256_srli_epi16(_mm256_xor_si256(a, b), 1), _mm256_set1_epi8(0x7f));
+      pred = _mm256_add_epi8(_mm256_and_si256(a, b), half);
+    }
+    else
+    {
+      /*unpack and pack both work per 128-bit lane, so the byte order survives the round trip*/
+      __m256i a8 = _mm256_loadu_si256((const __m256i*)&scanline[i - bytewidth]);
+      __m256i b8 = _mm256_loadu_si256((const __m256i*)&prevline[i]);
+      __m256i c8 = _mm256_loadu_si256((const __m256i*)&prevline[i - bytewidth]);
+      __m256i half[2];
+      unsigned k;
+      for(k = 0; k != 2; ++k)
+      {
+        __m256i a = k == 0 ? _mm256_unpacklo_epi8(a8, zero) : _mm256_unpackhi_epi8(a8, zero);
+        __m256i b = k == 0 ? _mm256_unpacklo_epi8(b8, zero) : _mm256_unpackhi_epi8(b8, zero);
+        __m256i c = k == 0 ? _mm256_unpacklo_epi8(c8, zero) : _mm256_unpackhi_epi8(c8, zero);
+        __m256i bc = _mm256_sub_epi16(b, c);
+        __m256i ac = _mm256_sub_epi16(a, c);
+        __m256i pa = _mm256_abs_epi16(bc);
+        __m256i pb = _mm256_abs_epi16(ac);
+        __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(bc, ac));
+        __m256i useb = _mm256_cmpgt_epi16(pa, pb);
+        __m256i usec = _mm256_and_si256(_mm256_cmpgt_epi16(pa, pc), _mm256_cmpgt_epi16(pb, pc));
+        half[k] = _mm256_blendv_epi8(_mm256_blendv_epi8(a, b, useb), c, usec);
+      }
+      pred = _mm256_packus_epi16(half[0], half[1]);
+    }
+    _mm256_storeu_si256((__m256i*)&out[i], _mm256_sub_epi8(x, pred));
+  }
+  return i;
+}
+
+/*the MINSUM score of a filtered scanline, see filterSum*/
+static size_t filterSumSSE2(const unsigned char* row, size_t length, unsigned char filterType, size_t* end)
+{
+  size_t i;
+  __m128i sum = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi8(-1);
+  for(i = 0; i + 16 <= length; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)&row[i]);
+    /*s < 128 ? s : 255 - s is the smaller of s and ~s*/
+    if(filterType != 0) v = _mm_min_epu8(v, _mm_xor_si128(v, ones));
+    sum = _mm_add_epi64(sum, _mm_sad_epu8(v, _mm_setzero_si128()));
+  }
+  *end = i;
+  /*each 64-bit half holds a sum far below 2^32, so its low 32 bits are all of it*/
+  return (size_t)(unsigned)_mm_cvtsi128_si32(sum) + (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+}
+
+__attribute__((target("avx2")))
+static size_t filterSumAVX2(const unsigned char* row, size_t length, unsigned char filterType, size_t* end)
+{
+  size_t i;
+  __m128i half;
+  __m256i sum = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi8(-1);
+  for(i = 0; i + 32 <= length; i += 32)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i*)&row[i]);
+    if(filterType != 0) v = _mm256_min_epu8(v, _mm256_xor_si256(v, ones));
+    sum = _mm256_add_epi64(sum, _mm256_sad_epu8(v, _mm256_setzero_si256()));
+  }
+  *end = i;
+  half = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+  return (size_t)(unsigned)_mm_cvtsi128_si32(half) + (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(half, 8));
+}
+
+/*the highest level allowed by lodepng_set_simd_level*/
+static unsigned simd_level_cap = 2;
+
+/*the kernels to run: 0 none, 1 SSE2, 2 AVX2. SSE2 is part of x86-64, so it needs no check.*/
+static unsigned simdLevel(void)
+{
+  unsigned supported = __builtin_cpu_supports("avx2") ? 2 : 1;
+  return simd_level_cap < supported ? simd_level_cap : supported;
+}
+
+unsigned lodepng_set_simd_level(unsigned level)
+{
+  simd_level_cap = level;
+  return simdLevel();
+}
+
+unsigned lodepng_get_simd_level(void)
+{
+  return simdLevel();
+}
+#endif /*LODEPNG_COMPILE_SIMD*/
+
 static void filterScanline(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
                            size_t length, size_t bytewidth, unsigned char filterType)
 {
   size_t i;
+  /*where the loops over the rest of the scanline start, the SIMD kernels may have done part of it*/
+  size_t start = filterType == 2 ? 0 : bytewidth;
+#ifdef LODEPNG_COMPILE_SIMD
+  unsigned simd = simdLevel();
+  if(simd != 0 && filterType >= 1 && filterType <= 4 && (prevline || filterType == 1))
+  {
+    if(simd == 2) start = filterScanlineAVX2(out, scanline, prevline, length, bytewidth, filterType);
+    else start = filterScanlineSSE2(out, scanline, prevline, length, bytewidth, filterType);
+  }
+#endif /*LODEPNG_COMPILE_SIMD*/
   switch(filterType)
   {
     case 0: /*None*/
@@ -5154,12 +6072,12 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       break;
     case 1: /*Sub*/
       for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
-      for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - scanline[i - bytewidth];
+      for(i = start; i < length; ++i) out[i] = scanline[i] - scanline[i - bytewidth];
       break;
     case 2: /*Up*/
       if(prevline)
       {
-        for(i = 0; i != length; ++i) out[i] = scanline[i] - prevline[i];
+        for(i = start; i < length; ++i) out[i] = scanline[i] - prevline[i];
       }
       else
       {
@@ -5170,7 +6088,7 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       if(prevline)
       {
         for(i = 0; i != bytewidth; ++i) out[i] = scanline[i] - (prevline[i] >> 1);
-        for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) >> 1);
+        for(i = start; i < length; ++i) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) >> 1);
       }
       else
       {
@@ -5183,7 +6101,7 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       {
         /*paethPredictor(0, prevline[i], 0) is always prevline[i]*/
         for(i = 0; i != bytewidth; ++i) out[i] = (scanline[i] - prevline[i]);
-        for(i = bytewidth; i < length; ++i)
+        for(i = start; i < length; ++i)
         {
           out[i] = (scanline[i] - paethPredictor(scanline[i - bytewidth], prevline[i], prevline[i - bytewidth]));
         }
@@ -5199,6 +6117,52 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
   }
 }
 
+/*
+The LFS_MINSUM score of a filtered scanline: the sum of its bytes. For differences, each byte should be treated
+as signed, values above 127 are negative (converted to signed char). Filtertype 0 isn't a difference though, so
+use unsigned there. This means filtertype 0 is almost never chosen, but that is justified.
+*/
+static size_t filterSum(const unsigned char* row, size_t length, unsigned char filterType)
+{
+  size_t i = 0, sum = 0;
+#ifdef LODEPNG_COMPILE_SIMD
+  unsigned simd = simdLevel();
+  if(simd == 2) sum = filterSumAVX2(row, length, filterType, &i);
+  else if(simd == 1) sum = filterSumSSE2(row, length, filterType, &i);
+#endif /*LODEPNG_COMPILE_SIMD*/
+  if(filterType == 0)
+  {
+    for(; i != length; ++i) sum += row[i];
+  }
+  else
+  {
+    for(; i != length; ++i) sum += row[i] < 128 ? row[i] : (255U - row[i]);
+  }
+  return sum;
+}
+
+/*
+Counts how often every byte value occurs in the scanline, for the LFS_ENTROPY score. Flat images filter to long
+runs of one value, so the counting is spread over four tables that are added up at the end: consecutive equal
+bytes then don't wait on each other's increments.
+*/
+static void filterHistogram(unsigned* count, const unsigned char* row, size_t length)
+{
+  unsigned tables[3][256];
+  size_t i;
+  unsigned x;
+  for(x = 0; x != 256; ++x) count[x] = tables[0][x] = tables[1][x] = tables[2][x] = 0;
+  for(i = 0; i + 4 <= length; i += 4)
+  {
+    ++count[row[i]];
+    ++tables[0][row[i + 1]];
+    ++tables[1][row[i + 2]];
+    ++tables[2][row[i + 3]];
+  }
+  for(; i != length; ++i) ++count[row[i]];
+  for(x = 0; x != 256; ++x) count[x] += tables[0][x] + tables[1][x] + tables[2][x];
+}
+
 /* log2 approximation. A slight bit faster than std::log. */
 static float flog2(float f)
 {
@@ -5208,135 +6172,93 @@ static float flog2(float f)
   return result + 1.442695f * (f * f * f / 3 - 3 * f * f / 2 + 3 * f - 1.83333f);
 }
 
-static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
-                       const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+/*grows a buffer owned by the context to at least size bytes. Returns NULL if out of memory.*/
+static unsigned char* encoder_context_buffer(unsigned char** buffer, size_t* buffersize, size_t size)
 {
-  /*
-  For PNG filter method 0
-  out must be a buffer with as size: h + (w * h * bpp + 7) / 8, because there are
-  the scanlines with 1 extra byte per scanline
-  */
+  if(size > *buffersize)
+  {
+    unsigned char* data = (unsigned char*)lodepng_realloc(*buffer, size);
+    if(!data) return 0;
+    *buffer = data;
+    *buffersize = size;
+  }
+  return *buffer;
+}
 
-  unsigned bpp = lodepng_get_bpp(info);
-  /*the width of a scanline in bytes, not including the filter type*/
-  size_t linebytes = (w * bpp + 7) / 8;
-  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
-  size_t bytewidth = (bpp + 7) / 8;
-  const unsigned char* prevline = 0;
-  unsigned x, y;
-  unsigned error = 0;
-  LodePNGFilterStrategy strategy = settings->filter_strategy;
+/*room for the five filter candidates of a row, kept by the encoder context if there is one*/
+static unsigned char* filter_rows_alloc(size_t size, const LodePNGEncoderSettings* settings)
+{
+  LodePNGEncoderContext* context = settings->zlibsettings.context;
+  if(context) return encoder_context_buffer(&context->rows, &context->rowssize, size);
+  return (unsigned char*)lodepng_malloc(size);
+}
 
-  /*
-  There is a heuristic called the minimum sum of absolute differences heuristic, suggested by the PNG standard:
-   *  If the image type is Palette, or the bit depth is smaller than 8, then do not filter the image (i.e.
-      use fixed filtering, with the filter None).
-   * (The other case) If the image type is Grayscale or RGB (with or without Alpha), and the bit depth is
-     not smaller than 8, then use adaptive filtering heuristic as follows: independently for each row, apply
-     all five filters and select the filter that produces the smallest sum of absolute values per row.
-  This heuristic is used if filter strategy is LFS_MINSUM and filter_palette_zero is true.
-
-  If filter_palette_zero is true and filter_strategy is not LFS_MINSUM, the above heuristic is followed,
-  but for "the other case", whatever strategy filter_strategy is set to instead of the minimum sum
-  heuristic is used.
-  */
-  if(settings->filter_palette_zero &&
-     (info->colortype == LCT_PALETTE || info->bitdepth < 8)) strategy = LFS_ZERO;
+static void filter_rows_free(unsigned char* rows, const LodePNGEncoderSettings* settings)
+{
+  if(!settings->zlibsettings.context) lodepng_free(rows);
+}
 
-  if(bpp == 0) return 31; /*error: invalid color type*/
+/*
+Chooses the filter of every scanline in [ystart, yend) with LFS_MINSUM, LFS_ENTROPY or LFS_BRUTE_FORCE and
+writes the filtered scanlines to out. A scanline only depends on the unfiltered scanline above it, so ranges
+can be filtered independently. rows must have room for the five candidates of a scanline. zlibsettings are
+used by LFS_BRUTE_FORCE to trial-compress the candidates.
+*/
+static void filterAdaptive(unsigned char* out, const unsigned char* in, size_t linebytes, size_t bytewidth,
+                           unsigned ystart, unsigned yend, LodePNGFilterStrategy strategy,
+                           unsigned char* rows, const LodePNGCompressSettings* zlibsettings)
+{
+  const unsigned char* prevline = ystart == 0 ? 0 : &in[(ystart - 1) * linebytes];
+  unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
+  unsigned x, y;
+  unsigned char type, bestType = 0;
 
-  if(strategy == LFS_ZERO)
-  {
-    for(y = 0; y != h; ++y)
-    {
-      size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
-      size_t inindex = linebytes * y;
-      out[outindex] = 0; /*filter type byte*/
-      filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, 0);
-      prevline = &in[inindex];
-    }
-  }
-  else if(strategy == LFS_MINSUM)
+  for(type = 0; type != 5; ++type) attempt[type] = &rows[type * linebytes];
+
+  if(strategy == LFS_MINSUM)
   {
     /*adaptive filtering*/
     size_t sum[5];
-    unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
     size_t smallest = 0;
-    unsigned char type, bestType = 0;
-
-    for(type = 0; type != 5; ++type)
-    {
-      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
-      if(!attempt[type]) return 83; /*alloc fail*/
-    }
 
-    if(!error)
+    for(y = ystart; y != yend; ++y)
     {
-      for(y = 0; y != h; ++y)
+      /*try the 5 filter types*/
+      for(type = 0; type != 5; ++type)
       {
-        /*try the 5 filter types*/
-        for(type = 0; type != 5; ++type)
-        {
-          filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
+        filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
 
-          /*calculate the sum of the result*/
-          sum[type] = 0;
-          if(type == 0)
-          {
-            for(x = 0; x != linebytes; ++x) sum[type] += (unsigned char)(attempt[type][x]);
-          }
-          else
-          {
-            for(x = 0; x != linebytes; ++x)
-            {
-              /*For differences, each byte should be treated as signed, values above 127 are negative
-              (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
-              This means filtertype 0 is almost never chosen, but that is justified.*/
-              unsigned char s = attempt[type][x];
-              sum[type] += s < 128 ? s : (255U - s);
-            }
-          }
+        /*calculate the sum of the result*/
+        sum[type] = filterSum(attempt[type], linebytes, type);
 
-          /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
-          if(type == 0 || sum[type] < smallest)
-          {
-            bestType = type;
-            smallest = sum[type];
-          }
+        /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
+        if(type == 0 || sum[type] < smallest)
+        {
+          bestType = type;
+          smallest = sum[type];
         }
+      }
 
-        prevline = &in[y * linebytes];
+      prevline = &in[y * linebytes];
 
-        /*now fill the out values*/
-        out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-        for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
-      }
+      /*now fill the out values*/
+      out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
+      for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
     }
-
-    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
   }
   else if(strategy == LFS_ENTROPY)
   {
     float sum[5];
-    unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
     float smallest = 0;
-    unsigned type, bestType = 0;
     unsigned count[256];
 
-    for(type = 0; type != 5; ++type)
-    {
-      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
-      if(!attempt[type]) return 83; /*alloc fail*/
-    }
-
-    for(y = 0; y != h; ++y)
+    for(y = ystart; y != yend; ++y)
     {
       /*try the 5 filter types*/
       for(type = 0; type != 5; ++type)
       {
         filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
-        for(x = 0; x != 256; ++x) count[x] = 0;
-        for(x = 0; x != linebytes; ++x) ++count[attempt[type][x]];
+        filterHistogram(count, attempt[type], linebytes);
         ++count[type]; /*the filter type itself is part of the scanline*/
         sum[type] = 0;
         for(x = 0; x != 256; ++x)
@@ -5358,57 +6280,27 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
       for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
     }
-
-    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
-  }
-  else if(strategy == LFS_PREDEFINED)
-  {
-    for(y = 0; y != h; ++y)
-    {
-      size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
-      size_t inindex = linebytes * y;
-      unsigned char type = settings->predefined_filters[y];
-      out[outindex] = type; /*filter type byte*/
-      filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, type);
-      prevline = &in[inindex];
-    }
   }
-  else if(strategy == LFS_BRUTE_FORCE)
+  else /*if(strategy == LFS_BRUTE_FORCE)*/
   {
     /*brute force filter chooser.
     deflate the scanline after every filter attempt to see which one deflates best.
     This is very slow and gives only slightly smaller, sometimes even larger, result*/
     size_t size[5];
-    unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
     size_t smallest = 0;
-    unsigned type = 0, bestType = 0;
     unsigned char* dummy;
-    LodePNGCompressSettings zlibsettings = settings->zlibsettings;
-    /*use fixed tree on the attempts so that the tree is not adapted to the filtertype on purpose,
-    to simulate the true case where the tree is the same for the whole image. Sometimes it gives
-    better result with dynamic tree anyway. Using the fixed tree sometimes gives worse, but in rare
-    cases better compression. It does make this a bit less slow, so it's worth doing this.*/
-    zlibsettings.btype = 1;
-    /*a custom encoder likely doesn't read the btype setting and is optimized for complete PNG
-    images only, so disable it*/
-    zlibsettings.custom_zlib = 0;
-    zlibsettings.custom_deflate = 0;
-    for(type = 0; type != 5; ++type)
-    {
-      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
-      if(!attempt[type]) return 83; /*alloc fail*/
-    }
-    for(y = 0; y != h; ++y) /*try the 5 filter types*/
+
+    for(y = ystart; y != yend; ++y) /*try the 5 filter types*/
     {
       for(type = 0; type != 5; ++type)
       {
-        unsigned testsize = linebytes;
+        unsigned testsize = (unsigned)linebytes;
         /*if(testsize > 8) testsize /= 8;*/ /*it already works good enough by testing a part of the row*/
 
         filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
         size[type] = 0;
         dummy = 0;
-        zlib_compress(&dummy, &size[type], attempt[type], testsize, &zlibsettings);
+        zlib_compress(&dummy, &size[type], attempt[type], testsize, zlibsettings);
         lodepng_free(dummy);
         /*check if this is smallest size (or if type == 0 it's the first case so always store the values)*/
         if(type == 0 || size[type] < smallest)
@@ -5421,13 +6313,261 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
       for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
     }
-    for(type = 0; type != 5; ++type) lodepng_free(attempt[type]);
+  }
+}
+
+#ifdef LODEPNG_COMPILE_THREADS
+/*worker loop of filterParallel: filters the next unclaimed band of scanlines until all are done. Trial
+compression gets its own encoder context per worker, the contexts aren't thread safe.*/
+static void filterWorker(unsigned char* out, const unsigned char* in, size_t linebytes, size_t bytewidth,
+                         unsigned h, unsigned bandsize, std::atomic<unsigned>* next,
+                         LodePNGFilterStrategy strategy, unsigned char* rows, LodePNGCompressSettings zlibsettings)
+{
+  LodePNGEncoderContext* context = 0;
+  if(strategy == LFS_BRUTE_FORCE) zlibsettings.context = context = lodepng_encoder_context_new();
+  for(;;)
+  {
+    unsigned ystart = next->fetch_add(bandsize);
+    unsigned yend;
+    if(ystart >= h) break;
+    yend = bandsize < h - ystart ? ystart + bandsize : h;
+    CS221_TRACE("lodepng::filter band");
+    filterAdaptive(out, in, linebytes, bytewidth, ystart, yend, strategy, rows, &zlibsettings);
+  }
+  lodepng_encoder_context_delete(context);
+}
+
+/*filterAdaptive on up to numthreads threads. Gives the same result as filtering serially.*/
+static unsigned filterParallel(unsigned char* out, const unsigned char* in, size_t linebytes, size_t bytewidth,
+                               unsigned h, LodePNGFilterStrategy strategy, size_t numthreads,
+                               const LodePNGCompressSettings* zlibsettings, const LodePNGEncoderSettings* settings)
+{
+  size_t i;
+  /*a few bands per thread, so a thread that was slow to start doesn't hold up the rest*/
+  unsigned bandsize = (unsigned)(h / (numthreads * 4));
+  std::atomic<unsigned> next(0);
+  std::vector<std::thread> threads;
+  unsigned char* rows = filter_rows_alloc(linebytes * 5 * numthreads, settings);
+  if(!rows) return 83; /*alloc fail*/
+  if(bandsize == 0) bandsize = 1;
+
+  /*if a thread can't be started, the ones that did (at least this one) pick up its bands*/
+  for(i = 1; i < numthreads; ++i)
+  {
+    try
+    {
+      threads.push_back(std::thread(filterWorker, out, in, linebytes, bytewidth, h, bandsize, &next,
+                                    strategy, &rows[i * linebytes * 5], *zlibsettings));
+    }
+    catch(...)
+    {
+      break;
+    }
+  }
+  filterWorker(out, in, linebytes, bytewidth, h, bandsize, &next, strategy, rows, *zlibsettings);
+  for(i = 0; i != threads.size(); ++i) threads[i].join();
+
+  filter_rows_free(rows, settings);
+  return 0;
+}
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+/*
+There is a heuristic called the minimum sum of absolute differences heuristic, suggested by the PNG standard:
+ *  If the image type is Palette, or the bit depth is smaller than 8, then do not filter the image (i.e.
+    use fixed filtering, with the filter None).
+ * (The other case) If the image type is Grayscale or RGB (with or without Alpha), and the bit depth is
+   not smaller than 8, then use adaptive filtering heuristic as follows: independently for each row, apply
+   all five filters and select the filter that produces the smallest sum of absolute values per row.
+This heuristic is used if filter strategy is LFS_MINSUM and filter_palette_zero is true.
+
+If filter_palette_zero is true and filter_strategy is not LFS_MINSUM, the above heuristic is followed,
+but for "the other case", whatever strategy filter_strategy is set to instead of the minimum sum
+heuristic is used.
+*/
+static LodePNGFilterStrategy getFilterStrategy(const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+{
+  if(settings->filter_palette_zero &&
+     (info->colortype == LCT_PALETTE || info->bitdepth < 8)) return LFS_ZERO;
+  return settings->filter_strategy;
+}
+
+/*the settings LFS_BRUTE_FORCE trial-compresses the filter candidates with*/
+static void getTrialCompressSettings(LodePNGCompressSettings* zlibsettings, const LodePNGEncoderSettings* settings)
+{
+  *zlibsettings = settings->zlibsettings;
+  /*use fixed tree on the attempts so that the tree is not adapted to the filtertype on purpose,
+  to simulate the true case where the tree is the same for the whole image. Sometimes it gives
+  better result with dynamic tree anyway. Using the fixed tree sometimes gives worse, but in rare
+  cases better compression. It does make this a bit less slow, so it's worth doing this.*/
+  zlibsettings->btype = 1;
+  /*a custom encoder likely doesn't read the btype setting and is optimized for complete PNG
+  images only, so disable it*/
+  zlibsettings->custom_zlib = 0;
+  zlibsettings->custom_deflate = 0;
+}
+
+static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                       const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+{
+  /*
+  For PNG filter method 0
+  out must be a buffer with as size: h + (w * h * bpp + 7) / 8, because there are
+  the scanlines with 1 extra byte per scanline
+  */
+
+  unsigned bpp = lodepng_get_bpp(info);
+  /*the width of a scanline in bytes, not including the filter type*/
+  size_t linebytes = (w * bpp + 7) / 8;
+  /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
+  size_t bytewidth = (bpp + 7) / 8;
+  const unsigned char* prevline = 0;
+  unsigned y;
+  unsigned error = 0;
+  LodePNGFilterStrategy strategy = getFilterStrategy(info, settings);
+  CS221_TRACE("lodepng::filter");
+
+  if(bpp == 0) return 31; /*error: invalid color type*/
+
+  if(strategy == LFS_ZERO)
+  {
+    for(y = 0; y != h; ++y)
+    {
+      size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
+      size_t inindex = linebytes * y;
+      out[outindex] = 0; /*filter type byte*/
+      filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, 0);
+      prevline = &in[inindex];
+    }
+  }
+  else if(strategy == LFS_MINSUM || strategy == LFS_ENTROPY || strategy == LFS_BRUTE_FORCE)
+  {
+    unsigned char* rows; /*room for the five filter candidates of a scanline*/
+    LodePNGEncoderContext* context = 0; /*for trial compression if the settings have none*/
+    LodePNGCompressSettings zlibsettings;
+    getTrialCompressSettings(&zlibsettings, settings);
+
+#ifdef LODEPNG_COMPILE_THREADS
+    if(settings->filter_threads > 1 && h > 1)
+    {
+      size_t numthreads = settings->filter_threads < h ? settings->filter_threads : h;
+      return filterParallel(out, in, linebytes, bytewidth, h, strategy, numthreads, &zlibsettings, settings);
+    }
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+    rows = filter_rows_alloc(linebytes * 5, settings);
+    if(!rows) return 83; /*alloc fail*/
+    /*trial compression allocates the deflate hash tables for every candidate unless they are kept*/
+    if(strategy == LFS_BRUTE_FORCE && !zlibsettings.context)
+    {
+      zlibsettings.context = context = lodepng_encoder_context_new();
+    }
+    filterAdaptive(out, in, linebytes, bytewidth, 0, h, strategy, rows, &zlibsettings);
+    lodepng_encoder_context_delete(context);
+    filter_rows_free(rows, settings);
+  }
+  else if(strategy == LFS_PREDEFINED)
+  {
+    for(y = 0; y != h; ++y)
+    {
+      size_t outindex = (1 + linebytes) * y; /*the extra filterbyte added to each row*/
+      size_t inindex = linebytes * y;
+      unsigned char type = settings->predefined_filters[y];
+      out[outindex] = type; /*filter type byte*/
+      filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, type);
+      prevline = &in[inindex];
+    }
   }
   else return 88; /* unknown filter strategy */
 
   return error;
 }
 
+/*
+Filters an image one scanline at a time for lodepng_encode_rows, choosing the same filter types as filter()
+does for the whole image. Only the current scanline and the one above it are kept.
+*/
+typedef struct RowFilter
+{
+  unsigned char* raw; /*the unfiltered scanline above, followed by the current one*/
+  unsigned char* filtered; /*room for two filtered scanlines, the second one receives the result*/
+  unsigned char* rows; /*the five candidates of the adaptive strategies*/
+  LodePNGEncoderContext* context; /*for trial compression if the settings have none*/
+  LodePNGCompressSettings zlibsettings; /*for trial compression*/
+  LodePNGFilterStrategy strategy;
+  size_t linebytes;
+  size_t bytewidth;
+} RowFilter;
+
+static unsigned rowfilter_init(RowFilter* rowfilter, unsigned w, const LodePNGColorMode* info,
+                               const LodePNGEncoderSettings* settings)
+{
+  unsigned bpp = lodepng_get_bpp(info);
+  LodePNGFilterStrategy strategy = getFilterStrategy(info, settings);
+  size_t linebytes = (w * (size_t)bpp + 7) / 8;
+
+  rowfilter->linebytes = linebytes;
+  rowfilter->bytewidth = (bpp + 7) / 8;
+  rowfilter->strategy = strategy;
+  rowfilter->rows = 0;
+  rowfilter->context = 0;
+  getTrialCompressSettings(&rowfilter->zlibsettings, settings);
+  rowfilter->raw = (unsigned char*)lodepng_malloc(linebytes * 2);
+  rowfilter->filtered = (unsigned char*)lodepng_malloc((linebytes + 1) * 2);
+
+  if(bpp == 0) return 31; /*error: invalid color type*/
+  if(!rowfilter->raw || !rowfilter->filtered) return 83; /*alloc fail*/
+  if(strategy == LFS_MINSUM || strategy == LFS_ENTROPY || strategy == LFS_BRUTE_FORCE)
+  {
+    rowfilter->rows = filter_rows_alloc(linebytes * 5, settings);
+    if(!rowfilter->rows) return 83; /*alloc fail*/
+    if(strategy == LFS_BRUTE_FORCE && !rowfilter->zlibsettings.context)
+    {
+      rowfilter->zlibsettings.context = rowfilter->context = lodepng_encoder_context_new();
+    }
+  }
+  else if(strategy != LFS_ZERO && strategy != LFS_PREDEFINED) return 88; /* unknown filter strategy */
+  return 0;
+}
+
+static void rowfilter_cleanup(RowFilter* rowfilter, const LodePNGEncoderSettings* settings)
+{
+  lodepng_free(rowfilter->raw);
+  lodepng_free(rowfilter->filtered);
+  if(rowfilter->rows) filter_rows_free(rowfilter->rows, settings);
+  lodepng_encoder_context_delete(rowfilter->context);
+}
+
+/*filters scanline y, taken from the second half of raw, into the second half of filtered. Then makes
+it the scanline above for the next call.*/
+static void rowfilter_apply(RowFilter* rowfilter, unsigned y, const LodePNGEncoderSettings* settings)
+{
+  size_t linebytes = rowfilter->linebytes;
+  unsigned char* scanline = &rowfilter->raw[linebytes];
+  unsigned char* out = &rowfilter->filtered[linebytes + 1];
+  LodePNGFilterStrategy strategy = rowfilter->strategy;
+
+  if(strategy == LFS_ZERO || strategy == LFS_PREDEFINED)
+  {
+    unsigned char type = strategy == LFS_ZERO ? 0 : settings->predefined_filters[y];
+    out[0] = type; /*filter type byte*/
+    filterScanline(&out[1], scanline, y == 0 ? 0 : rowfilter->raw, linebytes, rowfilter->bytewidth, type);
+  }
+  else if(y == 0)
+  {
+    filterAdaptive(out, scanline, linebytes, rowfilter->bytewidth, 0, 1, strategy,
+                   rowfilter->rows, &rowfilter->zlibsettings);
+  }
+  else
+  {
+    /*as the second scanline of a two scanline image, so that raw holds the one above*/
+    filterAdaptive(rowfilter->filtered, rowfilter->raw, linebytes, rowfilter->bytewidth, 1, 2, strategy,
+                   rowfilter->rows, &rowfilter->zlibsettings);
+  }
+
+  memcpy(rowfilter->raw, scanline, linebytes);
+}
+
 static void addPaddingBits(unsigned char* out, const unsigned char* in,
                            size_t olinebits, size_t ilinebits, unsigned h)
 {
@@ -5510,6 +6650,15 @@ static void Adam7_interlace(unsigned char* out, const unsigned char* in, unsigne
   }
 }
 
+/*the buffer for the filtered image, owned by the encoder context if there is one. Otherwise the
+caller frees it.*/
+static unsigned char* scanlines_alloc(size_t size, const LodePNGEncoderSettings* settings)
+{
+  LodePNGEncoderContext* context = settings->zlibsettings.context;
+  if(context) return encoder_context_buffer(&context->scanlines, &context->scanlinessize, size);
+  return (unsigned char*)lodepng_malloc(size);
+}
+
 /*out must be buffer big enough to contain uncompressed IDAT chunk data, and in must contain the full image.
 return value is error**/
 static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const unsigned char* in,
@@ -5527,7 +6676,7 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
   if(info_png->interlace_method == 0)
   {
     *outsize = h + (h * ((w * bpp + 7) / 8)); /*image size plus an extra byte per scanline + possible padding bits*/
-    *out = (unsigned char*)lodepng_malloc(*outsize);
+    *out = scanlines_alloc(*outsize, settings);
     if(!(*out) && (*outsize)) error = 83; /*alloc fail*/
 
     if(!error)
@@ -5560,7 +6709,7 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
     Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
 
     *outsize = filter_passstart[7]; /*image size plus an extra byte per scanline + possible padding bits*/
-    *out = (unsigned char*)lodepng_malloc(*outsize);
+    *out = scanlines_alloc(*outsize, settings);
     if(!(*out)) error = 83; /*alloc fail*/
 
     adam7 = (unsigned char*)lodepng_malloc(passstart[7]);
@@ -5639,150 +6788,127 @@ static unsigned addUnknownChunks(ucvector* out, unsigned char* data, size_t data
 }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-unsigned lodepng_encode(unsigned char** out, size_t* outsize,
-                        const unsigned char* image, unsigned w, unsigned h,
-                        LodePNGState* state)
+/*the checks lodepng_encode and lodepng_encode_rows make before encoding*/
+static unsigned checkEncoderState(const LodePNGState* state)
 {
-  LodePNGInfo info;
-  ucvector outv;
-  unsigned char* data = 0; /*uncompressed version of the IDAT chunk data*/
-  size_t datasize = 0;
-
-  /*provide some proper output values if error will happen*/
-  *out = 0;
-  *outsize = 0;
-  state->error = 0;
-
-  /*check input values validity*/
+  unsigned error;
   if((state->info_png.color.colortype == LCT_PALETTE || state->encoder.force_palette)
       && (state->info_png.color.palettesize == 0 || state->info_png.color.palettesize > 256))
   {
-    CERROR_RETURN_ERROR(state->error, 68); /*invalid palette size, it is only allowed to be 1-256*/
+    return 68; /*invalid palette size, it is only allowed to be 1-256*/
   }
   if(state->encoder.zlibsettings.btype > 2)
   {
-    CERROR_RETURN_ERROR(state->error, 61); /*error: unexisting btype*/
+    return 61; /*error: unexisting btype*/
   }
   if(state->info_png.interlace_method > 1)
   {
-    CERROR_RETURN_ERROR(state->error, 71); /*error: unexisting interlace mode*/
+    return 71; /*error: unexisting interlace mode*/
   }
-  state->error = checkColorValidity(state->info_png.color.colortype, state->info_png.color.bitdepth);
-  if(state->error) return state->error; /*error: unexisting color type given*/
-  state->error = checkColorValidity(state->info_raw.colortype, state->info_raw.bitdepth);
-  if(state->error) return state->error; /*error: unexisting color type given*/
+  error = checkColorValidity(state->info_png.color.colortype, state->info_png.color.bitdepth);
+  if(error) return error; /*error: unexisting color type given*/
+  return checkColorValidity(state->info_raw.colortype, state->info_raw.bitdepth);
+}
 
-  /* color convert and compute scanline filter types */
-  lodepng_info_init(&info);
-  lodepng_info_copy(&info, &state->info_png);
-  if(state->encoder.auto_convert)
+/*the compress settings for the IDAT data of an image with the color mode and interlacing of info*/
+static void getIdatCompressSettings(LodePNGCompressSettings* zlibsettings, unsigned w, const LodePNGInfo* info,
+                                    const LodePNGEncoderSettings* settings)
+{
+  *zlibsettings = settings->zlibsettings;
+  /*without interlacing every scanline, filter byte included, lines up with the one above*/
+  if(info->interlace_method == 0 && zlibsettings->rowstride == 0)
   {
-    state->error = lodepng_auto_choose_color(&info.color, image, w, h, &state->info_raw);
-  }
-  if (!state->error)
-  {
-    if(!lodepng_color_mode_equal(&state->info_raw, &info.color))
-    {
-      unsigned char* converted;
-      size_t size = (w * h * (size_t)lodepng_get_bpp(&info.color) + 7) / 8;
-
-      converted = (unsigned char*)lodepng_malloc(size);
-      if(!converted && size) state->error = 83; /*alloc fail*/
-      if(!state->error)
-      {
-        state->error = lodepng_convert(converted, image, &info.color, &state->info_raw, w, h);
-      }
-      if(!state->error) preProcessScanlines(&data, &datasize, converted, w, h, &info, &state->encoder);
-      lodepng_free(converted);
-    }
-    else preProcessScanlines(&data, &datasize, image, w, h, &info, &state->encoder);
+    zlibsettings->rowstride = (unsigned)(1 + (w * (size_t)lodepng_get_bpp(&info->color) + 7) / 8);
   }
+}
 
-  /* output all PNG chunks */
-  ucvector_init(&outv);
+/*writes all chunks of the PNG described by info, with zlibdata as the content of the IDAT chunk*/
+static unsigned writeChunks(ucvector* out, unsigned w, unsigned h, const LodePNGInfo* info, LodePNGState* state,
+                            const unsigned char* zlibdata, size_t zlibsize)
+{
   while(!state->error) /*while only executed once, to break on error*/
   {
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
     size_t i;
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
     /*write signature and chunks*/
-    writeSignature(&outv);
+    writeSignature(out);
     /*IHDR*/
-    addChunk_IHDR(&outv, w, h, info.color.colortype, info.color.bitdepth, info.interlace_method);
+    addChunk_IHDR(out, w, h, info->color.colortype, info->color.bitdepth, info->interlace_method);
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
     /*unknown chunks between IHDR and PLTE*/
-    if(info.unknown_chunks_data[0])
+    if(info->unknown_chunks_data[0])
     {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[0], info.unknown_chunks_size[0]);
+      state->error = addUnknownChunks(out, info->unknown_chunks_data[0], info->unknown_chunks_size[0]);
       if(state->error) break;
     }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
     /*PLTE*/
-    if(info.color.colortype == LCT_PALETTE)
+    if(info->color.colortype == LCT_PALETTE)
     {
-      addChunk_PLTE(&outv, &info.color);
+      addChunk_PLTE(out, &info->color);
     }
-    if(state->encoder.force_palette && (info.color.colortype == LCT_RGB || info.color.colortype == LCT_RGBA))
+    if(state->encoder.force_palette && (info->color.colortype == LCT_RGB || info->color.colortype == LCT_RGBA))
     {
-      addChunk_PLTE(&outv, &info.color);
+      addChunk_PLTE(out, &info->color);
     }
     /*tRNS*/
-    if(info.color.colortype == LCT_PALETTE && getPaletteTranslucency(info.color.palette, info.color.palettesize) != 0)
+    if(info->color.colortype == LCT_PALETTE && getPaletteTranslucency(info->color.palette, info->color.palettesize) != 0)
     {
-      addChunk_tRNS(&outv, &info.color);
+      addChunk_tRNS(out, &info->color);
     }
-    if((info.color.colortype == LCT_GREY || info.color.colortype == LCT_RGB) && info.color.key_defined)
+    if((info->color.colortype == LCT_GREY || info->color.colortype == LCT_RGB) && info->color.key_defined)
     {
-      addChunk_tRNS(&outv, &info.color);
+      addChunk_tRNS(out, &info->color);
     }
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
     /*bKGD (must come between PLTE and the IDAt chunks*/
-    if(info.background_defined) addChunk_bKGD(&outv, &info);
+    if(info->background_defined) addChunk_bKGD(out, info);
     /*pHYs (must come before the IDAT chunks)*/
-    if(info.phys_defined) addChunk_pHYs(&outv, &info);
+    if(info->phys_defined) addChunk_pHYs(out, info);
 
     /*unknown chunks between PLTE and IDAT*/
-    if(info.unknown_chunks_data[1])
+    if(info->unknown_chunks_data[1])
     {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[1], info.unknown_chunks_size[1]);
+      state->error = addUnknownChunks(out, info->unknown_chunks_data[1], info->unknown_chunks_size[1]);
       if(state->error) break;
     }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
     /*IDAT (multiple IDAT chunks must be consecutive)*/
-    state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
+    state->error = addChunk(out, "IDAT", zlibdata, zlibsize);
     if(state->error) break;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
     /*tIME*/
-    if(info.time_defined) addChunk_tIME(&outv, &info.time);
+    if(info->time_defined) addChunk_tIME(out, &info->time);
     /*tEXt and/or zTXt*/
-    for(i = 0; i != info.text_num; ++i)
+    for(i = 0; i != info->text_num; ++i)
     {
-      if(strlen(info.text_keys[i]) > 79)
+      if(strlen(info->text_keys[i]) > 79)
       {
         state->error = 66; /*text chunk too large*/
         break;
       }
-      if(strlen(info.text_keys[i]) < 1)
+      if(strlen(info->text_keys[i]) < 1)
       {
         state->error = 67; /*text chunk too small*/
         break;
       }
       if(state->encoder.text_compression)
       {
-        addChunk_zTXt(&outv, info.text_keys[i], info.text_strings[i], &state->encoder.zlibsettings);
+        addChunk_zTXt(out, info->text_keys[i], info->text_strings[i], &state->encoder.zlibsettings);
       }
       else
       {
-        addChunk_tEXt(&outv, info.text_keys[i], info.text_strings[i]);
+        addChunk_tEXt(out, info->text_keys[i], info->text_strings[i]);
       }
     }
     /*LodePNG version id in text chunk*/
     if(state->encoder.add_id)
     {
       unsigned alread_added_id_text = 0;
-      for(i = 0; i != info.text_num; ++i)
+      for(i = 0; i != info->text_num; ++i)
       {
-        if(!strcmp(info.text_keys[i], "LodePNG"))
+        if(!strcmp(info->text_keys[i], "LodePNG"))
         {
           alread_added_id_text = 1;
           break;
@@ -5790,41 +6916,200 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
       }
       if(alread_added_id_text == 0)
       {
-        addChunk_tEXt(&outv, "LodePNG", LODEPNG_VERSION_STRING); /*it's shorter as tEXt than as zTXt chunk*/
+        addChunk_tEXt(out, "LodePNG", LODEPNG_VERSION_STRING); /*it's shorter as tEXt than as zTXt chunk*/
       }
     }
     /*iTXt*/
-    for(i = 0; i != info.itext_num; ++i)
+    for(i = 0; i != info->itext_num; ++i)
     {
-      if(strlen(info.itext_keys[i]) > 79)
+      if(strlen(info->itext_keys[i]) > 79)
       {
         state->error = 66; /*text chunk too large*/
         break;
       }
-      if(strlen(info.itext_keys[i]) < 1)
+      if(strlen(info->itext_keys[i]) < 1)
       {
         state->error = 67; /*text chunk too small*/
         break;
       }
-      addChunk_iTXt(&outv, state->encoder.text_compression,
-                    info.itext_keys[i], info.itext_langtags[i], info.itext_transkeys[i], info.itext_strings[i],
+      addChunk_iTXt(out, state->encoder.text_compression,
+                    info->itext_keys[i], info->itext_langtags[i], info->itext_transkeys[i], info->itext_strings[i],
                     &state->encoder.zlibsettings);
     }
 
     /*unknown chunks between IDAT and IEND*/
-    if(info.unknown_chunks_data[2])
+    if(info->unknown_chunks_data[2])
     {
-      state->error = addUnknownChunks(&outv, info.unknown_chunks_data[2], info.unknown_chunks_size[2]);
+      state->error = addUnknownChunks(out, info->unknown_chunks_data[2], info->unknown_chunks_size[2]);
       if(state->error) break;
     }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
-    addChunk_IEND(&outv);
+    addChunk_IEND(out);
 
     break; /*this isn't really a while loop; no error happened so break out now!*/
   }
 
+  return state->error;
+}
+
+unsigned lodepng_encode(unsigned char** out, size_t* outsize,
+                        const unsigned char* image, unsigned w, unsigned h,
+                        LodePNGState* state)
+{
+  LodePNGInfo info;
+  ucvector outv;
+  ucvector zlibdata; /*the IDAT data*/
+  unsigned char* data = 0; /*uncompressed version of the IDAT chunk data*/
+  size_t datasize = 0;
+  LodePNGEncoderContext* context = state->encoder.zlibsettings.context; /*owns data if set*/
+
+  /*provide some proper output values if error will happen*/
+  *out = 0;
+  *outsize = 0;
+  state->error = 0;
+
+  /*check input values validity*/
+  state->error = checkEncoderState(state);
+  if(state->error) return state->error;
+
+  /* color convert and compute scanline filter types */
+  lodepng_info_init(&info);
+  lodepng_info_copy(&info, &state->info_png);
+  if(state->encoder.auto_convert)
+  {
+    state->error = lodepng_auto_choose_color(&info.color, image, w, h, &state->info_raw);
+  }
+  if (!state->error)
+  {
+    if(!lodepng_color_mode_equal(&state->info_raw, &info.color))
+    {
+      unsigned char* converted;
+      size_t size = (w * h * (size_t)lodepng_get_bpp(&info.color) + 7) / 8;
+
+      if(context) converted = encoder_context_buffer(&context->converted, &context->convertedsize, size);
+      else converted = (unsigned char*)lodepng_malloc(size);
+      if(!converted && size) state->error = 83; /*alloc fail*/
+      if(!state->error)
+      {
+        state->error = lodepng_convert(converted, image, &info.color, &state->info_raw, w, h);
+      }
+      if(!state->error) preProcessScanlines(&data, &datasize, converted, w, h, &info, &state->encoder);
+      if(!context) lodepng_free(converted);
+    }
+    else preProcessScanlines(&data, &datasize, image, w, h, &info, &state->encoder);
+  }
+
+  /*compress the filtered image*/
+  ucvector_init(&zlibdata);
+  if(!state->error)
+  {
+    LodePNGCompressSettings zlibsettings;
+    getIdatCompressSettings(&zlibsettings, w, &info, &state->encoder);
+    state->error = zlib_compress(&zlibdata.data, &zlibdata.size, data, datasize, &zlibsettings);
+  }
+  if(!context) lodepng_free(data);
+
+  /* output all PNG chunks */
+  ucvector_init(&outv);
+  if(!state->error) state->error = writeChunks(&outv, w, h, &info, state, zlibdata.data, zlibdata.size);
+  ucvector_cleanup(&zlibdata);
+
   lodepng_info_cleanup(&info);
-  lodepng_free(data);
+  /*instead of cleaning the vector up, give it to the output*/
+  *out = outv.data;
+  *outsize = outv.size;
+
+  return state->error;
+}
+
+unsigned lodepng_encode_rows(unsigned char** out, size_t* outsize, LodePNGRowCallback callback, void* userdata,
+                             unsigned w, unsigned h, LodePNGState* state)
+{
+  RowFilter rowfilter;
+  LodePNGCompressSettings zlibsettings;
+  ucvector outv;
+  ucvector zlibdata; /*the IDAT data*/
+  unsigned char* data = 0; /*the filtered image, if it is compressed as a whole*/
+  size_t linebytes = (w * (size_t)lodepng_get_bpp(&state->info_png.color) + 7) / 8;
+  size_t datasize = h * (linebytes + 1);
+  LodePNGEncoderContext* context = state->encoder.zlibsettings.context; /*owns data if set*/
+  unsigned streamed = 0; /*whether the scanlines are compressed as they come*/
+  unsigned y;
+#ifdef LODEPNG_COMPILE_ZLIB
+  ZlibStream stream;
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
+  *out = 0;
+  *outsize = 0;
+  state->error = checkEncoderState(state);
+  if(state->error) return state->error;
+  if(state->info_png.interlace_method != 0)
+  {
+    CERROR_RETURN_ERROR(state->error, 95); /*Adam7 needs the whole image*/
+  }
+
+  getIdatCompressSettings(&zlibsettings, w, &state->info_png, &state->encoder);
+#ifdef LODEPNG_COMPILE_ZLIB
+  /*the threaded and custom compressors, and the other block types, take the whole filtered image*/
+  streamed = zlibsettings.btype == 2 && !zlibsettings.custom_zlib && !zlibsettings.custom_deflate;
+#ifdef LODEPNG_COMPILE_THREADS
+  if(zlibsettings.numthreads > 1) streamed = 0;
+#endif /*LODEPNG_COMPILE_THREADS*/
+#endif /*LODEPNG_COMPILE_ZLIB*/
+
+  ucvector_init(&zlibdata);
+  state->error = rowfilter_init(&rowfilter, w, &state->info_png.color, &state->encoder);
+#ifdef LODEPNG_COMPILE_ZLIB
+  if(streamed)
+  {
+    unsigned error = zlib_stream_init(&stream, datasize, &zlibsettings);
+    if(!state->error) state->error = error;
+  }
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  if(!state->error && !streamed)
+  {
+    data = scanlines_alloc(datasize, &state->encoder);
+    if(!data && datasize) state->error = 83; /*alloc fail*/
+  }
+
+  for(y = 0; y != h && !state->error; ++y)
+  {
+    state->error = callback(&rowfilter.raw[linebytes], y, userdata);
+    if(state->error) break;
+    rowfilter_apply(&rowfilter, y, &state->encoder);
+#ifdef LODEPNG_COMPILE_ZLIB
+    if(streamed)
+    {
+      state->error = zlib_stream_write(&stream, &rowfilter.filtered[linebytes + 1], linebytes + 1);
+      continue;
+    }
+#endif /*LODEPNG_COMPILE_ZLIB*/
+    memcpy(&data[y * (linebytes + 1)], &rowfilter.filtered[linebytes + 1], linebytes + 1);
+  }
+  rowfilter_cleanup(&rowfilter, &state->encoder);
+
+#ifdef LODEPNG_COMPILE_ZLIB
+  if(streamed)
+  {
+    if(!state->error) state->error = zlib_stream_finish(&stream);
+    if(!state->error)
+    {
+      zlibdata = stream.out;
+      ucvector_init(&stream.out);
+    }
+    zlib_stream_cleanup(&stream);
+  }
+#endif /*LODEPNG_COMPILE_ZLIB*/
+  if(!state->error && !streamed)
+  {
+    state->error = zlib_compress(&zlibdata.data, &zlibdata.size, data, datasize, &zlibsettings);
+  }
+  if(!context) lodepng_free(data);
+
+  ucvector_init(&outv);
+  if(!state->error) state->error = writeChunks(&outv, w, h, &state->info_png, state, zlibdata.data, zlibdata.size);
+  ucvector_cleanup(&zlibdata);
+
   /*instead of cleaning the vector up, give it to the output*/
   *out = outv.data;
   *outsize = outv.size;
@@ -5889,6 +7174,7 @@ void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings)
   settings->auto_convert = 1;
   settings->force_palette = 0;
   settings->predefined_filters = 0;
+  settings->filter_threads = 1;
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   settings->add_id = 0;
   settings->text_compression = 1;
@@ -6000,6 +7286,7 @@ const char* lodepng_error_text(unsigned code)
     case 92: return "too many pixels, not supported";
     case 93: return "zero width or height is invalid";
     case 94: return "header chunk must have a size of 13 bytes";
+    case 95: return "interlaced images can't be encoded a scanline at a time";
   }
   return "unknown error code";
 }
@@ -6101,6 +7388,47 @@ State& State::operator=(const State& other)
   lodepng_state_copy(this, &other);
   return *this;
 }
+#endif /*LODEPNG_COMPILE_PNG*/
+
+#ifdef LODEPNG_COMPILE_DECODER
+
+DecoderContext::DecoderContext()
+{
+  context = lodepng_decoder_context_new();
+}
+
+DecoderContext::~DecoderContext()
+{
+  lodepng_decoder_context_delete(context);
+}
+
+LodePNGDecoderContext* DecoderContext::get() const
+{
+  return context;
+}
+
+#endif /*LODEPNG_COMPILE_DECODER*/
+
+#ifdef LODEPNG_COMPILE_ENCODER
+
+EncoderContext::EncoderContext()
+{
+  context = lodepng_encoder_context_new();
+}
+
+EncoderContext::~EncoderContext()
+{
+  lodepng_encoder_context_delete(context);
+}
+
+LodePNGEncoderContext* EncoderContext::get() const
+{
+  return context;
+}
+
+#endif /*LODEPNG_COMPILE_ENCODER*/
+
+#ifdef LODEPNG_COMPILE_PNG
 
 #ifdef LODEPNG_COMPILE_DECODER
 
@@ -6207,6 +7535,21 @@ unsigned encode(std::vector<unsigned char>& out,
   return encode(out, in.empty() ? 0 : &in[0], w, h, state);
 }
 
+unsigned encode_rows(std::vector<unsigned char>& out,
+                     LodePNGRowCallback callback, void* userdata, unsigned w, unsigned h,
+                     State& state)
+{
+  unsigned char* buffer;
+  size_t buffersize;
+  unsigned error = lodepng_encode_rows(&buffer, &buffersize, callback, userdata, w, h, &state);
+  if(buffer)
+  {
+    out.insert(out.end(), &buffer[0], &buffer[buffersize]);
+    lodepng_free(buffer);
+  }
+  return error;
+}
+
 #ifdef LODEPNG_COMPILE_DISK
 unsigned encode(const std::string& filename,
                 const unsigned char* in, unsigned w, unsigned h,
@@ -80,6 +80,19 @@ source files with custom allocators.*/
 #define LODEPNG_COMPILE_CPP
 #endif
 #endif
+/*multithreaded deflate encoding and filter selection (uses std::thread, so only available when compiling as C++)*/
+#ifdef __cplusplus
+#ifndef LODEPNG_NO_COMPILE_THREADS
+#define LODEPNG_COMPILE_THREADS
+#endif
+#endif
+/*SSE2 and AVX2 versions of the encoder's scanline filters, picked at runtime (x86-64 with gcc or clang only).
+They give the same bytes as the portable code.*/
+#if defined(__GNUC__) && defined(__x86_64__)
+#ifndef LODEPNG_NO_COMPILE_SIMD
+#define LODEPNG_COMPILE_SIMD
+#endif
+#endif
 
 #ifdef LODEPNG_COMPILE_CPP
 #include <vector>
@@ -252,11 +265,26 @@ const char* lodepng_error_text(unsigned code);
 
 #ifdef LODEPNG_COMPILE_DECODER
 /*Settings for zlib decompression*/
+/*
+Memory the decoder keeps between calls instead of allocating it for every block and file: the
+Huffman trees of the inflator and the IDAT and scanline buffers of the PNG decoder. Worth it when
+decoding many images in a row. Create one with lodepng_decoder_context_new, point
+LodePNGDecompressSettings::context at it and free it with lodepng_decoder_context_delete when done.
+A context must not be used by two decodes at the same time, use one per thread.
+*/
+typedef struct LodePNGDecoderContext LodePNGDecoderContext;
+/*returns NULL if out of memory*/
+LodePNGDecoderContext* lodepng_decoder_context_new(void);
+void lodepng_decoder_context_delete(LodePNGDecoderContext* context);
+
 typedef struct LodePNGDecompressSettings LodePNGDecompressSettings;
 struct LodePNGDecompressSettings
 {
   unsigned ignore_adler32; /*if 1, continue and don't give an error message if the Adler32 checksum is corrupted*/
 
+  /*memory reused between decodes, see LodePNGDecoderContext. Default: NULL*/
+  LodePNGDecoderContext* context;
+
   /*use custom zlib decoder instead of built in one (default: null)*/
   unsigned (*custom_zlib)(unsigned char**, size_t*,
                           const unsigned char*, size_t,
@@ -276,6 +304,32 @@ void lodepng_decompress_settings_init(LodePNGDecompressSettings* settings);
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 #ifdef LODEPNG_COMPILE_ENCODER
+/*How the deflate encoder searches for LZ77 matches. Default: LMS_HASH*/
+typedef enum LodePNGMatchStrategy
+{
+  /*hash chains over the whole window, tuned by windowsize, maxchainlength, nicematch and lazymatching*/
+  LMS_HASH,
+  /*LMS_HASH, but first tries the run of one repeated byte (distance 1) and the repeat of the
+  previous row (distance rowstride), and only walks the hash chain when neither gives a match of
+  at least 16 bytes. Meant for images made of large flat rectangles, where it rarely has to.*/
+  LMS_RLE,
+  /*LMS_RLE if nearly every byte repeats its left or upper neighbour, LMS_HASH otherwise*/
+  LMS_AUTO
+} LodePNGMatchStrategy;
+
+/*
+Scratch memory the encoder keeps between calls instead of allocating it for every image: the LZ77
+hash tables, the LZ77 symbols of a block, the filter candidate rows and the filtered and color
+converted image. Worth it when encoding many images in a row. Create one with
+lodepng_encoder_context_new, point LodePNGCompressSettings::context at it and free it with
+lodepng_encoder_context_delete when done. A context must not be used by two encodes at the same
+time, use one per thread.
+*/
+typedef struct LodePNGEncoderContext LodePNGEncoderContext;
+/*returns NULL if out of memory*/
+LodePNGEncoderContext* lodepng_encoder_context_new(void);
+void lodepng_encoder_context_delete(LodePNGEncoderContext* context);
+
 /*
 Settings for zlib compression. Tweaking these settings tweaks the balance
 between speed and compression ratio.
@@ -290,6 +344,22 @@ struct LodePNGCompressSettings /*deflate = compress*/
   unsigned minmatch; /*mininum lz77 length. 3 is normally best, 6 can be better for some PNGs. Default: 0*/
   unsigned nicematch; /*stop searching if >= this length found. Set to 258 for best compression. Default: 128*/
   unsigned lazymatching; /*use lazy matching: better compression but a bit slower. Default: true*/
+  /*max hash chain entries tried per position. 0 picks it from windowsize: the full window from 8192
+  up, windowsize / 8 below that. 1 is a single probe. Default: 0*/
+  unsigned maxchainlength;
+  LodePNGMatchStrategy strategy; /*LZ77 match finder, see LodePNGMatchStrategy. Default: LMS_HASH*/
+  /*distance of the row-repeat matches of LMS_RLE, 0 for none; ignored if larger than windowsize. The
+  PNG encoder sets it to the scanline length (filter byte included) of non-interlaced images when left
+  at 0. Default: 0*/
+  unsigned rowstride;
+
+  /*Number of threads to deflate the independent blocks of a btype 2 stream with. Each block then
+  gets its own hash table, primed with the preceding window. 0 or 1 encodes serially. Ignored
+  without LODEPNG_COMPILE_THREADS. Default: 1*/
+  unsigned numthreads;
+
+  /*scratch memory reused between encodes, see LodePNGEncoderContext. Default: NULL*/
+  LodePNGEncoderContext* context;
 
   /*use custom zlib encoder instead of built in one (default: null)*/
   unsigned (*custom_zlib)(unsigned char**, size_t*,
@@ -307,6 +377,14 @@ struct LodePNGCompressSettings /*deflate = compress*/
 
 extern const LodePNGCompressSettings lodepng_default_compress_settings;
 void lodepng_compress_settings_init(LodePNGCompressSettings* settings);
+
+/*
+Sets the LZ77 and block type settings to a zlib style compression level, trading speed for size.
+0 stores uncompressed, 1 is greedy matching with a single hash probe, 6 equals the defaults of
+lodepng_compress_settings_init and 9 searches the full 32768 window. Levels above 9 act as 9.
+Leaves strategy, rowstride, numthreads, context and the custom functions as they are.
+*/
+void lodepng_compress_settings_set_level(LodePNGCompressSettings* settings, unsigned level);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_PNG
@@ -601,6 +679,10 @@ typedef struct LodePNGEncoderSettings
   have to cleanup this buffer, LodePNG will never free it. Don't forget that filter_palette_zero
   must be set to 0 to ensure this is also used on palette or low bitdepth images.*/
   const unsigned char* predefined_filters;
+  /*number of threads choosing the filters for LFS_MINSUM, LFS_ENTROPY and LFS_BRUTE_FORCE, each taking
+  bands of scanlines. Gives the same result for any count; 0 or 1 filters serially. Ignored without
+  LODEPNG_COMPILE_THREADS. Default: 1*/
+  unsigned filter_threads;
 
   /*force creating a PLTE chunk if colortype is 2 or 6 (= a suggested palette).
   If colortype is 3, PLTE is _always_ created.*/
@@ -614,6 +696,15 @@ typedef struct LodePNGEncoderSettings
 } LodePNGEncoderSettings;
 
 void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings);
+
+#ifdef LODEPNG_COMPILE_SIMD
+/*Caps the instruction sets the scanline filters use: 0 only the portable code, 1 up to SSE2, 2 up to
+AVX2 (the default). Returns the level in effect, lower than asked if the CPU lacks AVX2. For testing and
+benchmarking the kernels against the portable code; not to be changed while an image is being encoded.*/
+unsigned lodepng_set_simd_level(unsigned level);
+/*The level in effect, see lodepng_set_simd_level.*/
+unsigned lodepng_get_simd_level(void);
+#endif /*LODEPNG_COMPILE_SIMD*/
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 
@@ -667,6 +758,25 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h,
 unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                         const unsigned char* image, unsigned w, unsigned h,
                         LodePNGState* state);
+
+/*
+Gives scanline y of an image encoded with lodepng_encode_rows: (w * bpp + 7) / 8 bytes in the color
+mode of info_png.color, with the pixels packed as in a raw image and any unused bits of the last byte 0.
+A nonzero return value stops the encoding and becomes its error.
+*/
+typedef unsigned (*LodePNGRowCallback)(unsigned char* row, unsigned y, void* userdata);
+
+/*
+Same as lodepng_encode, but the image is pulled from callback one scanline at a time, top to bottom,
+instead of being passed as a buffer. Each scanline is filtered and compressed as soon as it is given, so
+only two scanlines and the deflate window plus two deflate blocks are held, not the whole image. The
+scanlines must be in the color mode of info_png.color: info_raw and auto_convert are not used. Adam7
+interlacing isn't possible. With numthreads > 1, btype 0 or 1, or a custom zlib or deflate function, the
+filtered image is collected (h * (1 + scanline bytes)) and compressed as a whole.
+*/
+unsigned lodepng_encode_rows(unsigned char** out, size_t* outsize,
+                             LodePNGRowCallback callback, void* userdata, unsigned w, unsigned h,
+                             LodePNGState* state);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 /*
@@ -825,6 +935,41 @@ class State : public LodePNGState
     virtual ~State();
     State& operator=(const State& other);
 };
+#endif /*LODEPNG_COMPILE_PNG*/
+
+#ifdef LODEPNG_COMPILE_DECODER
+/*Owns a LodePNGDecoderContext. Set get() as the context of the decompress settings. get() is NULL if
+the context couldn't be allocated, which only means nothing is reused.*/
+class DecoderContext
+{
+  public:
+    DecoderContext();
+    ~DecoderContext();
+    LodePNGDecoderContext* get() const;
+  private:
+    DecoderContext(const DecoderContext& other); /*not copyable*/
+    DecoderContext& operator=(const DecoderContext& other);
+    LodePNGDecoderContext* context;
+};
+#endif /*LODEPNG_COMPILE_DECODER*/
+
+#ifdef LODEPNG_COMPILE_ENCODER
+/*Owns a LodePNGEncoderContext. Set get() as the context of the compress settings. get() is NULL if
+the context couldn't be allocated, which only means nothing is reused.*/
+class EncoderContext
+{
+  public:
+    EncoderContext();
+    ~EncoderContext();
+    LodePNGEncoderContext* get() const;
+  private:
+    EncoderContext(const EncoderContext& other); /*not copyable*/
+    EncoderContext& operator=(const EncoderContext& other);
+    LodePNGEncoderContext* context;
+};
+#endif /*LODEPNG_COMPILE_ENCODER*/
+
+#ifdef LODEPNG_COMPILE_PNG
 
 #ifdef LODEPNG_COMPILE_DECODER
 /* Same as other lodepng::decode, but using a State for more settings and information. */
@@ -844,6 +989,10 @@ unsigned encode(std::vector<unsigned char>& out,
 unsigned encode(std::vector<unsigned char>& out,
                 const std::vector<unsigned char>& in, unsigned w, unsigned h,
                 State& state);
+/* Same as lodepng_encode_rows: the scanlines are pulled from callback. */
+unsigned encode_rows(std::vector<unsigned char>& out,
+                     LodePNGRowCallback callback, void* userdata, unsigned w, unsigned h,
+                     State& state);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_DISK
@@ -12,6 +12,10 @@
 #include <string>
 
 #include "qtree.h"
+#include "qtreeview.h"
+#include "cs221util/Metrics.h"
+#include "cs221util/SyntheticImage.h"
+#include "cs221util/lodepng/lodepng.h"
 
 using namespace std;
 
@@ -22,6 +26,21 @@ void TestBuildRender(unsigned int scale);
 void TestFlipHorizontal();
 void TestRotateCCW();
 void TestPrune(double tol);
+void TestWritePNG(double tol, unsigned int scale);
+void TestSaveLoad(double tol);
+void TestEncodeDecode(double tol);
+void TestView(unsigned int scale);
+void TestLoadRegion(double tol);
+void TestProgressive(double tol);
+void TestTreePNG(unsigned int scale);
+void TestSynthetic(double tol);
+void TestTune(double psnr);
+void TestMetrics(double tol);
+void TestParallelDeflate(unsigned int threads);
+void TestWideRunLength(unsigned int scale);
+void TestSIMDFilters();
+void TestPrunedRenderScale(double tol, unsigned int scale);
+void TestTrustedInput();
 
 /***********************************/
 /*** MAIN FUNCTION PROGRAM ENTRY ***/
@@ -35,6 +54,22 @@ int main(int argc, char* argv[]) {
 	TestRotateCCW();
 	TestPrune(0.01);
 	TestPrune(0.05);
+	TestWritePNG(0.05, 1);
+	TestWritePNG(0.05, 4);
+	TestSaveLoad(0.05);
+	TestEncodeDecode(0.05);
+	TestView(4);
+	TestLoadRegion(0.05);
+	TestProgressive(0.05);
+	TestTreePNG(4);
+	TestSynthetic(0.05);
+	TestTune(30);
+	TestMetrics(0.05);
+	TestParallelDeflate(4);
+	TestWideRunLength(8);
+	TestSIMDFilters();
+	TestPrunedRenderScale(0.05, 3);
+	TestTrustedInput();
 
 	return 0;
 }
@@ -209,4 +244,580 @@ void TestPrune(double tol) {
 	cout << "done." << endl;
 
 	cout << "Exiting TestPrune.\n" << endl;
-}
\ No newline at end of file
+}
+
+void TestWritePNG(double tol, unsigned int scale) {
+	cout << "Entered TestWritePNG, tolerance: " << tol << ", scale: " << scale << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/malachi-60x87.png");
+
+	cout << "Constructing QTree from image... ";
+	QTree t(input);
+	cout << "done." << endl;
+
+	cout << "Calling Prune... ";
+	t.Prune(tol);
+	cout << "done." << endl;
+
+	// write output PNG straight from the tree
+	string outfilename = "images-output/malachi-prune_" + to_string(tol) + "-writepng_x" + to_string(scale) + ".png";
+	cout << "Writing tree to PNG file at x" << scale << " scale... ";
+	t.WritePNG(outfilename, scale);
+	cout << "done." << endl;
+
+	PNG written;
+	written.readFromFile(outfilename);
+	cout << "Written PNG " << (written == t.Render(scale) ? "matches" : "DOES NOT match") << " the rendered tree." << endl;
+
+	cout << "Exiting TestWritePNG.\n" << endl;
+}
+
+void TestSaveLoad(double tol) {
+	cout << "Entered TestSaveLoad, tolerance: " << tol << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	cout << "Constructing QTree from image... ";
+	QTree t(input);
+	cout << "done." << endl;
+
+	cout << "Calling Prune and RotateCCW... ";
+	t.Prune(tol);
+	t.RotateCCW();
+	cout << "done." << endl;
+
+	string outfilename = "images-output/kkkk_nnkm-256x224-prune_" + to_string(tol) + "-rotateccw.qtree";
+	cout << "Saving tree to file... ";
+	t.Save(outfilename);
+	cout << "done." << endl;
+
+	cout << "Loading tree from file... ";
+	QTree loaded;
+	loaded.Load(outfilename);
+	cout << "done." << endl;
+
+	cout << "Loaded tree contains " << loaded.CountNodes() << " nodes and " << loaded.CountLeaves() << " leaves." << endl;
+
+	cout << "Rendering loaded tree to PNG at x1 scale... ";
+	PNG output = loaded.Render(1);
+	cout << "done." << endl;
+	cout << "Loaded tree " << (output == t.Render(1) ? "matches" : "DOES NOT match") << " the saved tree." << endl;
+
+	// write output PNG
+	outfilename = "images-output/kkkk_nnkm-256x224-prune_" + to_string(tol) + "-rotateccw-load-render_x1.png";
+	cout << "Writing rendered PNG to file... ";
+	output.writeToFile(outfilename);
+	cout << "done." << endl;
+
+	cout << "Exiting TestSaveLoad.\n" << endl;
+}
+
+void TestEncodeDecode(double tol) {
+	cout << "Entered TestEncodeDecode, tolerance: " << tol << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	cout << "Constructing QTree from image... ";
+	QTree t(input);
+	cout << "done." << endl;
+
+	cout << "Calling Prune... ";
+	t.Prune(tol);
+	cout << "done." << endl;
+
+	cout << "Encoding tree... ";
+	vector<unsigned char> stream;
+	t.Encode(stream);
+	cout << "done." << endl;
+	cout << "Stream is " << stream.size() << " bytes for " << t.CountLeaves() << " leaves." << endl;
+
+	cout << "Decoding tree... ";
+	QTree decoded;
+	decoded.Decode(stream);
+	cout << "done." << endl;
+
+	cout << "Rendering decoded tree to PNG at x1 scale... ";
+	PNG output = decoded.Render(1);
+	cout << "done." << endl;
+	cout << "Decoded tree " << (output == t.Render(1) ? "matches" : "DOES NOT match") << " the encoded tree." << endl;
+
+	// write output PNG
+	string outfilename = "images-output/kkkk_nnkm-256x224-prune_" + to_string(tol) + "-decode-render_x1.png";
+	cout << "Writing rendered PNG to file... ";
+	output.writeToFile(outfilename);
+	cout << "done." << endl;
+
+	cout << "Exiting TestEncodeDecode.\n" << endl;
+}
+
+void TestView(unsigned int scale) {
+	cout << "Entered TestView, scale: " << scale << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/malachi-60x87.png");
+
+	cout << "Constructing QTree from image... ";
+	QTree t(input);
+	cout << "done." << endl;
+
+	cout << "Calling Prune and FlipHorizontal... ";
+	t.Prune(0.05);
+	t.FlipHorizontal();
+	cout << "done." << endl;
+
+	string viewfilename = "images-output/malachi-prune_0.050000-fliphorizontal.qtreeview";
+	cout << "Saving tree view to file... ";
+	t.SaveView(viewfilename);
+	cout << "done." << endl;
+
+	cout << "Opening tree view... ";
+	QTreeView view;
+	view.Open(viewfilename);
+	cout << "done." << endl;
+
+	cout << "View contains " << view.CountLeaves() << " leaves." << endl;
+	cout << "Rendered view " << (view.Render(1) == t.Render(1) ? "matches" : "DOES NOT match") << " the rendered tree." << endl;
+
+	cout << "Rendering region (10,20)-(49,59) of view at x" << scale << " scale... ";
+	PNG output = view.RenderRegion(make_pair(10, 20), make_pair(49, 59), scale);
+	cout << "done." << endl;
+
+	// write output PNG
+	string outfilename = "images-output/malachi-prune_0.050000-fliphorizontal-view-region_x" + to_string(scale) + ".png";
+	cout << "Writing rendered PNG to file... ";
+	output.writeToFile(outfilename);
+	cout << "done." << endl;
+
+	cout << "Exiting TestView.\n" << endl;
+}
+
+void TestLoadRegion(double tol) {
+	cout << "Entered TestLoadRegion, tolerance: " << tol << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	cout << "Constructing QTree from image... ";
+	QTree t(input);
+	cout << "done." << endl;
+
+	cout << "Calling Prune... ";
+	t.Prune(tol);
+	cout << "done." << endl;
+
+	string tiledfilename = "images-output/kkkk_nnkm-256x224-prune_" + to_string(tol) + ".qtreetiled";
+	cout << "Saving tiled tree to file... ";
+	t.SaveTiled(tiledfilename, 3);
+	cout << "done." << endl;
+
+	cout << "Loading region (64,48)-(159,143) from file... ";
+	QTree region;
+	region.LoadRegion(tiledfilename, make_pair(64, 48), make_pair(159, 143));
+	cout << "done." << endl;
+
+	cout << "Region tree contains " << region.CountNodes() << " of " << t.CountNodes() << " nodes." << endl;
+
+	cout << "Rendering region tree to PNG at x1 scale... ";
+	PNG output = region.Render(1);
+	cout << "done." << endl;
+
+	PNG expected = t.Render(1);
+	bool matches = true;
+	for (unsigned int y = 48; y <= 143; y++) {
+		for (unsigned int x = 64; x <= 159; x++) {
+			matches = matches && *output.getPixel(x, y) == *expected.getPixel(x, y);
+		}
+	}
+	cout << "Region " << (matches ? "matches" : "DOES NOT match") << " the rendered tree." << endl;
+
+	// write output PNG
+	string outfilename = "images-output/kkkk_nnkm-256x224-prune_" + to_string(tol) + "-region-render_x1.png";
+	cout << "Writing rendered PNG to file... ";
+	output.writeToFile(outfilename);
+	cout << "done." << endl;
+
+	cout << "Exiting TestLoadRegion.\n" << endl;
+}
+
+void TestProgressive(double tol) {
+	cout << "Entered TestProgressive, tolerance: " << tol << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	cout << "Constructing QTree from image... ";
+	QTree t(input);
+	cout << "done." << endl;
+
+	cout << "Calling Prune... ";
+	t.Prune(tol);
+	cout << "done." << endl;
+
+	cout << "Encoding tree progressively... ";
+	vector<unsigned char> stream;
+	t.EncodeProgressive(stream);
+	cout << "done." << endl;
+	cout << "Stream is " << stream.size() << " bytes." << endl;
+
+	// deliver the stream in eighths, as if over a slow link
+	QTree received;
+	PNG preview;
+	vector<unsigned char> arrived;
+	for (int part = 1; part <= 8; part++) {
+		arrived.assign(stream.begin(), stream.begin() + stream.size() * part / 8);
+		received.DecodeProgressive(arrived, &preview, 1);
+		cout << "After " << arrived.size() << " bytes, preview has " << received.CountLeaves() << " leaves." << endl;
+
+		if (part == 2) {
+			// write output PNG
+			string outfilename = "images-output/kkkk_nnkm-256x224-prune_" + to_string(tol) + "-progressive-preview_x1.png";
+			cout << "Writing preview PNG to file... ";
+			preview.writeToFile(outfilename);
+			cout << "done." << endl;
+		}
+	}
+
+	cout << "Decoding is " << (received.ProgressiveComplete() ? "complete" : "NOT complete") << "." << endl;
+	cout << "Preview " << (preview == t.Render(1) ? "matches" : "DOES NOT match") << " the encoded tree." << endl;
+
+	cout << "Exiting TestProgressive.\n" << endl;
+}
+
+void TestTreePNG(unsigned int scale) {
+	cout << "Entered TestTreePNG, scale: " << scale << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/malachi-60x87.png");
+
+	cout << "Constructing QTree from image... ";
+	QTree t(input);
+	cout << "done." << endl;
+
+	cout << "Calling Prune and FlipHorizontal... ";
+	t.Prune(0.05);
+	t.FlipHorizontal();
+	cout << "done." << endl;
+
+	// write output PNG with the tree embedded
+	string outfilename = "images-output/malachi-prune_0.050000-fliphorizontal-treepng_x" + to_string(scale) + ".png";
+	cout << "Writing tree to PNG file at x" << scale << " scale... ";
+	t.WriteTreePNG(outfilename, scale);
+	cout << "done." << endl;
+
+	PNG written;
+	written.readFromFile(outfilename);
+	cout << "Written PNG " << (written == t.Render(scale) ? "matches" : "DOES NOT match") << " the rendered tree." << endl;
+
+	cout << "Reopening PNG file as a tree... ";
+	QTree reopened;
+	reopened.ReadPNG(outfilename);
+	cout << "done." << endl;
+
+	cout << "Reopened tree contains " << reopened.CountNodes() << " nodes and " << reopened.CountLeaves() << " leaves." << endl;
+	cout << "Reopened tree " << (reopened.Render(1) == t.Render(1) ? "matches" : "DOES NOT match") << " the written tree." << endl;
+
+	cout << "Exiting TestTreePNG.\n" << endl;
+}
+
+void TestSynthetic(double tol) {
+	cout << "Entered TestSynthetic, tolerance: " << tol << endl;
+
+	// a size that is not a power of two in either dimension, so BuildNode
+	// splits unevenly all the way down
+	for (int p = 0; p < cs221util::kSyntheticPatterns; p++) {
+		cs221util::SyntheticPattern pattern = (cs221util::SyntheticPattern)p;
+		PNG input = cs221util::SyntheticImage(pattern, 97, 61).render();
+
+		QTree t(input);
+		cout << "Generated " << cs221util::SyntheticImage::patternName(pattern) << " image: " << t.CountLeaves() << " leaves, ";
+		cout << "unpruned render " << (t.Render(1) == input ? "matches" : "DOES NOT match") << " the image, ";
+		t.Prune(tol);
+		cout << t.CountLeaves() << " leaves after Prune." << endl;
+	}
+
+	PNG input = cs221util::SyntheticImage(cs221util::kSyntheticMixed, 97, 61).render();
+	QTree t(input);
+	t.Prune(tol);
+
+	// write output PNG
+	string outfilename = "images-output/synthetic-mixed-97x61-prune_" + to_string(tol) + "-render_x4.png";
+	cout << "Writing rendered PNG to file... ";
+	t.Render(4).writeToFile(outfilename);
+	cout << "done." << endl;
+
+	cout << "Exiting TestSynthetic.\n" << endl;
+}
+
+void TestTune(double psnr) {
+	cout << "Entered TestTune, PSNR: " << psnr << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	cout << "Constructing QTree from image... ";
+	QTree t(input);
+	cout << "done." << endl;
+
+	TuneTarget targets[3];
+	targets[0].kind = TuneTarget::kLeaves;
+	targets[0].value = 5000;
+	targets[1].kind = TuneTarget::kPSNR;
+	targets[1].value = psnr;
+	targets[2].kind = TuneTarget::kBytes;
+	targets[2].value = 20000;
+	const char* names[3] = { "leaves", "PSNR", "bytes" };
+
+	QTree pruned;
+	for (int i = 0; i < 3; i++) {
+		TuneResult result = t.Tune(targets[i], pruned);
+		cout << "Tuned for " << names[i] << " " << targets[i].value << ": tolerance " << result.tolerance
+		     << ", " << result.leaves << " leaves (tree has " << pruned.CountLeaves() << "), PSNR " << result.psnr;
+		if (targets[i].kind == TuneTarget::kBytes) {
+			cout << ", " << result.bytes << " bytes after " << result.encodes << " encodes";
+		}
+		cout << (result.met ? "" : ", NOT met") << endl;
+	}
+
+	t.Tune(targets[1], pruned);
+
+	// write output PNG
+	string outfilename = "images-output/kkkk_nnkm-256x224-tune_psnr_" + to_string(psnr) + "-render_x1.png";
+	cout << "Writing rendered PNG to file... ";
+	pruned.Render(1).writeToFile(outfilename);
+	cout << "done." << endl;
+
+	cout << "Exiting TestTune.\n" << endl;
+}
+
+void TestMetrics(double tol) {
+	cout << "Entered TestMetrics, tolerance: " << tol << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	QTree t(input);
+	t.Prune(tol);
+	PNG output = t.Render(1);
+
+	cs221util::ImageMetrics rendered, threaded, tree;
+	cs221util::compareImages(input, output, rendered);
+	cs221util::compareImages(input, output, threaded, 4);
+	vector<LeafError> leafErrors;
+	t.Compare(input, tree, &leafErrors, 4);
+	cout << "Rendered image: " << rendered << endl;
+	cout << "On 4 threads " << (threaded.mse == rendered.mse && threaded.ssim == rendered.ssim ? "matches" : "DOES NOT match") << endl;
+	cout << "From the tree: mse " << tree.mse << ", psnr " << tree.psnr << " dB, max error " << tree.maxError << endl;
+	cout << "Tree MSE " << (tree.mse == rendered.mse && tree.maxError == rendered.maxError ? "matches" : "DOES NOT match") << " the rendered image" << endl;
+
+	size_t worst = 0;
+	for (size_t i = 1; i < leafErrors.size(); i++) {
+		if (leafErrors[i].mse > leafErrors[worst].mse) {
+			worst = i;
+		}
+	}
+	cout << leafErrors.size() << " leaves; the worst, (" << leafErrors[worst].upLeft.first << "," << leafErrors[worst].upLeft.second
+	     << ")-(" << leafErrors[worst].lowRight.first << "," << leafErrors[worst].lowRight.second << "), has MSE " << leafErrors[worst].mse << endl;
+
+	cs221util::ImageMetrics same;
+	cs221util::compareImages(input, input, same);
+	cout << "Image against itself: " << same << endl;
+
+#ifdef LODEPNG_COMPILE_SIMD
+	// the SSE2 loops must give the figures of the portable ones
+	cs221util::ImageMetrics portable;
+	unsigned int available = lodepng_get_simd_level();
+	lodepng_set_simd_level(0);
+	cs221util::compareImages(input, output, portable);
+	lodepng_set_simd_level(available);
+	cout << "Without SIMD " << (portable.mse == rendered.mse && portable.ssim == rendered.ssim && portable.maxError == rendered.maxError ? "matches" : "DOES NOT match") << endl;
+#endif
+
+	cout << "Exiting TestMetrics.\n" << endl;
+}
+
+void TestParallelDeflate(unsigned int threads) {
+	cout << "Entered TestParallelDeflate, threads: " << threads << endl;
+
+	// read input PNG; its 229k bytes of image data make several deflate blocks
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+	auto fill = [&](unsigned int y, RGBAPixel* row) {
+		for (unsigned int x = 0; x < input.width(); x++) {
+			row[x] = *input.getPixel(x, y);
+		}
+	};
+
+	unsigned int levels[3] = { 1, 6, 9 };
+	for (unsigned int level : levels) {
+		PNGWriteOptions options;
+		options.level = level;
+		vector<unsigned char> serial, parallel;
+		encodeRows(serial, input.width(), input.height(), true, fill, options);
+		options.threads = threads;
+		encodeRows(parallel, input.width(), input.height(), true, fill, options);
+
+		PNG serialImage, parallelImage;
+		cs221util::ImageMetrics serialMetrics, parallelMetrics;
+		bool serialRead = serialImage.readFromMemory(serial);
+		bool parallelRead = parallelImage.readFromMemory(parallel);
+		bool serialMatches = serialRead && cs221util::compareImages(input, serialImage, serialMetrics) && serialMetrics.maxError == 0;
+		bool parallelMatches = parallelRead && cs221util::compareImages(serialImage, parallelImage, parallelMetrics) && parallelMetrics.maxError == 0;
+		cout << "Level " << level << ": serial " << (serialMatches ? "matches" : "DOES NOT match") << " the image, parallel "
+		     << (parallelMatches ? "matches" : "DOES NOT match") << " the serial encode (" << serial.size() << " and " << parallel.size() << " bytes)" << endl;
+	}
+
+	cout << "Exiting TestParallelDeflate.\n" << endl;
+}
+
+void TestWideRunLength(unsigned int scale) {
+	cout << "Entered TestWideRunLength, scale: " << scale << endl;
+
+	// an RGBA render over 511 pixels wide has rows longer than the 2048 byte
+	// window of the default level, so the run-length finder gets no row
+	// repeats and has to pick up the zero runs of the filtered rows instead
+	PNG input = cs221util::SyntheticImage(cs221util::kSyntheticMixed, 97, 61).render();
+	QTree t(input);
+	t.Prune(0.05);
+	PNG output = t.Render(scale);
+	auto fill = [&](unsigned int y, RGBAPixel* row) {
+		for (unsigned int x = 0; x < output.width(); x++) {
+			row[x] = *output.getPixel(x, y);
+		}
+	};
+
+	PNGWriteOptions options;
+	vector<unsigned char> runLength, hashed;
+	encodeRows(runLength, output.width(), output.height(), true, fill, options);
+	options.autoRunLength = false;
+	encodeRows(hashed, output.width(), output.height(), true, fill, options);
+
+	PNG decoded;
+	decoded.readFromMemory(runLength);
+	cout << "Rendered " << output.width() << "x" << output.height() << " image: " << runLength.size() << " bytes with autoRunLength, "
+	     << hashed.size() << " without" << (runLength.size() <= hashed.size() ? "" : ", LARGER with it") << endl;
+	cout << "Decoded PNG " << (decoded == output ? "matches" : "DOES NOT match") << " the rendered tree." << endl;
+
+	cout << "Exiting TestWideRunLength.\n" << endl;
+}
+
+void TestSIMDFilters() {
+	cout << "Entered TestSIMDFilters" << endl;
+
+#ifdef LODEPNG_COMPILE_SIMD
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+	auto fill = [&](unsigned int y, RGBAPixel* row) {
+		for (unsigned int x = 0; x < input.width(); x++) {
+			row[x] = *input.getPixel(x, y);
+		}
+	};
+
+	// every level the CPU has must give the bytes of the portable filters
+	unsigned int available = lodepng_get_simd_level();
+	PNGFilterStrategy strategies[2] = { PNGFilterStrategy::MinSum, PNGFilterStrategy::Entropy };
+	const char* names[2] = { "MinSum", "Entropy" };
+	for (int s = 0; s < 2; s++) {
+		PNGWriteOptions options;
+		options.filter = strategies[s];
+		vector<unsigned char> portable;
+		lodepng_set_simd_level(0);
+		encodeRows(portable, input.width(), input.height(), true, fill, options);
+		for (unsigned int level = 1; level <= available; level++) {
+			vector<unsigned char> simd;
+			lodepng_set_simd_level(level);
+			encodeRows(simd, input.width(), input.height(), true, fill, options);
+			cout << names[s] << " with " << (level == 1 ? "SSE2" : "AVX2") << " " << (simd == portable ? "matches" : "DOES NOT match")
+			     << " the portable filters (" << portable.size() << " bytes)" << endl;
+		}
+	}
+	lodepng_set_simd_level(available);
+#else
+	cout << "No SIMD filters in this build." << endl;
+#endif
+
+	cout << "Exiting TestSIMDFilters.\n" << endl;
+}
+
+void TestPrunedRenderScale(double tol, unsigned int scale) {
+	cout << "Entered TestPrunedRenderScale, tolerance: " << tol << ", scale: " << scale << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/malachi-60x87.png");
+
+	QTree t(input);
+	t.Prune(tol);
+
+	// a pruned tree has leaves of many pixels; each of their pixels must
+	// become a scale x scale block of its own at the pixel's place
+	PNG small = t.Render(1);
+	PNG large = t.Render(scale);
+	unsigned int wrong = 0;
+	for (unsigned int y = 0; y < large.height(); y++) {
+		for (unsigned int x = 0; x < large.width(); x++) {
+			if (!(*large.getPixel(x, y) == *small.getPixel(x / scale, y / scale))) {
+				wrong++;
+			}
+		}
+	}
+	cout << "Render at x" << scale << " is " << large.width() << "x" << large.height() << ", " << wrong << " pixels differ from the x1 render scaled up; "
+	     << (wrong == 0 && large.width() == scale * small.width() && large.height() == scale * small.height() ? "matches" : "DOES NOT match") << endl;
+
+	cout << "Exiting TestPrunedRenderScale.\n" << endl;
+}
+
+void TestTrustedInput() {
+	cout << "Entered TestTrustedInput" << endl;
+
+	// read input PNG and encode it again, so its chunks are known
+	PNG input;
+	input.readFromFile("images-original/malachi-60x87.png");
+	vector<unsigned char> file;
+	encodeRows(file, input.width(), input.height(), true, [&](unsigned int y, RGBAPixel* row) {
+		for (unsigned int x = 0; x < input.width(); x++) {
+			row[x] = *input.getPixel(x, y);
+		}
+	});
+
+	// the IDAT chunk, whose data ends in the Adler-32 followed by the chunk CRC
+	size_t chunk = 0, end = 0;
+	for (size_t pos = 8; pos + 12 <= file.size(); ) {
+		size_t length = ((size_t)file[pos] << 24) | (file[pos + 1] << 16) | (file[pos + 2] << 8) | file[pos + 3];
+		if (string(file.begin() + pos + 4, file.begin() + pos + 8) == "IDAT") {
+			chunk = pos;
+			end = pos + 8 + length;
+		}
+		pos += 12 + length;
+	}
+
+	vector<unsigned char> badCRC = file;
+	badCRC[end + 3] ^= 1;
+	vector<unsigned char> badAdler = file;
+	badAdler[end - 1] ^= 1;
+	lodepng_chunk_generate_crc(&badAdler[chunk]);
+	vector<unsigned char>* broken[2] = { &badCRC, &badAdler };
+	const char* names[2] = { "CRC", "Adler-32" };
+	PNGReadOptions trusted;
+	trusted.trustedInput = true;
+	for (int i = 0; i < 2; i++) {
+		PNG checked, unchecked;
+		bool failed = !checked.readFromMemory(*broken[i]);
+		bool read = unchecked.readFromMemory(*broken[i], trusted);
+		cout << "Corrupted " << names[i] << ": default read " << (failed ? "fails" : "DOES NOT fail") << ", trusted read " << (read && unchecked == input ? "matches" : "DOES NOT match") << " the image" << endl;
+	}
+
+	cout << "Exiting TestTrustedInput.\n" << endl;
+}
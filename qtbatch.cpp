@@ -0,0 +1,540 @@
+/**
+ * @file qtbatch.cpp
+ * @description command line tool that compresses a directory of PNGs
+ *              through QTree: each image is read, decoded, built into a
+ *              tree, pruned, encoded rendered at a chosen scale, and
+ *              written back out.
+ *
+ *              By default each of a fixed number of threads takes whole
+ *              images through every stage. With -p, each stage instead runs
+ *              on its own threads, and the stages hand images to each other
+ *              through bounded queues, so file I/O overlaps with compute.
+ *
+ *              With -a, each tree is pruned with the tolerance QTree::Tune
+ *              finds for a leaf count, PSNR or output size, instead of -t.
+ *
+ *              With -m, it also measures how far each pruned tree is from
+ *              its image, as PSNR and largest channel error.
+ *
+ *              With -u, inputs are trusted: their chunk CRCs and zlib
+ *              Adler-32 checksums are not verified.
+ *
+ *              usage: qtbatch [-t tolerance | -a leaves:N|psnr:dB|kb:N] [-s scale]
+ *                             [-j threads] [-l level] [-m] [-u]
+ *                             [-p read,decode,tree,encode,write] [-q capacity]
+ *                             [-T trace.json] input-dir output-dir
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "cs221util/BoundedQueue.h"
+#include "cs221util/CommandLine.h"
+#include "cs221util/Memory.h"
+#include "cs221util/Stats.h"
+#include "cs221util/Trace.h"
+#include "cs221util/lodepng/lodepng.h"
+#include "qtree.h"
+
+using namespace std;
+using cs221util::BoundedQueue;
+using cs221util::parseUnsigned;
+
+typedef chrono::steady_clock Clock;
+
+// The stages every image goes through, in order
+enum Stage { kRead, kDecode, kTree, kEncode, kWrite, kStages };
+
+static const char* const kStageNames[kStages] = { "read", "decode", "tree", "encode", "write" };
+
+struct BatchOptions {
+	double tolerance = 0;
+	// what to tune the tolerance of each image for, if -a was given
+	bool tune = false;
+	TuneTarget target;
+	unsigned int scale = 1;
+	unsigned int threads = max(1u, thread::hardware_concurrency());
+	unsigned int level = 6;
+	// threads per stage; all zero unless -p was given
+	unsigned int stageThreads[kStages] = { };
+	unsigned int queueCapacity = 4;
+	// whether to measure each tree against its image
+	bool measure = false;
+	// whether to skip the checksums of the input files
+	bool trusted = false;
+	// where to write a Chrome trace of the run, if anywhere
+	string traceFile;
+	string inDir;
+	string outDir;
+};
+
+// What happened to one image; times in ms
+struct BatchResult {
+	bool ok = false;
+	unsigned int width = 0;
+	unsigned int height = 0;
+	double tolerance = 0;
+	unsigned int leaves = 0;
+	// of the pruned tree against the image, if measured
+	double psnr = 0;
+	unsigned int maxError = 0;
+	unsigned long long inBytes = 0;
+	unsigned long long outBytes = 0;
+	double read = 0;
+	double decode = 0;
+	double build = 0;
+	double prune = 0;
+	double encode = 0;
+	double write = 0;
+	// counters of every stage, if built with CS221_STATS
+	cs221util::Stats stats;
+	// the most extra memory any one stage needed, and which, if built with
+	// CS221_MEMORY
+	long long peakBytes = 0;
+	int peakStage = kRead;
+};
+
+// One image on its way through the stages. Each stage frees what the
+// stages after it no longer need
+struct Job {
+	size_t index;
+	vector<unsigned char> inFile;
+	PNG img;
+	unique_ptr<QTree> tree;
+	vector<unsigned char> outFile;
+};
+
+// Scratch memory and options reused by every image a thread handles
+struct StageContext {
+	lodepng::DecoderContext decoderContext;
+	lodepng::EncoderContext encoderContext;
+	PNGReadOptions readOptions;
+	PNGWriteOptions writeOptions;
+
+	StageContext(const BatchOptions& options) {
+		readOptions.context = &decoderContext;
+		readOptions.trustedInput = options.trusted;
+		writeOptions.level = options.level;
+		writeOptions.context = &encoderContext;
+	}
+};
+
+static double Millis(Clock::time_point from, Clock::time_point to) {
+	return chrono::duration<double, milli>(to - from).count();
+}
+
+// Parses the kind:value target of -a; kb is a file size in KB
+static bool ParseTarget(const char* text, TuneTarget& target) {
+	string spec = text;
+	size_t colon = spec.find(':');
+	if (colon == string::npos) {
+		return false;
+	}
+	string kind = spec.substr(0, colon);
+	string value = spec.substr(colon + 1);
+	char* end;
+	target.value = strtod(value.c_str(), &end);
+	if (value.empty() || *end != '\0' || target.value < 0) {
+		return false;
+	}
+	if (kind == "leaves") {
+		target.kind = TuneTarget::kLeaves;
+	} else if (kind == "psnr") {
+		target.kind = TuneTarget::kPSNR;
+	} else if (kind == "kb") {
+		target.kind = TuneTarget::kBytes;
+		target.value *= 1024;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+// Parses the comma separated thread counts of -p, one per stage
+static bool ParseStageThreads(const char* text, unsigned int stageThreads[]) {
+	stringstream in(text);
+	string count;
+	int stage = 0;
+	while (getline(in, count, ',')) {
+		if (stage == kStages || !parseUnsigned(count, 1, 64, stageThreads[stage])) {
+			return false;
+		}
+		stage++;
+	}
+	return stage == kStages;
+}
+
+static bool ParseArgs(int argc, char* argv[], BatchOptions& options) {
+	vector<string> dirs;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "-T" && i + 1 < argc) {
+			options.traceFile = argv[++i];
+		} else if (arg == "-m") {
+			options.measure = true;
+		} else if (arg == "-u") {
+			options.trusted = true;
+		} else if (arg == "-a" && i + 1 < argc) {
+			options.tune = ParseTarget(argv[++i], options.target);
+			if (!options.tune) {
+				cerr << "qtbatch: bad value " << argv[i] << " for " << arg << endl;
+				return false;
+			}
+		} else if ((arg == "-t" || arg == "-s" || arg == "-j" || arg == "-l" || arg == "-p" || arg == "-q") && i + 1 < argc) {
+			const char* value = argv[++i];
+			char* end;
+			bool valid;
+			switch (arg[1]) {
+				case 't':
+					options.tolerance = strtod(value, &end);
+					valid = *value != '\0' && *end == '\0' && options.tolerance >= 0;
+					break;
+				case 's':
+					valid = parseUnsigned(value, 1, 64, options.scale);
+					break;
+				case 'j':
+					valid = parseUnsigned(value, 1, 256, options.threads);
+					break;
+				case 'p':
+					valid = ParseStageThreads(value, options.stageThreads);
+					break;
+				case 'q':
+					valid = parseUnsigned(value, 1, 1024, options.queueCapacity);
+					break;
+				default:
+					valid = parseUnsigned(value, 0, 9, options.level);
+			}
+			if (!valid) {
+				cerr << "qtbatch: bad value " << value << " for " << arg << endl;
+				return false;
+			}
+		} else if (arg[0] == '-') {
+			cerr << "qtbatch: unknown option or missing value: " << arg << endl;
+			return false;
+		} else {
+			dirs.push_back(arg);
+		}
+	}
+	if (dirs.size() != 2) {
+		return false;
+	}
+	options.inDir = dirs[0];
+	options.outDir = dirs[1];
+	return true;
+}
+
+// Names of the .png files in dir, sorted
+static bool ListPNGs(const string& dir, vector<string>& names) {
+	DIR* d = opendir(dir.c_str());
+	if (d == nullptr) {
+		return false;
+	}
+	while (dirent* entry = readdir(d)) {
+		string name = entry -> d_name;
+		if (name.size() > 4 && name.compare(name.size() - 4, 4, ".png") == 0) {
+			names.push_back(name);
+		}
+	}
+	closedir(d);
+	sort(names.begin(), names.end());
+	return true;
+}
+
+// Takes job through one stage, recording the time it took in result.
+// Returns false, and stops the job, if the stage fails
+static bool RunStage(Stage stage, Job& job, const vector<string>& names, const BatchOptions& options,
+                     StageContext& context, BatchResult& result) {
+	Clock::time_point start = Clock::now();
+	switch (stage) {
+		case kRead: {
+			if (lodepng::load_file(job.inFile, options.inDir + "/" + names[job.index]) != 0) {
+				return false;
+			}
+			result.inBytes = job.inFile.size();
+			result.read = Millis(start, Clock::now());
+			return true;
+		}
+		case kDecode: {
+			bool ok = job.img.readFromMemory(job.inFile, context.readOptions);
+			vector<unsigned char>().swap(job.inFile);
+			result.decode = Millis(start, Clock::now());
+			return ok;
+		}
+		case kTree: {
+			job.tree.reset(new QTree(job.img));
+			Clock::time_point built = Clock::now();
+			if (options.tune) {
+				// file sizes are measured as the encode stage will write them
+				TuneTarget target = options.target;
+				target.scale = options.scale;
+				target.options = context.writeOptions;
+				unique_ptr<QTree> pruned(new QTree);
+				result.tolerance = job.tree -> Tune(target, *pruned).tolerance;
+				job.tree.swap(pruned);
+			} else {
+				job.tree -> Prune(options.tolerance);
+				result.tolerance = options.tolerance;
+			}
+			result.width = job.img.width();
+			result.height = job.img.height();
+			result.leaves = job.tree -> CountLeaves();
+			result.build = Millis(start, built);
+			result.prune = Millis(built, Clock::now());
+			if (options.measure) {
+				cs221util::ImageMetrics metrics;
+				job.tree -> Compare(job.img, metrics);
+				result.psnr = metrics.psnr;
+				result.maxError = metrics.maxError;
+			}
+			job.img = PNG();
+			return true;
+		}
+		case kEncode: {
+			// renders each scanline straight into the encoder
+			bool ok = job.tree -> EncodePNG(job.outFile, options.scale, context.writeOptions);
+			job.tree.reset();
+			result.encode = Millis(start, Clock::now());
+			return ok;
+		}
+		default: {
+			result.ok = writeFile(job.outFile, options.outDir + "/" + names[job.index]);
+			result.outBytes = job.outFile.size();
+			vector<unsigned char>().swap(job.outFile);
+			result.write = Millis(start, Clock::now());
+			return result.ok;
+		}
+	}
+}
+
+// Keeps the peak of stage's memory if it is the image's largest so far
+static void NotePeak(BatchResult& result, Stage stage, const cs221util::MemoryScope& memory) {
+	long long peak = memory.usage().totalPeak;
+	if (peak > result.peakBytes) {
+		result.peakBytes = peak;
+		result.peakStage = stage;
+	}
+}
+
+// Runs on each pool thread: takes the next unprocessed image through every
+// stage until none are left
+static void ProcessImages(const vector<string>& names, const BatchOptions& options, atomic<size_t>& next, vector<BatchResult>& results) {
+	StageContext context(options);
+	cs221util::traceThreadName("worker");
+	for (size_t i = next++; i < names.size(); i = next++) {
+		Job job;
+		job.index = i;
+		for (int stage = kRead; stage < kStages; stage++) {
+			CS221_TRACE(kStageNames[stage]);
+			cs221util::StatsScope scope;
+			cs221util::MemoryScope memory;
+			bool ok = RunStage((Stage)stage, job, names, options, context, results[i]);
+			results[i].stats += scope.stats();
+			NotePeak(results[i], (Stage)stage, memory);
+			if (!ok) {
+				break;
+			}
+		}
+	}
+}
+
+// The queues between the stages of a pipeline: queues[s] carries jobs from
+// stage s to stage s + 1. The read stage takes image indices from next
+struct Pipeline {
+	vector<unique_ptr<BoundedQueue<Job*>>> queues;
+	atomic<size_t> next;
+	// threads of each stage still running; the last one out closes its queue
+	atomic<unsigned int> running[kStages];
+	// time each stage spent working, in ms, over all of its threads
+	atomic<unsigned long long> busy[kStages];
+
+	Pipeline(const BatchOptions& options) : next(0) {
+		for (int stage = kRead; stage < kStages; stage++) {
+			if (stage < kWrite) {
+				queues.emplace_back(new BoundedQueue<Job*>(options.queueCapacity));
+			}
+			running[stage] = options.stageThreads[stage];
+			busy[stage] = 0;
+		}
+	}
+};
+
+// Runs on each thread of one pipeline stage: takes jobs from the stage before
+// and passes them to the stage after, waiting while that queue is full
+static void RunPipelineStage(Stage stage, const vector<string>& names, const BatchOptions& options,
+                             Pipeline& pipeline, vector<BatchResult>& results) {
+	StageContext context(options);
+	Clock::duration busy(0);
+	cs221util::traceThreadName(kStageNames[stage]);
+	for (;;) {
+		Job* job;
+		if (stage == kRead) {
+			size_t i = pipeline.next++;
+			if (i >= names.size()) {
+				break;
+			}
+			job = new Job;
+			job -> index = i;
+		} else if (!pipeline.queues[stage - 1] -> pop(job)) {
+			break;
+		}
+
+		Clock::time_point start = Clock::now();
+		bool ok;
+		{
+			CS221_TRACE(kStageNames[stage]);
+			cs221util::StatsScope scope;
+			cs221util::MemoryScope memory;
+			ok = RunStage(stage, *job, names, options, context, results[job -> index]);
+			results[job -> index].stats += scope.stats();
+			NotePeak(results[job -> index], stage, memory);
+		}
+		busy += Clock::now() - start;
+		if (ok && stage != kWrite) {
+			pipeline.queues[stage] -> push(job);
+		} else {
+			delete job;
+		}
+	}
+	pipeline.busy[stage] += chrono::duration_cast<chrono::microseconds>(busy).count();
+	if (--pipeline.running[stage] == 0 && stage != kWrite) {
+		pipeline.queues[stage] -> close();
+	}
+}
+
+int main(int argc, char* argv[]) {
+	BatchOptions options;
+	if (!ParseArgs(argc, argv, options)) {
+		cerr << "usage: qtbatch [-t tolerance | -a leaves:N|psnr:dB|kb:N] [-s scale] [-j threads] [-l level] [-m] [-u]" << endl
+		     << "               [-p read,decode,tree,encode,write] [-q capacity] [-T trace.json]" << endl
+		     << "               input-dir output-dir" << endl;
+		return 2;
+	}
+
+	vector<string> names;
+	if (!ListPNGs(options.inDir, names)) {
+		cerr << "qtbatch: could not read directory " << options.inDir << endl;
+		return 1;
+	}
+	mkdir(options.outDir.c_str(), 0777);
+
+	vector<BatchResult> results(names.size());
+	bool pipelined = options.stageThreads[kRead] > 0;
+	unsigned int threads = 0;
+	Pipeline pipeline(options);
+
+	if (!options.traceFile.empty()) {
+		if (!cs221util::traceCompiled()) {
+			cerr << "qtbatch: built without CS221_TRACING, the trace will be empty" << endl;
+		}
+		cs221util::traceStart();
+	}
+	Clock::time_point start = Clock::now();
+	vector<thread> pool;
+	if (pipelined) {
+		for (int stage = kRead; stage < kStages; stage++) {
+			for (unsigned int t = 0; t < options.stageThreads[stage]; t++) {
+				pool.emplace_back(RunPipelineStage, (Stage)stage, cref(names), cref(options), ref(pipeline), ref(results));
+			}
+			threads += options.stageThreads[stage];
+		}
+	} else {
+		threads = min<size_t>(options.threads, max<size_t>(names.size(), 1));
+		for (unsigned int t = 0; t < threads; t++) {
+			pool.emplace_back(ProcessImages, cref(names), cref(options), ref(pipeline.next), ref(results));
+		}
+	}
+	for (thread& worker : pool) {
+		worker.join();
+	}
+	double seconds = Millis(start, Clock::now()) / 1000;
+	if (!options.traceFile.empty()) {
+		cs221util::traceStop();
+		if (!cs221util::traceWrite(options.traceFile)) {
+			cerr << "qtbatch: could not write " << options.traceFile << endl;
+		}
+	}
+
+	printf("%-32s %9s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s", "image", "size", "tol", "leaves",
+		"read", "decode", "build", "prune", "encode", "write", "in KB", "out KB");
+	printf(options.measure ? " %8s %8s\n" : "\n", "psnr", "max err");
+	const BatchResult* worst = nullptr;
+	BatchResult total;
+	const BatchResult* largest = nullptr;
+	unsigned int done = 0;
+	unsigned long long pixels = 0;
+	for (size_t i = 0; i < names.size(); i++) {
+		const BatchResult& r = results[i];
+		if (!r.ok) {
+			printf("%-32s FAILED\n", names[i].c_str());
+			continue;
+		}
+		string size = to_string(r.width) + "x" + to_string(r.height);
+		printf("%-32s %9s %8.4f %8u %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f %8.1f %8.1f", names[i].c_str(), size.c_str(), r.tolerance, r.leaves,
+			r.read, r.decode, r.build, r.prune, r.encode, r.write, r.inBytes / 1024.0, r.outBytes / 1024.0);
+		if (options.measure) {
+			printf(" %8.2f %8u", r.psnr, r.maxError);
+			if (worst == nullptr || r.psnr < worst -> psnr) {
+				worst = &r;
+			}
+		}
+		printf("\n");
+		done++;
+		pixels += (unsigned long long)r.width * r.height;
+		total.inBytes += r.inBytes;
+		total.outBytes += r.outBytes;
+		total.read += r.read;
+		total.decode += r.decode;
+		total.build += r.build;
+		total.prune += r.prune;
+		total.encode += r.encode;
+		total.write += r.write;
+		total.stats += r.stats;
+		if (largest == nullptr || r.peakBytes > largest -> peakBytes) {
+			largest = &r;
+		}
+	}
+
+	printf("stage totals (ms): read %.1f, decode %.1f, build %.1f, prune %.1f, render+encode %.1f, write %.1f\n",
+		total.read, total.decode, total.build, total.prune, total.encode, total.write);
+	if (cs221util::statsEnabled()) {
+		cout << "counters: " << total.stats << endl;
+	}
+	if (worst != nullptr) {
+		printf("lowest PSNR: %.2f dB, %s\n", worst -> psnr, names[worst - results.data()].c_str());
+	}
+	if (cs221util::memoryCompiled()) {
+		// a stage's peak only counts its own thread, not lodepng's workers
+		if (largest != nullptr) {
+			printf("largest stage peak: %.1f KB, %s of %s\n", largest -> peakBytes / 1024.0,
+				kStageNames[largest -> peakStage], names[largest - results.data()].c_str());
+		}
+		cout << "memory: " << cs221util::memoryUsage() << endl;
+	}
+	if (pipelined) {
+		// the share of its threads' time each stage spent working rather than
+		// waiting on its queues; the busiest stage is the one to give threads to
+		printf("stage busy (%%):");
+		for (int stage = kRead; stage < kStages; stage++) {
+			printf("%s %s %.0f (%u thread%s)", stage == kRead ? "" : ",", kStageNames[stage],
+				pipeline.busy[stage] / 10.0 / (seconds * 1000 * options.stageThreads[stage]),
+				options.stageThreads[stage], options.stageThreads[stage] == 1 ? "" : "s");
+		}
+		printf("; queue capacity %zu\n", pipeline.queues[0] -> capacity());
+	}
+	printf("%u of %zu images on %u threads in %.3f s: %.1f images/s, %.2f MB/s read, %.2f MB/s written, %.2f Mpixels/s\n",
+		done, names.size(), threads, seconds, done / seconds, total.inBytes / 1e6 / seconds,
+		total.outBytes / 1e6 / seconds, pixels / 1e6 / seconds);
+
+	return done == names.size() ? 0 : 1;
+}
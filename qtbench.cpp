@@ -0,0 +1,323 @@
+/**
+ * @file qtbench.cpp
+ * @description microbenchmarks for the QTree and PNG hot paths: tree
+ *              construction, Prune, Render, FlipHorizontal, RotateCCW,
+ *              Copy, Clear, RGBAPixel::distanceTo, PNG file I/O and
+ *              lodepng encode/decode. Each benchmark runs on generated
+ *              images (see SyntheticImage) of several sizes, with untimed
+ *              warmup runs first, and reports the min, median, p95 and
+ *              mean of its timed runs as JSON.
+ *
+ *              usage: qtbench [-s sizes] [-p pattern] [-e entropy] [-i iterations]
+ *                             [-w warmup] [-f filter] [-o output.json]
+ *
+ *              sizes is a comma separated list of N (for NxN) or WxH.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "cs221util/CommandLine.h"
+#include "cs221util/Memory.h"
+#include "cs221util/Metrics.h"
+#include "cs221util/SyntheticImage.h"
+#include "cs221util/lodepng/lodepng.h"
+#include "qtree.h"
+
+using namespace std;
+using cs221util::SyntheticImage;
+using cs221util::SyntheticPattern;
+using cs221util::parseUnsigned;
+
+typedef chrono::steady_clock Clock;
+
+// Render benchmarks whose output would be larger than this many pixels are
+// skipped
+static const unsigned long long kMaxRenderPixels = 1ull << 25;
+
+// File the PNG I/O benchmarks write to and read from; removed at the end
+static const string kScratchFile = "images-output/qtbench-scratch.png";
+
+struct BenchOptions {
+	vector<pair<unsigned int, unsigned int>> sizes = { {64, 64}, {256, 256}, {800, 600} };
+	SyntheticPattern pattern = cs221util::kSyntheticMixed;
+	double entropy = 0.5;
+	unsigned int iterations = 5;
+	unsigned int warmup = 1;
+	string filter;
+	string outFile;
+};
+
+// Timings of one benchmark on one image size, in ms
+struct BenchResult {
+	string name;
+	unsigned int width;
+	unsigned int height;
+	// pixels processed by one run, for the throughput figure
+	unsigned long long pixels;
+	vector<double> times;
+	// the most extra memory a timed run needed, if built with CS221_MEMORY
+	long long peakBytes = 0;
+};
+
+// Keeps results the optimizer would otherwise drop
+static volatile double sink;
+
+static double Millis(Clock::time_point from, Clock::time_point to) {
+	return chrono::duration<double, milli>(to - from).count();
+}
+
+// Parses a comma separated list of N or WxH
+static bool ParseSizes(const char* text, vector<pair<unsigned int, unsigned int>>& sizes) {
+	sizes.clear();
+	stringstream in(text);
+	string size;
+	while (getline(in, size, ',')) {
+		size_t x = size.find('x');
+		unsigned int w, h;
+		if (x == string::npos) {
+			if (!parseUnsigned(size, 1, cs221util::kSyntheticMaxSize, w)) {
+				return false;
+			}
+			h = w;
+		} else if (!parseUnsigned(size.substr(0, x), 1, cs221util::kSyntheticMaxSize, w) ||
+		           !parseUnsigned(size.substr(x + 1), 1, cs221util::kSyntheticMaxSize, h)) {
+			return false;
+		}
+		sizes.push_back(make_pair(w, h));
+	}
+	return !sizes.empty();
+}
+
+static bool ParseArgs(int argc, char* argv[], BenchOptions& options) {
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if ((arg == "-s" || arg == "-p" || arg == "-e" || arg == "-i" || arg == "-w" || arg == "-f" || arg == "-o") && i + 1 < argc) {
+			const char* value = argv[++i];
+			char* end;
+			bool valid = true;
+			switch (arg[1]) {
+				case 's':
+					valid = ParseSizes(value, options.sizes);
+					break;
+				case 'p':
+					valid = SyntheticImage::parsePattern(value, options.pattern);
+					break;
+				case 'e':
+					options.entropy = strtod(value, &end);
+					valid = *value != '\0' && *end == '\0' && options.entropy >= 0 && options.entropy <= 1;
+					break;
+				case 'i':
+					valid = parseUnsigned(value, 1, 100000, options.iterations);
+					break;
+				case 'w':
+					valid = parseUnsigned(value, 0, 100000, options.warmup);
+					break;
+				case 'f':
+					options.filter = value;
+					break;
+				default:
+					options.outFile = value;
+			}
+			if (!valid) {
+				cerr << "qtbench: bad value " << value << " for " << arg << endl;
+				return false;
+			}
+		} else {
+			cerr << "qtbench: unknown option or missing value: " << arg << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+// The value at fraction q of the sorted times, by nearest rank
+static double Percentile(const vector<double>& times, double q) {
+	size_t rank = (size_t)ceil(q * times.size());
+	return times[rank == 0 ? 0 : rank - 1];
+}
+
+// Runs op warmup times untimed, then iterations times timed. setup, if any,
+// runs untimed before every run of op
+static void Measure(const BenchOptions& options, vector<BenchResult>& results, const string& name,
+                    const PNG& img, unsigned long long pixels, const function<void()>& setup, const function<void()>& op) {
+	if (!options.filter.empty() && name.find(options.filter) == string::npos) {
+		return;
+	}
+	BenchResult result;
+	result.name = name;
+	result.width = img.width();
+	result.height = img.height();
+	result.pixels = pixels;
+	for (unsigned int i = 0; i < options.warmup + options.iterations; i++) {
+		if (setup) {
+			setup();
+		}
+		cs221util::MemoryScope memory;
+		Clock::time_point start = Clock::now();
+		op();
+		double ms = Millis(start, Clock::now());
+		if (i >= options.warmup) {
+			result.times.push_back(ms);
+			result.peakBytes = max(result.peakBytes, memory.usage().totalPeak);
+		}
+	}
+	sort(result.times.begin(), result.times.end());
+	fprintf(stderr, "%-24s %5ux%-5u median %10.3f ms\n", name.c_str(), result.width, result.height,
+		Percentile(result.times, 0.5));
+	results.push_back(result);
+}
+
+// Runs every benchmark on img
+static void RunBenchmarks(const BenchOptions& options, const PNG& img, vector<BenchResult>& results) {
+	unsigned long long pixels = (unsigned long long)img.width() * img.height();
+	QTree built(img);
+	QTree tree;
+
+	// setup frees the previous tree, so only the construction is timed
+	unique_ptr<QTree> fresh;
+	Measure(options, results, "build", img, pixels, [&] { fresh.reset(); }, [&] { fresh.reset(new QTree(img)); });
+
+	const double tolerances[] = { 0.01, 0.05, 0.1 };
+	for (double tolerance : tolerances) {
+		char name[32];
+		snprintf(name, sizeof(name), "prune_%g", tolerance);
+		Measure(options, results, name, img, pixels, [&] { tree = built; }, [&] { tree.Prune(tolerance); });
+	}
+
+	// the remaining tree benchmarks work on a tree pruned as in main.cpp
+	QTree pruned(built);
+	pruned.Prune(0.05);
+
+	const unsigned int scales[] = { 1, 6, 16 };
+	for (unsigned int scale : scales) {
+		if (pixels * scale * scale > kMaxRenderPixels) {
+			continue;
+		}
+		Measure(options, results, "render_x" + to_string(scale), img, pixels * scale * scale, nullptr,
+			[&] { sink = pruned.Render(scale).width(); });
+	}
+
+	tree = pruned;
+	Measure(options, results, "flip_horizontal", img, pixels, nullptr, [&] { tree.FlipHorizontal(); });
+	tree = pruned;
+	Measure(options, results, "rotate_ccw", img, pixels, nullptr, [&] { tree.RotateCCW(); });
+	Measure(options, results, "copy", img, pixels, [&] { tree = QTree(); }, [&] { tree = pruned; });
+	Measure(options, results, "clear", img, pixels, [&] { tree = pruned; }, [&] { tree = QTree(); });
+
+	Measure(options, results, "distance_to", img, pixels, nullptr, [&] {
+		double sum = 0;
+		for (unsigned int y = 0; y < img.height(); y++) {
+			RGBAPixel* row = img.getPixel(0, y);
+			for (unsigned int x = 1; x < img.width(); x++) {
+				sum += row[x].distanceTo(row[x - 1]);
+			}
+		}
+		sink = sum;
+	});
+
+	PNG rendered = pruned.Render(1);
+	cs221util::ImageMetrics metrics;
+	Measure(options, results, "compare_images", img, pixels, nullptr, [&] {
+		cs221util::compareImages(img, rendered, metrics);
+		sink = metrics.ssim;
+	});
+	Measure(options, results, "tree_compare", img, pixels, nullptr, [&] {
+		pruned.Compare(img, metrics);
+		sink = metrics.mse;
+	});
+
+	// the file png_read_file reads and the PNG lodepng_decode decodes are made
+	// untimed here, so they exist whichever benchmarks -f selects
+	PNG copy(img);
+	copy.writeToFile(kScratchFile);
+	vector<unsigned char> raw;
+	for (unsigned int y = 0; y < img.height(); y++) {
+		for (unsigned int x = 0; x < img.width(); x++) {
+			RGBAPixel* p = img.getPixel(x, y);
+			raw.push_back(p -> r);
+			raw.push_back(p -> g);
+			raw.push_back(p -> b);
+			raw.push_back((unsigned char)round(p -> a * 255));
+		}
+	}
+	vector<unsigned char> encoded;
+	lodepng::encode(encoded, raw, img.width(), img.height());
+
+	Measure(options, results, "png_write_file", img, pixels, nullptr, [&] { copy.writeToFile(kScratchFile); });
+	Measure(options, results, "png_read_file", img, pixels, nullptr, [&] { copy.readFromFile(kScratchFile); });
+	Measure(options, results, "lodepng_encode", img, pixels, nullptr, [&] {
+		encoded.clear();
+		lodepng::encode(encoded, raw, img.width(), img.height());
+	});
+	Measure(options, results, "lodepng_decode", img, pixels, nullptr, [&] {
+		vector<unsigned char> decoded;
+		unsigned int w, h;
+		lodepng::decode(decoded, w, h, encoded);
+		sink = decoded.size();
+	});
+}
+
+static void WriteJSON(ostream& out, const BenchOptions& options, const vector<BenchResult>& results) {
+	out << "{\n  \"benchmark\": \"qtbench\",\n  \"pattern\": \"" << SyntheticImage::patternName(options.pattern)
+	    << "\",\n  \"entropy\": " << options.entropy << ",\n  \"iterations\": " << options.iterations
+	    << ",\n  \"warmup\": " << options.warmup << ",\n  \"results\": [";
+	for (size_t i = 0; i < results.size(); i++) {
+		const BenchResult& r = results[i];
+		double mean = 0;
+		for (double t : r.times) {
+			mean += t / r.times.size();
+		}
+		double median = Percentile(r.times, 0.5);
+		char line[512];
+		snprintf(line, sizeof(line),
+			"%s\n    {\"name\": \"%s\", \"width\": %u, \"height\": %u, \"min_ms\": %.6f, \"median_ms\": %.6f, "
+			"\"p95_ms\": %.6f, \"mean_ms\": %.6f, \"mpixels_per_s\": %.3f",
+			i == 0 ? "" : ",", r.name.c_str(), r.width, r.height, r.times.front(), median,
+			Percentile(r.times, 0.95), mean, median > 0 ? r.pixels / median / 1000 : 0.0);
+		out << line;
+		if (cs221util::memoryCompiled()) {
+			out << ", \"peak_bytes\": " << r.peakBytes;
+		}
+		out << "}";
+	}
+	out << "\n  ]\n}\n";
+}
+
+int main(int argc, char* argv[]) {
+	BenchOptions options;
+	if (!ParseArgs(argc, argv, options)) {
+		cerr << "usage: qtbench [-s sizes] [-p pattern] [-e entropy] [-i iterations] [-w warmup]" << endl
+		     << "               [-f filter] [-o output.json]" << endl;
+		return 2;
+	}
+
+	vector<BenchResult> results;
+	for (const pair<unsigned int, unsigned int>& size : options.sizes) {
+		SyntheticImage image(options.pattern, size.first, size.second, options.entropy);
+		RunBenchmarks(options, image.render(), results);
+	}
+	remove(kScratchFile.c_str());
+
+	if (options.outFile.empty()) {
+		WriteJSON(cout, options, results);
+		return 0;
+	}
+	ofstream out(options.outFile);
+	WriteJSON(out, options, results);
+	if (!out) {
+		cerr << "qtbench: could not write " << options.outFile << endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,78 @@
+/**
+ * @file qtgen.cpp
+ * @description command line tool that writes a generated test image (see
+ *              SyntheticImage) to a PNG file. The image is produced a row
+ *              at a time, so sizes up to 32768 x 32768 never hold more
+ *              than one row of pixels, only the compressed file.
+ *
+ *              usage: qtgen [-e entropy] [-r seed] [-l level] pattern WxH output.png
+ *
+ *              pattern is one of flat, gradient, noise, pixelart, alpha, mixed.
+ */
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "cs221util/CommandLine.h"
+#include "cs221util/SyntheticImage.h"
+
+using namespace std;
+using namespace cs221util;
+
+int main(int argc, char* argv[]) {
+	double entropy = 0.5;
+	unsigned int seed = 1;
+	unsigned int level = 6;
+	vector<string> args;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if ((arg == "-e" || arg == "-r" || arg == "-l") && i + 1 < argc) {
+			const char* value = argv[++i];
+			char* end;
+			bool valid;
+			switch (arg[1]) {
+				case 'e':
+					entropy = strtod(value, &end);
+					valid = *value != '\0' && *end == '\0' && entropy >= 0 && entropy <= 1;
+					break;
+				case 'r':
+					valid = parseUnsigned(value, 0, 0xFFFFFFFFu, seed);
+					break;
+				default:
+					valid = parseUnsigned(value, 0, 9, level);
+			}
+			if (!valid) {
+				cerr << "qtgen: bad value " << value << " for " << arg << endl;
+				return 2;
+			}
+		} else if (arg[0] == '-') {
+			cerr << "qtgen: unknown option or missing value: " << arg << endl;
+			return 2;
+		} else {
+			args.push_back(arg);
+		}
+	}
+
+	SyntheticPattern pattern;
+	size_t x = args.size() == 3 ? args[1].find('x') : string::npos;
+	unsigned int w, h;
+	if (x == string::npos || !SyntheticImage::parsePattern(args[0], pattern) ||
+	    !parseUnsigned(args[1].substr(0, x), 1, kSyntheticMaxSize, w) ||
+	    !parseUnsigned(args[1].substr(x + 1), 1, kSyntheticMaxSize, h)) {
+		cerr << "usage: qtgen [-e entropy] [-r seed] [-l level] pattern WxH output.png" << endl
+		     << "       pattern is one of flat, gradient, noise, pixelart, alpha, mixed;" << endl
+		     << "       W and H are at most " << kSyntheticMaxSize << endl;
+		return 2;
+	}
+
+	PNGWriteOptions options;
+	options.level = level;
+	SyntheticImage image(pattern, w, h, entropy, seed);
+	if (!image.writeToFile(args[2], options)) {
+		cerr << "qtgen: could not write " << args[2] << endl;
+		return 1;
+	}
+	return 0;
+}
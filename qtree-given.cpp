@@ -7,6 +7,8 @@
  */
 
 #include "qtree.h"
+#include "cs221util/Memory.h"
+#include "cs221util/Stats.h"
 
  /**
   * Node constructor.
@@ -21,6 +23,17 @@ Node::Node(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int>
 	NE = nullptr;
 	SW = nullptr;
 	SE = nullptr;
+
+	CS221_COUNT(nodesAllocated, 1);
+	CS221_MEMORY_ALLOC(kMemoryNodes, sizeof(Node));
+}
+
+/**
+ * Node destructor.
+ * Only accounts for the node's memory; the tree deletes the children.
+ */
+Node::~Node() {
+	CS221_MEMORY_FREE(kMemoryNodes, sizeof(Node));
 }
 
 /**
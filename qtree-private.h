@@ -19,4 +19,29 @@ void CopyNodes(Node* &subroot, Node* other);
 void Clear(Node* &subroot);
 void Prune(Node* &subroot, double tolerance);
 bool ValidPrune(Node* subroot, RGBAPixel nodeP, double tolerance);
+double PruneTolerance(Node* subroot, RGBAPixel nodeP) const;
+struct TuneStep;
+struct TuneSums;
+void TuneSteps(Node* subroot, double limit, vector<TuneStep>& steps, TuneSums& sums) const;
+void CollectLeaves(Node* subroot, vector<Node*>& leaves) const;
+bool CollectPalette(Node* subroot, vector<RGBAPixel>& palette, map<unsigned int, unsigned char>& index) const;
+bool Opaque(Node* subroot) const;
+void RenderRow(Node* subroot, unsigned int y, unsigned int scale, RGBAPixel* row) const;
+void RenderRow(Node* subroot, unsigned int y, unsigned int scale, const map<unsigned int, unsigned char>& index, unsigned char* row) const;
+unsigned char SplitSides(Node* subroot, unsigned char& known) const;
+void SaveNode(Node* subroot, bool opaque, vector<unsigned char>& bits, size_t& bit, vector<unsigned char>& colors) const;
+Node* LoadNode(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, unsigned char flags, const unsigned char* bits, size_t bitCount, size_t& bit, const unsigned char*& color, unsigned int& leaves);
+void SaveViewNode(Node* subroot, vector<QTreeViewNode>& nodes) const;
+struct StreamEncoder;
+struct StreamDecoder;
+void EncodeNode(Node* subroot, unsigned int depth, StreamEncoder& encoder) const;
+Node* DecodeNode(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, unsigned int depth, StreamDecoder& decoder);
+struct TileReader;
+void EncodeTop(Node* subroot, unsigned int depth, unsigned int indexDepth, StreamEncoder& encoder, vector<Node*>& subtrees) const;
+Node* DecodeTop(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, unsigned int depth, StreamDecoder& decoder, TileReader& reader);
+bool LoadSubtree(Node* subroot, unsigned int depth, TileReader& reader);
+struct ProgressiveState;
+ProgressiveState* progressive = nullptr; // DecodeProgressive's place in its stream, if any
+void EndProgressive();
+bool DecodeLevel(const unsigned char* in, size_t size, const vector<Node*>& level, const vector<Node*>& parents, ProgressiveState& state);
 
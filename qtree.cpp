@@ -7,9 +7,304 @@
  */
 
 #include "qtree.h"
+#include "cs221util/RangeCoder.h"
+#include "cs221util/Stats.h"
+#include "cs221util/Trace.h"
+#include "cs221util/lodepng/lodepng.h"
+#include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <limits>
 
 using namespace std;
+
+// The color a pixel is written as: 8-bit RGBA, alpha scaled as in PNG::writeToFile
+static unsigned int PaletteKey(const RGBAPixel& p) {
+	unsigned char a = p.a * 255;
+	return ((unsigned int)p.r << 24) | ((unsigned int)p.g << 16) | ((unsigned int)p.b << 8) | a;
+}
+
+// Save/Load file layout, integers are 4 bytes little-endian:
+//   "QTR1", flags byte, width, height, leaf count, structure byte count
+//   the rest of the file is zlib-compressed, and holds:
+//   structure: one bit per node in preorder (low bit first), set if the node is split;
+//              1x1 nodes are always leaves and have no bit
+//   leaf colors in preorder: r, g, b, and alpha*255 unless QTREE_OPAQUE is set
+// A split node's children cover the non-empty quadrants of its rectangle, split
+// as in BuildNode except that flips and rotations move the extra column/row.
+static const unsigned char QTREE_MAGIC[4] = {'Q', 'T', 'R', '1'};
+static const size_t QTREE_HEADER_SIZE = 21;
+static const unsigned char QTREE_OPAQUE = 1;
+static const unsigned char QTREE_WIDE_EAST = 2;   // odd widths have the extra column in the east half
+static const unsigned char QTREE_TALL_SOUTH = 4;  // odd heights have the extra row in the south half
+
+static void PutU32(vector<unsigned char>& out, unsigned int value) {
+	for (int i = 0; i < 4; i++) {
+		out.push_back((value >> (8 * i)) & 255);
+	}
+}
+
+static unsigned int GetU32(const unsigned char* in) {
+	return in[0] | (in[1] << 8) | (in[2] << 16) | ((unsigned int)in[3] << 24);
+}
+
+// The rectangles of a split node's children in NW, NE, SW, SE order, given the
+// Save flags; exists is false for the empty quadrants of 1-pixel wide/tall nodes
+static void ChildRects(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, unsigned char flags,
+	pair<unsigned int, unsigned int>* childUL, pair<unsigned int, unsigned int>* childLR, bool* exists) {
+	unsigned int nodeWidth = lr.first - ul.first + 1;
+	unsigned int nodeHeight = lr.second - ul.second + 1;
+	unsigned int westWidth = (flags & QTREE_WIDE_EAST) ? nodeWidth / 2 : (nodeWidth + 1) / 2;
+	unsigned int northHeight = (flags & QTREE_TALL_SOUTH) ? nodeHeight / 2 : (nodeHeight + 1) / 2;
+
+	// first column/row of the east/south halves
+	unsigned int splitW = ul.first + westWidth;
+	unsigned int splitH = ul.second + northHeight;
+
+	childUL[0] = ul;
+	childLR[0] = make_pair(splitW - 1, splitH - 1);
+	exists[0] = westWidth > 0 && northHeight > 0;
+	childUL[1] = make_pair(splitW, ul.second);
+	childLR[1] = make_pair(lr.first, splitH - 1);
+	exists[1] = westWidth < nodeWidth && northHeight > 0;
+	childUL[2] = make_pair(ul.first, splitH);
+	childLR[2] = make_pair(splitW - 1, lr.second);
+	exists[2] = westWidth > 0 && northHeight < nodeHeight;
+	childUL[3] = make_pair(splitW, splitH);
+	childLR[3] = lr;
+	exists[3] = westWidth < nodeWidth && northHeight < nodeHeight;
+}
+
+// Encode/Decode stream layout: "QTRC", flags byte as in Save, width, height,
+// then a range-coded preorder traversal giving, for each node, whether it is
+// split (not coded for 1x1 nodes) in a context per depth, and for each leaf:
+//   whether its color is one of the QTREE_CACHE_SIZE most recently coded
+//   distinct colors, and if so which;
+//   if not, the color as a difference from the previous leaf's color; green
+//   first, red and blue relative to green's difference.
+// Non-leaf colors are not coded: they are averages of their children.
+static const unsigned char QTREE_STREAM_MAGIC[4] = {'Q', 'T', 'R', 'C'};
+static const size_t QTREE_STREAM_HEADER_SIZE = 13;
+static const unsigned int QTREE_DEPTH_CONTEXTS = 64;
+static const unsigned int QTREE_CACHE_BITS = 6;
+static const unsigned int QTREE_CACHE_SIZE = 1 << QTREE_CACHE_BITS;
+// after the split contexts: hit bits (after a miss, after a hit), cache index bit trees
+// (likewise), and a bit tree per channel
+static const size_t QTREE_HIT_CONTEXTS = QTREE_DEPTH_CONTEXTS;
+static const size_t QTREE_INDEX_CONTEXTS = QTREE_HIT_CONTEXTS + 2;
+static const size_t QTREE_DELTA_CONTEXTS = QTREE_INDEX_CONTEXTS + 2 * QTREE_CACHE_SIZE;
+static const size_t QTREE_STREAM_CONTEXTS = QTREE_DELTA_CONTEXTS + 4 * 256;
+
+// The most recently coded distinct colors, most recent first; alpha scaled
+// as in PNG::writeToFile
+struct ColorCache {
+	unsigned char colors[QTREE_CACHE_SIZE][4] = {};
+	unsigned int size = 0;
+	bool hit = false;  // whether the last color was found
+
+	// Index of color, or -1
+	int Find(const unsigned char* color) const {
+		for (unsigned int i = 0; i < size; i++) {
+			if (equal(color, color + 4, colors[i])) {
+				return i;
+			}
+		}
+		return -1;
+	}
+
+	// Moves entry i, or a new color if i is -1, to the front
+	void Use(int i, const unsigned char* color) {
+		hit = i >= 0;
+		if (i < 0) {
+			i = min(size, QTREE_CACHE_SIZE - 1);
+			size = min(size + 1, QTREE_CACHE_SIZE);
+		}
+		copy_backward(colors[0], colors[i], colors[i] + 4);
+		copy(color, color + 4, colors[0]);
+	}
+};
+
+struct QTree::StreamEncoder {
+	RangeEncoder coder;
+	vector<Probability> probs;
+	ColorCache cache;
+	bool opaque;
+
+	StreamEncoder(vector<unsigned char>& out, bool opaque) : coder(out), probs(QTREE_STREAM_CONTEXTS, kProbabilityHalf), opaque(opaque) { }
+
+	void EncodeSplit(unsigned int depth, bool split) {
+		coder.encodeBit(probs[min(depth, QTREE_DEPTH_CONTEXTS - 1)], split);
+	}
+
+	// Codes p by its cache position or as its difference from predicted,
+	// by default the previous color
+	void EncodeColor(const RGBAPixel& p, const RGBAPixel* predicted = nullptr) {
+		unsigned char color[4] = {p.r, p.g, p.b, (unsigned char)(opaque ? 255 : p.a * 255)};
+		unsigned char parent[4];
+		const unsigned char* prediction = cache.colors[0];
+		if (predicted != nullptr) {
+			parent[0] = predicted -> r;
+			parent[1] = predicted -> g;
+			parent[2] = predicted -> b;
+			parent[3] = opaque ? 255 : predicted -> a * 255;
+			prediction = parent;
+		}
+		int i = cache.Find(color);
+		coder.encodeBit(probs[QTREE_HIT_CONTEXTS + cache.hit], i >= 0);
+		if (i >= 0) {
+			coder.encodeBitTree(&probs[QTREE_INDEX_CONTEXTS + cache.hit * QTREE_CACHE_SIZE], QTREE_CACHE_BITS, i);
+		} else {
+			Probability* delta = &probs[QTREE_DELTA_CONTEXTS];
+			unsigned char dg = color[1] - prediction[1];
+			coder.encodeBitTree(delta + 256, 8, dg);
+			coder.encodeBitTree(delta, 8, (unsigned char)(color[0] - prediction[0] - dg));
+			coder.encodeBitTree(delta + 512, 8, (unsigned char)(color[2] - prediction[2] - dg));
+			if (!opaque) {
+				coder.encodeBitTree(delta + 768, 8, (unsigned char)(color[3] - prediction[3]));
+			}
+		}
+		cache.Use(i, color);
+	}
+};
+
+struct QTree::StreamDecoder {
+	RangeDecoder coder;
+	vector<Probability> probs;
+	ColorCache cache;
+	unsigned char flags;
+
+	StreamDecoder(const unsigned char* in, size_t size, unsigned char flags) : coder(in, size), probs(QTREE_STREAM_CONTEXTS, kProbabilityHalf), flags(flags) { }
+
+	bool DecodeSplit(unsigned int depth) {
+		return coder.decodeBit(probs[min(depth, QTREE_DEPTH_CONTEXTS - 1)]);
+	}
+
+	RGBAPixel DecodeColor(const RGBAPixel* predicted = nullptr) {
+		unsigned char color[4];
+		unsigned char parent[4];
+		const unsigned char* prediction = cache.colors[0];
+		bool opaque = flags & QTREE_OPAQUE;
+		if (predicted != nullptr) {
+			parent[0] = predicted -> r;
+			parent[1] = predicted -> g;
+			parent[2] = predicted -> b;
+			parent[3] = opaque ? 255 : predicted -> a * 255;
+			prediction = parent;
+		}
+		int i = -1;
+		if (coder.decodeBit(probs[QTREE_HIT_CONTEXTS + cache.hit])) {
+			i = coder.decodeBitTree(&probs[QTREE_INDEX_CONTEXTS + cache.hit * QTREE_CACHE_SIZE], QTREE_CACHE_BITS);
+			i = min(i, max((int)cache.size - 1, 0));
+			copy(cache.colors[i], cache.colors[i] + 4, color);
+		} else {
+			Probability* delta = &probs[QTREE_DELTA_CONTEXTS];
+			unsigned char dg = coder.decodeBitTree(delta + 256, 8);
+			color[1] = prediction[1] + dg;
+			color[0] = prediction[0] + dg + coder.decodeBitTree(delta, 8);
+			color[2] = prediction[2] + dg + coder.decodeBitTree(delta + 512, 8);
+			color[3] = opaque ? 255 : prediction[3] + coder.decodeBitTree(delta + 768, 8);
+		}
+		cache.Use(i, color);
+		return RGBAPixel(color[0], color[1], color[2], opaque ? 1.0 : color[3] / 255.);
+	}
+};
+
+// Type of the PNG chunk holding the Encode stream: ancillary, private,
+// unsafe to copy
+static const char QTREE_PNG_CHUNK[] = "qtRE";
+
+// SaveTiled file layout, integers little-endian:
+//   "QTRT", flags byte as in Save, then width, height, index depth, top stream
+//   size and subtree count, 4 bytes each
+//   top stream: as Encode's, for the nodes down to the index depth; nodes at
+//   that depth have their color coded even if they are split
+//   index: for each split node at the index depth, in preorder, the offset of
+//   its subtree stream from the end of the index (8 bytes) and its size (4 bytes)
+//   subtree streams: as Encode's, for the children of each indexed node
+static const unsigned char QTREE_TILED_MAGIC[4] = {'Q', 'T', 'R', 'T'};
+static const size_t QTREE_TILED_HEADER_SIZE = 25;
+static const size_t QTREE_TILE_ENTRY_SIZE = 12;
+
+// What LoadRegion needs to find and read the indexed subtrees
+struct QTree::TileReader {
+	ifstream& file;
+	vector<unsigned char> index;
+	unsigned long long dataStart;  // file offset of the subtree streams
+	unsigned long long dataSize;
+	unsigned int indexDepth;
+	size_t next;  // index entry of the next indexed node decoded
+	pair<unsigned int, unsigned int> ul;  // the window
+	pair<unsigned int, unsigned int> lr;
+	unsigned char flags;
+};
+
+// EncodeProgressive stream layout, integers little-endian:
+//   "QTRP", flags byte as in Save, width and height (4 bytes each)
+//   then for each level of the tree, its size (4 bytes) and a range coded
+//   stream holding each node of the level, in breadth-first order: its split
+//   bit as in Encode (none for 1x1 nodes) and its color, coded as in Encode
+//   but as a difference from its parent's color. The contexts and the color
+//   cache carry over from one level to the next.
+//   An empty tree has no levels.
+static const unsigned char QTREE_PROGRESSIVE_MAGIC[4] = {'Q', 'T', 'R', 'P'};
+static const size_t QTREE_PROGRESSIVE_HEADER_SIZE = 13;
+
+// Where DecodeProgressive is in the stream it is decoding
+struct QTree::ProgressiveState {
+	vector<Probability> probs;
+	ColorCache cache;
+	unsigned char flags;
+	size_t decoded;  // bytes of the stream decoded
+	unsigned int depth;  // of the next level
+	vector<Node*> split;  // nodes of the last level decoded that are split in the next
+};
+
+// A change to the leaves of the pruned tree as the tolerance reaches
+// tolerance: a node becomes a leaf (leaves 1), or stops being one because
+// an ancestor is pruned (leaves -1); error is its squared error as a leaf,
+// and edges its width plus height
+struct QTree::TuneStep {
+	double tolerance;
+	int leaves;
+	double error;
+	double edges;
+
+	bool operator<(const TuneStep& other) const {
+		return tolerance < other.tolerance;
+	}
+};
+
+// Pixel count, and per color channel the sum of values and of squares, of
+// a subtree's leaves
+struct QTree::TuneSums {
+	unsigned long long count = 0;
+	unsigned long long sum[3] = { };
+	unsigned long long squares[3] = { };
+};
+
+// Tune models a file's size as a cost per pixel of leaf edge, i.e. per
+// unit of the leaves' summed width plus height, which varies less with the
+// tolerance than the cost per leaf. Before any encode it assumes this cost,
+// typical of pruned trees at scale 1
+static const double kTuneBytesPerEdge = 0.75;
+
+// Tune's search for a file size stops at the first file that fits and is at
+// least this fraction of the target, or at the first file that fits after
+// this many encodes
+static const double kTuneBytesPrecision = 0.9;
+static const unsigned int kTuneMaxEncodes = 4;
+
+// PSNR of an image whose r, g and b channels have the given summed squared
+// error over pixels pixels, as cs221util::compareImages measures it
+static double PSNR(double error, unsigned long long pixels) {
+	return psnr(error / (3.0 * pixels));
+}
+
+static bool Overlaps(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+	pair<unsigned int, unsigned int> otherUL, pair<unsigned int, unsigned int> otherLR) {
+	return ul.first <= otherLR.first && otherUL.first <= lr.first && ul.second <= otherLR.second && otherUL.second <= lr.second;
+}
+
 /**
  * Constructor that builds a QTree out of the given PNG.
  * Every leaf in the tree corresponds to a pixel in the PNG.
@@ -45,12 +340,23 @@ using namespace std;
  * region and do not overlap.
  */
 QTree::QTree(const PNG& imIn) {
+	CS221_TIME(buildNs);
+	CS221_TRACE("QTree::build");
 	width = imIn.width();
 	height = imIn.height();
 	
 	root = BuildNode(imIn, make_pair(0, 0), make_pair(width-1, height-1));
 }
 
+/**
+ * Default constructor: an empty 0x0 tree, e.g. to Load into.
+ */
+QTree::QTree() {
+	root = nullptr;
+	width = 0;
+	height = 0;
+}
+
 /**
  * Overloaded assignment operator for QTrees.
  * Part of the Big Three that we must define because the class
@@ -78,6 +384,8 @@ QTree& QTree::operator=(const QTree& rhs) {
  * @pre scale > 0
  */
 PNG QTree::Render(unsigned int scale) const {
+	CS221_TIME(renderNs);
+	CS221_TRACE("QTree::Render");
 	PNG output =  PNG(width*scale, height*scale);
 	Render(root, scale, output);
 	return output;
@@ -97,7 +405,10 @@ PNG QTree::Render(unsigned int scale) const {
  * @pre this tree has not previously been pruned, nor is copied from a previously pruned tree.
  */
 void QTree::Prune(double tolerance) {
+	CS221_TIME(pruneNs);
+	CS221_TRACE("QTree::Prune");
 	Prune(root, tolerance);	
+	EndProgressive();
 }
 
 /**
@@ -116,6 +427,7 @@ void QTree::Prune(double tolerance) {
  */
 void QTree::FlipHorizontal() {
 	FlipHorizontal(root);
+	EndProgressive();
 }
 
 /**
@@ -141,6 +453,856 @@ void QTree::RotateCCW() {
 	int temp = width;
 	width = height;
 	height = temp;
+	EndProgressive();
+}
+
+/**
+ * WritePNG writes the image that Render(scale) would produce to a PNG file,
+ * without rendering it: each scanline is drawn from the leaf rectangles
+ * that cross it and compressed before the next one, so memory use does
+ * not grow with the (scaled) image size.
+ * When the leaves hold at most 256 distinct colors, the palette is taken
+ * from the leaves and palette indices are drawn instead of pixels, so
+ * the encoder writes PLTE/tRNS directly without examining each pixel.
+ * Otherwise the image is written as RGB, or RGBA if a leaf is translucent.
+ *
+ * @param fileName name of the file to be written
+ * @param scale multiplier for each horizontal/vertical dimension
+ * @param options encoder options, see PNGWriteOptions
+ * @pre scale > 0
+ * @return true, if the image was successfully written
+ */
+bool QTree::WritePNG(const string& fileName, unsigned int scale, const PNGWriteOptions& options) const {
+	if (root == nullptr) {
+		return Render(scale).writeToFile(fileName, options);
+	}
+
+	vector<unsigned char> fileData;
+	return EncodePNG(fileData, scale, options) && writeFile(fileData, fileName);
+}
+
+/**
+ * EncodePNG encodes the image as WritePNG does, but stores the PNG file
+ * in out instead of writing it.
+ *
+ * @param out receives the bytes of the PNG file, replacing its contents
+ * @param scale multiplier for each horizontal/vertical dimension
+ * @param options encoder options, see PNGWriteOptions
+ * @pre scale > 0
+ * @return true, if the image was successfully encoded
+ */
+bool QTree::EncodePNG(vector<unsigned char>& out, unsigned int scale, const PNGWriteOptions& options) const {
+	CS221_TRACE("QTree::EncodePNG");
+	if (root == nullptr) {
+		return encodeRows(out, 0, 0, false, [](unsigned int, RGBAPixel*) { }, options);
+	}
+
+	vector<RGBAPixel> palette;
+	map<unsigned int, unsigned char> index;
+
+	// every source row is drawn from the leaves that cross it, right before
+	// its first output row is compressed, and copied to the scale - 1 rows
+	// below it
+	unsigned int sourceY = height;
+	if (!CollectPalette(root, palette, index)) {
+		vector<RGBAPixel> source(width * scale);
+		return encodeRows(out, width * scale, height * scale, !Opaque(root),
+			[&](unsigned int y, RGBAPixel* row) {
+				if (y / scale != sourceY) {
+					CS221_TIME(renderNs);
+					sourceY = y / scale;
+					RenderRow(root, sourceY, scale, source.data());
+				}
+				copy(source.begin(), source.end(), row);
+			}, options);
+	}
+
+	// translucent colors first, so that the tRNS chunk can end at the last of them
+	stable_partition(palette.begin(), palette.end(), [](const RGBAPixel& p) {
+		return (unsigned char)(p.a * 255) != 255;
+	});
+	for (unsigned int i = 0; i < palette.size(); i++) {
+		index[PaletteKey(palette[i])] = i;
+	}
+
+	vector<unsigned char> source(width * scale);
+	return encodeIndexedRows(out, width * scale, height * scale, palette,
+		[&](unsigned int y, unsigned char* indices) {
+			if (y / scale != sourceY) {
+				CS221_TIME(renderNs);
+				sourceY = y / scale;
+				RenderRow(root, sourceY, scale, index, source.data());
+			}
+			copy(source.begin(), source.end(), indices);
+		}, options);
+}
+
+/**
+ * WriteTreePNG writes the image as WritePNG does, and embeds the tree's
+ * Encode stream in a private ancillary chunk ahead of the image data, so
+ * that ReadPNG can reopen the file as this tree without decoding the image.
+ * PNG viewers and decoders skip the chunk. It adds the size of the stream
+ * to the file. The chunk is marked unsafe to copy, so editors that change
+ * the image drop it.
+ *
+ * @param fileName name of the file to be written
+ * @param scale multiplier for each horizontal/vertical dimension of the image;
+ *        the embedded tree is not scaled
+ * @param options encoder options, see PNGWriteOptions
+ * @pre scale > 0
+ * @return true, if the image was successfully written
+ */
+bool QTree::WriteTreePNG(const string& fileName, unsigned int scale, const PNGWriteOptions& options) const {
+	vector<PNGChunk> chunks;
+	if (options.chunks != nullptr) {
+		chunks = *options.chunks;
+	}
+	chunks.push_back(PNGChunk());
+	chunks.back().type = QTREE_PNG_CHUNK;
+	Encode(chunks.back().data);
+
+	PNGWriteOptions withTree = options;
+	withTree.chunks = &chunks;
+	return WritePNG(fileName, scale, withTree);
+}
+
+/**
+ * ReadPNG replaces the contents of this tree with the tree that WriteTreePNG
+ * embedded in a PNG file. It finds the chunk by skipping from chunk header
+ * to chunk header, without decompressing the image data. A PNG without the
+ * chunk, or whose chunk is damaged, is decoded instead, and the tree is
+ * built from its pixels as the constructor does. The tree is left
+ * unchanged if the file cannot be read.
+ *
+ * @param fileName name of the file to be read
+ * @return true, if the tree was successfully read
+ */
+bool QTree::ReadPNG(const string& fileName) {
+	vector<unsigned char> stream;
+	if (readChunkFromFile(fileName, QTREE_PNG_CHUNK, stream) && Decode(stream)) {
+		return true;
+	}
+
+	PNG img;
+	if (!img.readFromFile(fileName)) {
+		return false;
+	}
+	Clear();
+	width = img.width();
+	height = img.height();
+	root = BuildNode(img, make_pair(0, 0), make_pair(width - 1, height - 1));
+	return true;
+}
+
+/**
+ * Save writes the tree to a compact binary file: its dimensions, one
+ * bit per node in preorder telling whether it is split, and the leaf
+ * colors. Node rectangles are not stored; they follow from the
+ * constructor's split rule, and which children exist follows from
+ * the rectangles. Flipped and rotated trees are saved as well.
+ * Leaf alpha is kept at 8 bits, as in a PNG file, so a loaded tree
+ * renders exactly like this one.
+ *
+ * @param fileName name of the file to be written
+ * @return true, if the tree was successfully written
+ */
+bool QTree::Save(const string& fileName) const {
+	CS221_TRACE("QTree::Save");
+	unsigned char known = 0;
+	unsigned char flags = SplitSides(root, known);
+	if (Opaque(root)) {
+		flags |= QTREE_OPAQUE;
+	}
+
+	vector<unsigned char> bits;
+	vector<unsigned char> colors;
+	size_t bit = 0;
+	unsigned int leaves = CountLeaves();
+	colors.reserve((size_t)leaves * 4);
+	SaveNode(root, flags & QTREE_OPAQUE, bits, bit, colors);
+
+	vector<unsigned char> payload;
+	bits.insert(bits.end(), colors.begin(), colors.end());
+	unsigned error = lodepng::compress(payload, bits);
+	if (error) {
+		cerr << "QTree::Save: compression error " << error << ": " << lodepng_error_text(error) << endl;
+		return false;
+	}
+
+	vector<unsigned char> header(QTREE_MAGIC, QTREE_MAGIC + 4);
+	header.push_back(flags);
+	PutU32(header, width);
+	PutU32(header, height);
+	PutU32(header, leaves);
+	PutU32(header, bits.size() - colors.size());
+
+	ofstream file(fileName.c_str(), ios::binary);
+	file.write((const char*)header.data(), header.size());
+	file.write((const char*)payload.data(), payload.size());
+	if (!file) {
+		cerr << "QTree::Save: could not write " << fileName << endl;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Load replaces the contents of this tree with a tree written by Save.
+ * Non-leaf average colors are recomputed from their children as the
+ * constructor does. The tree is left unchanged if the file cannot be
+ * read or is not a valid tree file.
+ *
+ * @param fileName name of the file to be read
+ * @return true, if the tree was successfully read
+ */
+bool QTree::Load(const string& fileName) {
+	CS221_TRACE("QTree::Load");
+	ifstream file(fileName.c_str(), ios::binary | ios::ate);
+	vector<unsigned char> data;
+	if (file) {
+		data.resize(file.tellg());
+		file.seekg(0);
+		file.read((char*)data.data(), data.size());
+	}
+	if (!file) {
+		cerr << "QTree::Load: could not read " << fileName << endl;
+		return false;
+	}
+
+	if (data.size() < QTREE_HEADER_SIZE || !equal(QTREE_MAGIC, QTREE_MAGIC + 4, data.begin())) {
+		cerr << "QTree::Load: " << fileName << " is not a QTree file" << endl;
+		return false;
+	}
+
+	unsigned char flags = data[4];
+	unsigned int w = GetU32(&data[5]);
+	unsigned int h = GetU32(&data[9]);
+	unsigned int leaves = GetU32(&data[13]);
+	size_t bitBytes = GetU32(&data[17]);
+	size_t colorSize = (size_t)leaves * ((flags & QTREE_OPAQUE) ? 3 : 4);
+
+	vector<unsigned char> payload;
+	unsigned error = lodepng::decompress(payload, data.data() + QTREE_HEADER_SIZE, data.size() - QTREE_HEADER_SIZE);
+
+	Node* newRoot = nullptr;
+	bool valid = !error && (w == 0) == (h == 0) && payload.size() == bitBytes + colorSize;
+	if (valid && w > 0) {
+		const unsigned char* bits = payload.data();
+		const unsigned char* color = bits + bitBytes;
+		size_t bit = 0;
+		newRoot = LoadNode(make_pair(0, 0), make_pair(w - 1, h - 1), flags, bits, bitBytes * 8, bit, color, leaves);
+		valid = newRoot != nullptr && leaves == 0;
+	}
+	if (!valid) {
+		Clear(newRoot);
+		cerr << "QTree::Load: " << fileName << " is truncated or corrupt" << endl;
+		return false;
+	}
+
+	Clear();
+	root = newRoot;
+	width = w;
+	height = h;
+	return true;
+}
+
+/**
+ * Encode writes the tree as an entropy-coded stream, smaller than Save's
+ * file: split bits are range coded in a context per depth, and each leaf's
+ * color is coded as its position among the most recently coded colors or,
+ * if it is not one of them, as its difference from the previous leaf's color.
+ * Non-leaf colors are not stored. Like Save, it keeps leaf alpha at 8 bits.
+ *
+ * @param out receives the stream, replacing its contents
+ */
+void QTree::Encode(vector<unsigned char>& out) const {
+	CS221_TRACE("QTree::Encode");
+	unsigned char known = 0;
+	unsigned char flags = SplitSides(root, known);
+	if (Opaque(root)) {
+		flags |= QTREE_OPAQUE;
+	}
+
+	out.assign(QTREE_STREAM_MAGIC, QTREE_STREAM_MAGIC + 4);
+	out.push_back(flags);
+	PutU32(out, width);
+	PutU32(out, height);
+	if (root == nullptr) {
+		return;
+	}
+
+	StreamEncoder encoder(out, flags & QTREE_OPAQUE);
+	EncodeNode(root, 0, encoder);
+	encoder.coder.finish();
+}
+
+/**
+ * SaveView writes the tree in the layout QTreeView maps and reads in
+ * place: a header and one fixed-size record per node, holding its
+ * rectangle, color, and the distances to its children's records.
+ * The file is much larger than Save's, in exchange for needing no
+ * decoding. See qtreeview.h.
+ *
+ * @param fileName name of the file to be written
+ * @return true, if the tree was successfully written
+ */
+bool QTree::SaveView(const string& fileName) const {
+	vector<QTreeViewNode> nodes;
+	nodes.reserve(CountNodes());
+	if (root != nullptr) {
+		SaveViewNode(root, nodes);
+	}
+
+	QTreeViewHeader header = {{'Q', 'T', 'R', 'V'}, width, height, (uint32_t)nodes.size(), CountLeaves()};
+
+	ofstream file(fileName.c_str(), ios::binary);
+	file.write((const char*)&header, sizeof(header));
+	file.write((const char*)nodes.data(), nodes.size() * sizeof(QTreeViewNode));
+	if (!file) {
+		cerr << "QTree::SaveView: could not write " << fileName << endl;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Decode replaces the contents of this tree with a tree written by Encode.
+ * Non-leaf average colors are recomputed from their children as the
+ * constructor does. The tree is left unchanged if in is not a valid stream.
+ *
+ * @param in the stream
+ * @return true, if the tree was successfully decoded
+ */
+bool QTree::Decode(const vector<unsigned char>& in) {
+	CS221_TRACE("QTree::Decode");
+	if (in.size() < QTREE_STREAM_HEADER_SIZE || !equal(QTREE_STREAM_MAGIC, QTREE_STREAM_MAGIC + 4, in.begin())) {
+		cerr << "QTree::Decode: not a QTree stream" << endl;
+		return false;
+	}
+
+	unsigned char flags = in[4];
+	unsigned int w = GetU32(&in[5]);
+	unsigned int h = GetU32(&in[9]);
+
+	Node* newRoot = nullptr;
+	bool valid = (w == 0) == (h == 0);
+	if (valid && w > 0) {
+		StreamDecoder decoder(in.data() + QTREE_STREAM_HEADER_SIZE, in.size() - QTREE_STREAM_HEADER_SIZE, flags);
+		newRoot = DecodeNode(make_pair(0, 0), make_pair(w - 1, h - 1), 0, decoder);
+		valid = newRoot != nullptr && !decoder.coder.overrun();
+	}
+	if (!valid) {
+		Clear(newRoot);
+		cerr << "QTree::Decode: stream is truncated or corrupt" << endl;
+		return false;
+	}
+
+	Clear();
+	root = newRoot;
+	width = w;
+	height = h;
+	return true;
+}
+
+/**
+ * SaveTiled writes the tree as Encode does, but cut at indexDepth: the nodes
+ * down to that depth are coded in one stream, and the subtree below each
+ * split node at that depth in a stream of its own, found through an index of
+ * file offsets. LoadRegion can then read and decode just the subtrees that a
+ * window of the image needs.
+ *
+ * @param fileName name of the file to be written
+ * @param indexDepth depth of the nodes whose subtrees are indexed; there are
+ *        up to 4^indexDepth of them
+ * @return true, if the tree was successfully written
+ */
+bool QTree::SaveTiled(const string& fileName, unsigned int indexDepth) const {
+	unsigned char known = 0;
+	unsigned char flags = SplitSides(root, known);
+	if (Opaque(root)) {
+		flags |= QTREE_OPAQUE;
+	}
+
+	vector<unsigned char> top;
+	vector<Node*> subtrees;
+	if (root != nullptr) {
+		StreamEncoder encoder(top, flags & QTREE_OPAQUE);
+		EncodeTop(root, 0, indexDepth, encoder, subtrees);
+		encoder.coder.finish();
+	}
+
+	vector<unsigned char> index;
+	vector<unsigned char> streams;
+	for (Node* subtree : subtrees) {
+		unsigned long long offset = streams.size();
+		StreamEncoder encoder(streams, flags & QTREE_OPAQUE);
+		EncodeNode(subtree -> NW, indexDepth + 1, encoder);
+		EncodeNode(subtree -> NE, indexDepth + 1, encoder);
+		EncodeNode(subtree -> SW, indexDepth + 1, encoder);
+		EncodeNode(subtree -> SE, indexDepth + 1, encoder);
+		encoder.coder.finish();
+		PutU32(index, offset & 0xFFFFFFFF);
+		PutU32(index, offset >> 32);
+		PutU32(index, streams.size() - offset);
+	}
+
+	vector<unsigned char> header(QTREE_TILED_MAGIC, QTREE_TILED_MAGIC + 4);
+	header.push_back(flags);
+	PutU32(header, width);
+	PutU32(header, height);
+	PutU32(header, indexDepth);
+	PutU32(header, top.size());
+	PutU32(header, subtrees.size());
+
+	ofstream file(fileName.c_str(), ios::binary);
+	file.write((const char*)header.data(), header.size());
+	file.write((const char*)top.data(), top.size());
+	file.write((const char*)index.data(), index.size());
+	file.write((const char*)streams.data(), streams.size());
+	if (!file) {
+		cerr << "QTree::SaveTiled: could not write " << fileName << endl;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * LoadRegion replaces the contents of this tree with the part of a tree
+ * written by SaveTiled that covers the image rectangle from ul to lr. The
+ * nodes down to the index depth are always decoded, but of the indexed
+ * subtrees only those overlapping the rectangle are read from the file;
+ * the others are left as leaves holding their average color. Loading the
+ * whole image gives the same tree as Decode. The tree is left unchanged if
+ * the file cannot be read or is not a valid tiled tree file.
+ *
+ * @param fileName name of the file to be read
+ * @param ul upper left corner of the rectangle, in image coordinates
+ * @param lr lower right corner of the rectangle, in image coordinates
+ * @pre ul <= lr
+ * @return true, if the tree was successfully read
+ */
+bool QTree::LoadRegion(const string& fileName, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) {
+	ifstream file(fileName.c_str(), ios::binary | ios::ate);
+	unsigned long long fileSize = file ? (unsigned long long)file.tellg() : 0;
+	vector<unsigned char> header(QTREE_TILED_HEADER_SIZE);
+	file.seekg(0);
+	if (!file || fileSize < QTREE_TILED_HEADER_SIZE || !file.read((char*)header.data(), header.size())) {
+		cerr << "QTree::LoadRegion: could not read " << fileName << endl;
+		return false;
+	}
+	if (!equal(QTREE_TILED_MAGIC, QTREE_TILED_MAGIC + 4, header.begin())) {
+		cerr << "QTree::LoadRegion: " << fileName << " is not a tiled QTree file" << endl;
+		return false;
+	}
+
+	unsigned char flags = header[4];
+	unsigned int w = GetU32(&header[5]);
+	unsigned int h = GetU32(&header[9]);
+	unsigned int indexDepth = GetU32(&header[13]);
+	unsigned int topSize = GetU32(&header[17]);
+	unsigned int count = GetU32(&header[21]);
+	unsigned long long dataStart = QTREE_TILED_HEADER_SIZE + topSize + (unsigned long long)count * QTREE_TILE_ENTRY_SIZE;
+
+	// only the top stream and the index are read up front
+	TileReader reader = {file, vector<unsigned char>(), dataStart, fileSize - dataStart, indexDepth, 0, ul, lr, flags};
+	vector<unsigned char> top;
+	Node* newRoot = nullptr;
+	bool valid = (w == 0) == (h == 0) && dataStart <= fileSize;
+	if (valid) {
+		top.resize(topSize);
+		reader.index.resize((size_t)count * QTREE_TILE_ENTRY_SIZE);
+		valid = file.read((char*)top.data(), top.size()) && file.read((char*)reader.index.data(), reader.index.size());
+	}
+	if (valid && w > 0) {
+		StreamDecoder decoder(top.data(), top.size(), flags);
+		newRoot = DecodeTop(make_pair(0, 0), make_pair(w - 1, h - 1), 0, decoder, reader);
+		valid = newRoot != nullptr && !decoder.coder.overrun() && reader.next == count;
+	}
+	if (!valid) {
+		Clear(newRoot);
+		cerr << "QTree::LoadRegion: " << fileName << " is truncated or corrupt" << endl;
+		return false;
+	}
+
+	Clear();
+	root = newRoot;
+	width = w;
+	height = h;
+	return true;
+}
+
+/**
+ * EncodeProgressive writes the tree breadth-first, so that it can be shown
+ * while it arrives: the root's color comes first, then each level of the
+ * tree in turn. Every node's split bit and color are coded as in Encode,
+ * but colors as differences from the parent's color. Non-leaf colors are
+ * stored too, so the stream is larger than Encode's.
+ * Each level is a separately flushed chunk, so a level can be decoded as
+ * soon as its bytes have arrived.
+ *
+ * @param out receives the stream, replacing its contents
+ */
+void QTree::EncodeProgressive(vector<unsigned char>& out) const {
+	unsigned char known = 0;
+	unsigned char flags = SplitSides(root, known);
+	if (Opaque(root)) {
+		flags |= QTREE_OPAQUE;
+	}
+
+	out.assign(QTREE_PROGRESSIVE_MAGIC, QTREE_PROGRESSIVE_MAGIC + 4);
+	out.push_back(flags);
+	PutU32(out, width);
+	PutU32(out, height);
+
+	vector<Probability> probs(QTREE_STREAM_CONTEXTS, kProbabilityHalf);
+	ColorCache cache;
+	vector<Node*> level;
+	vector<Node*> parents;  // of the nodes in level
+	if (root != nullptr) {
+		level.push_back(root);
+		parents.push_back(nullptr);
+	}
+	for (unsigned int depth = 0; !level.empty(); depth++) {
+		vector<unsigned char> chunk;
+		StreamEncoder encoder(chunk, flags & QTREE_OPAQUE);
+		encoder.probs.swap(probs);
+		encoder.cache = cache;
+
+		vector<Node*> next;
+		vector<Node*> nextParents;
+		for (size_t n = 0; n < level.size(); n++) {
+			Node* node = level[n];
+			Node* children[4] = {node -> NW, node -> NE, node -> SW, node -> SE};
+			bool leaf = true;
+			for (int i = 0; i < 4; i++) {
+				if (children[i] != nullptr) {
+					next.push_back(children[i]);
+					nextParents.push_back(node);
+					leaf = false;
+				}
+			}
+			if (node -> upLeft != node -> lowRight) {
+				encoder.EncodeSplit(depth, !leaf);
+			}
+			encoder.EncodeColor(node -> avg, parents[n] == nullptr ? nullptr : &parents[n] -> avg);
+		}
+		encoder.coder.finish();
+		probs.swap(encoder.probs);
+		cache = encoder.cache;
+
+		PutU32(out, chunk.size());
+		out.insert(out.end(), chunk.begin(), chunk.end());
+		level.swap(next);
+		parents.swap(nextParents);
+	}
+}
+
+/**
+ * DecodeProgressive decodes a stream written by EncodeProgressive as it
+ * arrives. in holds the bytes of the stream received so far. The first call
+ * replaces the contents of this tree with the root, once the header and
+ * the root's level have arrived. Each later call splits the leaves of the
+ * last level decoded with every following level that has arrived in full.
+ * Non-leaves keep their coded colors. Once the last level is decoded, the
+ * next call starts a new stream. Prune, FlipHorizontal, RotateCCW and
+ * anything that replaces the tree abandon a stream being decoded.
+ *
+ * @param in the stream received so far; later calls must pass the same
+ *        bytes, followed by any that have arrived since
+ * @param preview if not null, kept equal to Render(scale): the first call
+ *        renders the root into it, and later calls repaint only the
+ *        rectangles of the leaves they split
+ * @param scale multiplier for each horizontal/vertical dimension of preview
+ * @pre scale > 0
+ * @return false if in is not a valid stream; the levels already decoded
+ *         are kept, and the next call starts a new stream
+ */
+bool QTree::DecodeProgressive(const vector<unsigned char>& in, PNG* preview, unsigned int scale) {
+	if (progressive == nullptr || progressive -> split.empty()) {
+		// a new stream: wait for the header and the root's level
+		if (in.size() < QTREE_PROGRESSIVE_HEADER_SIZE) {
+			return true;
+		}
+		if (!equal(QTREE_PROGRESSIVE_MAGIC, QTREE_PROGRESSIVE_MAGIC + 4, in.begin())) {
+			cerr << "QTree::DecodeProgressive: not a progressive QTree stream" << endl;
+			return false;
+		}
+		unsigned char flags = in[4];
+		unsigned int w = GetU32(&in[5]);
+		unsigned int h = GetU32(&in[9]);
+		size_t size = 0;
+		size_t decoded = QTREE_PROGRESSIVE_HEADER_SIZE;
+		if (w > 0 || h > 0) {
+			if (in.size() < QTREE_PROGRESSIVE_HEADER_SIZE + 4) {
+				return true;
+			}
+			size = GetU32(&in[QTREE_PROGRESSIVE_HEADER_SIZE]);
+			if (in.size() - QTREE_PROGRESSIVE_HEADER_SIZE - 4 < size) {
+				return true;
+			}
+			decoded += 4 + size;
+		}
+
+		ProgressiveState state = {vector<Probability>(QTREE_STREAM_CONTEXTS, kProbabilityHalf), ColorCache(), flags, decoded, 0, {}};
+		Node* newRoot = nullptr;
+		bool valid = (w == 0) == (h == 0);
+		if (valid && w > 0) {
+			newRoot = new Node(make_pair(0, 0), make_pair(w - 1, h - 1), RGBAPixel());
+			valid = DecodeLevel(&in[QTREE_PROGRESSIVE_HEADER_SIZE + 4], size, vector<Node*>(1, newRoot), vector<Node*>(), state);
+		}
+		if (!valid) {
+			delete newRoot;
+			cerr << "QTree::DecodeProgressive: stream is corrupt" << endl;
+			return false;
+		}
+
+		Clear();
+		root = newRoot;
+		width = w;
+		height = h;
+		progressive = new ProgressiveState(state);
+		if (preview != nullptr) {
+			*preview = PNG(w * scale, h * scale);
+			Render(root, scale, *preview);
+		}
+	}
+
+	while (!progressive -> split.empty() && progressive -> decoded + 4 <= in.size()) {
+		size_t size = GetU32(&in[progressive -> decoded]);
+		if (in.size() - progressive -> decoded - 4 < size) {
+			break;
+		}
+
+		vector<Node*> parents;
+		parents.swap(progressive -> split);
+		vector<Node*> level;
+		for (Node* parent : parents) {
+			pair<unsigned int, unsigned int> childUL[4];
+			pair<unsigned int, unsigned int> childLR[4];
+			bool exists[4];
+			ChildRects(parent -> upLeft, parent -> lowRight, progressive -> flags, childUL, childLR, exists);
+			for (int i = 0; i < 4; i++) {
+				level.push_back(exists[i] ? new Node(childUL[i], childLR[i], RGBAPixel()) : nullptr);
+			}
+		}
+
+		if (!DecodeLevel(&in[progressive -> decoded + 4], size, level, parents, *progressive)) {
+			for (Node* node : level) {
+				delete node;
+			}
+			EndProgressive();
+			cerr << "QTree::DecodeProgressive: stream is corrupt" << endl;
+			return false;
+		}
+		for (size_t i = 0; i < parents.size(); i++) {
+			parents[i] -> NW = level[4 * i];
+			parents[i] -> NE = level[4 * i + 1];
+			parents[i] -> SW = level[4 * i + 2];
+			parents[i] -> SE = level[4 * i + 3];
+			if (preview != nullptr) {
+				Render(parents[i], scale, *preview);
+			}
+		}
+		progressive -> decoded += 4 + size;
+	}
+	return true;
+}
+
+/**
+ * ProgressiveComplete tells whether DecodeProgressive has decoded the
+ * whole of the last stream it was given.
+ */
+bool QTree::ProgressiveComplete() const {
+	return progressive != nullptr && progressive -> split.empty();
+}
+
+/**
+ * Tune finds the tolerance at which Prune meets target, and stores
+ * this tree pruned at that tolerance in pruned. This tree is left as
+ * it is, so it can be tuned again towards other targets.
+ *
+ * @param target what to tune for, see TuneTarget
+ * @param pruned receives the pruned tree
+ * @pre this tree has not previously been pruned, nor is copied from a previously pruned tree.
+ * @return the tolerance chosen and what it gives, see TuneResult
+ */
+TuneResult QTree::Tune(const TuneTarget& target, QTree& pruned) const {
+	CS221_TRACE("QTree::Tune");
+	vector<TuneStep> steps;
+	TuneSums sums;
+	TuneSteps(root, numeric_limits<double>::infinity(), steps, sums);
+	sort(steps.begin(), steps.end());
+
+	// the pruned tree at each distinct tolerance; fewer leaves at each level
+	vector<TuneStep> levels;
+	int leaves = 0;
+	double error = 0;
+	double edges = 0;
+	for (size_t i = 0; i < steps.size(); i++) {
+		leaves += steps[i].leaves;
+		error += steps[i].error;
+		edges += steps[i].edges;
+		if (i + 1 == steps.size() || steps[i + 1].tolerance != steps[i].tolerance) {
+			TuneStep level = { steps[i].tolerance, leaves, error, edges };
+			levels.push_back(level);
+		}
+	}
+
+	TuneResult result;
+	if (levels.empty()) {
+		pruned = *this;
+		result.met = true;
+		return result;
+	}
+
+	size_t chosen = levels.size() - 1;
+	if (target.kind == TuneTarget::kLeaves) {
+		for (size_t i = 0; i < levels.size(); i++) {
+			if (levels[i].leaves <= target.value) {
+				chosen = i;
+				result.met = true;
+				break;
+			}
+		}
+	} else if (target.kind == TuneTarget::kPSNR) {
+		for (size_t i = levels.size(); i-- > 0; ) {
+			if (PSNR(levels[i].error, sums.count) >= target.value) {
+				chosen = i;
+				result.met = true;
+				break;
+			}
+		}
+	} else {
+		// levels[fit] is the level with the most leaves known to fit, and
+		// levels[over] the one with the fewest known not to. Every probe is
+		// the level the size model picks; the encodes check it and
+		// calibrate the model
+		long over = -1;
+		long fit = levels.size();
+		long last = -1, previous = -1; // the last two levels probed
+		vector<size_t> sizes(levels.size());
+		bool bisect = false;
+		while (fit - over > 1 && (fit == (long)levels.size() ||
+		                          (sizes[fit] < target.value * kTuneBytesPrecision && result.encodes < kTuneMaxEncodes))) {
+			long next = over + (fit - over) / 2;
+			if (!bisect) {
+				// the leaf edges at which the file would just fit: on the line
+				// through the last two probes, or, after one, in proportion to
+				// its bytes per edge, or at kTuneBytesPerEdge before any
+				double estimate = target.value / kTuneBytesPerEdge;
+				if (previous >= 0 && sizes[last] != sizes[previous]) {
+					estimate = levels[last].edges + (target.value - sizes[last]) *
+						(levels[last].edges - levels[previous].edges) / ((double)sizes[last] - sizes[previous]);
+				} else if (last >= 0) {
+					estimate = target.value * levels[last].edges / sizes[last];
+				}
+				// the first level with no more edges than that
+				next = lower_bound(levels.begin(), levels.end(), estimate,
+					[](const TuneStep& level, double edges) { return level.edges > edges; }) - levels.begin();
+				next = max(over + 1, min(fit - 1, next));
+			}
+
+			QTree probe(*this);
+			probe.Prune(levels[next].tolerance);
+			vector<unsigned char> file;
+			probe.EncodePNG(file, target.scale, target.options);
+			result.encodes++;
+			sizes[next] = file.size();
+			previous = last;
+			last = next;
+
+			long before = fit - over;
+			if (file.size() <= target.value) {
+				fit = next;
+			} else {
+				over = next;
+			}
+			// estimates that keep landing near one end of a bracketed range
+			// fall back to halving it
+			bisect = over >= 0 && fit < (long)levels.size() && 2 * (fit - over) > before;
+		}
+		result.met = fit < (long)levels.size();
+		chosen = result.met ? fit : levels.size() - 1;
+		result.bytes = sizes[chosen];
+	}
+
+	result.tolerance = levels[chosen].tolerance;
+	result.leaves = levels[chosen].leaves;
+	result.psnr = PSNR(levels[chosen].error, sums.count);
+	pruned = *this;
+	pruned.Prune(result.tolerance);
+	return result;
+}
+
+/**
+ * Compare measures how far the image the tree renders at scale 1 is
+ * from original, without rendering it.
+ *
+ * @param original the image to compare with, e.g. the one the tree was built from
+ * @param metrics receives the figures for the whole image
+ * @param leafErrors if not null, receives the error of each leaf, in preorder
+ * @param threads number of threads to compare on; 1 compares on the calling thread only
+ * @return false, leaving metrics and leafErrors unchanged, if original's
+ *         size is not the tree's
+ */
+bool QTree::Compare(const PNG& original, ImageMetrics& metrics, vector<LeafError>* leafErrors, unsigned int threads) const {
+	if (original.width() != width || original.height() != height) {
+		return false;
+	}
+	CS221_TRACE("QTree::Compare");
+
+	vector<Node*> leaves;
+	CollectLeaves(root, leaves);
+
+	// each leaf's squared error and largest error, summed up in order after,
+	// so the figures don't depend on the threads
+	vector<unsigned long long> errors(leaves.size());
+	vector<LeafError> measured(leaves.size());
+	const size_t chunk = 256;
+	parallelFor((leaves.size() + chunk - 1) / chunk, threads, [&](size_t c) {
+		for (size_t i = c * chunk; i < min(leaves.size(), (c + 1) * chunk); i++) {
+			Node* leaf = leaves[i];
+			const int r = leaf -> avg.r;
+			const int g = leaf -> avg.g;
+			const int b = leaf -> avg.b;
+			const int a = alphaByte(leaf -> avg.a);
+			unsigned long long error = 0;
+			int largest = 0;
+			for (unsigned int y = leaf -> upLeft.second; y <= leaf -> lowRight.second; y++) {
+				const RGBAPixel* row = original.getPixel(0, y);
+				for (unsigned int x = leaf -> upLeft.first; x <= leaf -> lowRight.first; x++) {
+					int dr = abs(row[x].r - r);
+					int dg = abs(row[x].g - g);
+					int db = abs(row[x].b - b);
+					int da = abs(alphaByte(row[x].a) - a);
+					error += dr * dr + dg * dg + db * db;
+					largest = max(largest, max(max(dr, dg), max(db, da)));
+				}
+			}
+			unsigned long long area = (unsigned long long)(leaf -> lowRight.first - leaf -> upLeft.first + 1) *
+				(leaf -> lowRight.second - leaf -> upLeft.second + 1);
+			errors[i] = error;
+			LeafError result = { leaf -> upLeft, leaf -> lowRight, error / (3.0 * area), (unsigned int)largest };
+			measured[i] = result;
+		}
+	});
+
+	ImageMetrics result;
+	unsigned long long error = 0;
+	for (size_t i = 0; i < leaves.size(); i++) {
+		error += errors[i];
+		result.maxError = max(result.maxError, measured[i].maxError);
+	}
+	if (width > 0 && height > 0) {
+		result.mse = error / (3.0 * width * height);
+	}
+	result.psnr = psnr(result.mse);
+	result.ssim = numeric_limits<double>::quiet_NaN();
+	metrics = result;
+	if (leafErrors != nullptr) {
+		leafErrors -> swap(measured);
+	}
+	return true;
 }
 
 /**
@@ -150,6 +1312,7 @@ void QTree::RotateCCW() {
  */
 void QTree:: Clear() {
 	Clear(root);	
+	EndProgressive();
 }
 
 /**
@@ -281,12 +1444,13 @@ void QTree::Render(Node* subroot, unsigned int scale, PNG &img) const {
 		int nodeWidth = subroot -> lowRight.first - subroot -> upLeft.first;
 		int nodeHeight = subroot -> lowRight.second - subroot -> upLeft.second;
 		RGBAPixel nodeP = subroot -> avg;
+		CS221_COUNT(pixelsRendered, (unsigned long long)(nodeWidth + 1) * (nodeHeight + 1) * scale * scale);
 
 		for (int x = 0; x <= nodeWidth; x++) {
 			for (int y = 0; y <= nodeHeight; y++){
 				for (unsigned int xx = 0; xx < scale; xx++) {
 					for(unsigned int yy = 0; yy < scale; yy++){
-						RGBAPixel* imgP = img.getPixel((scale*subroot -> upLeft.first) + x + xx, (scale*subroot -> upLeft.second) + y + yy);
+						RGBAPixel* imgP = img.getPixel(scale*(subroot -> upLeft.first + x) + xx, scale*(subroot -> upLeft.second + y) + yy);
 						imgP -> r = nodeP.r;
 						imgP -> g = nodeP.g;
 						imgP -> b = nodeP.b;
@@ -439,6 +1603,7 @@ void QTree::Prune(Node* &subroot, double tolerance) {
 		ValidPrune(subroot->NE, nodeP, tolerance) &&
 		ValidPrune(subroot->SW, nodeP, tolerance) &&
 		ValidPrune(subroot->SE, nodeP, tolerance)) {
+		CS221_COUNT(nodesPruned, CountNodes(subroot) - 1);
 		Clear(subroot -> NW);
 		Clear(subroot -> NE);
 		Clear(subroot -> SW);
@@ -464,6 +1629,7 @@ bool QTree::ValidPrune(Node* subroot, RGBAPixel nodeP, double tolerance) {
 	subroot -> SW == nullptr && 
 	subroot -> SE == nullptr) {
 		//Check whether that leaf is less than tolerance
+		CS221_COUNT(validPruneVisits, 1);
 		return nodeP.distanceTo(subroot -> avg) <= tolerance;
 	} else {
 		return ValidPrune(subroot->NW, nodeP, tolerance) && 
@@ -473,3 +1639,551 @@ bool QTree::ValidPrune(Node* subroot, RGBAPixel nodeP, double tolerance) {
 	}
 }
 
+// The smallest tolerance at which Prune clears the subtree's children: the
+// largest distance from nodeP to one of its leaves
+double QTree::PruneTolerance(Node* subroot, RGBAPixel nodeP) const {
+	if (subroot == nullptr) {
+		return 0;
+	}
+
+	if (subroot -> NW == nullptr && 
+	subroot -> NE == nullptr && 
+	subroot -> SW == nullptr && 
+	subroot -> SE == nullptr) {
+		return nodeP.distanceTo(subroot -> avg);
+	}
+
+	return max(max(PruneTolerance(subroot -> NW, nodeP), PruneTolerance(subroot -> NE, nodeP)),
+		max(PruneTolerance(subroot -> SW, nodeP), PruneTolerance(subroot -> SE, nodeP)));
+}
+
+// Adds to steps the tolerances at which the subtree's nodes become leaves of
+// the pruned tree, and stop being leaves. limit is the smallest tolerance at
+// which an ancestor is pruned. Adds the subtree's leaves to sums
+void QTree::TuneSteps(Node* subroot, double limit, vector<TuneStep>& steps, TuneSums& sums) const {
+	if (subroot == nullptr) {
+		return;
+	}
+
+	const unsigned char color[3] = { subroot -> avg.r, subroot -> avg.g, subroot -> avg.b };
+	double tolerance = 0;
+	TuneSums own;
+	if (subroot -> NW == nullptr && 
+	subroot -> NE == nullptr && 
+	subroot -> SW == nullptr && 
+	subroot -> SE == nullptr) {
+		own.count = 1;
+		for (int c = 0; c < 3; c++) {
+			own.sum[c] = color[c];
+			own.squares[c] = color[c] * color[c];
+		}
+	} else {
+		tolerance = PruneTolerance(subroot, subroot -> avg);
+		double below = min(limit, tolerance);
+		TuneSteps(subroot -> NW, below, steps, own);
+		TuneSteps(subroot -> NE, below, steps, own);
+		TuneSteps(subroot -> SW, below, steps, own);
+		TuneSteps(subroot -> SE, below, steps, own);
+	}
+
+	// whether or not the node is ever a leaf, its ancestors need its pixels
+	sums.count += own.count;
+	for (int c = 0; c < 3; c++) {
+		sums.sum[c] += own.sum[c];
+		sums.squares[c] += own.squares[c];
+	}
+	if (tolerance >= limit) {
+		return;
+	}
+
+	// sum of (pixel - color)^2 over the node's pixels
+	double error = 0;
+	for (int c = 0; c < 3; c++) {
+		error += (double)own.squares[c] - 2.0 * color[c] * own.sum[c] + (double)color[c] * color[c] * own.count;
+	}
+	double edges = (subroot -> lowRight.first - subroot -> upLeft.first + 1) + (subroot -> lowRight.second - subroot -> upLeft.second + 1);
+	TuneStep leaf = { tolerance, 1, error, edges };
+	steps.push_back(leaf);
+	if (limit != numeric_limits<double>::infinity()) {
+		TuneStep cleared = { limit, -1, -error, -edges };
+		steps.push_back(cleared);
+	}
+}
+
+// Appends the subtree's leaves to leaves, in preorder
+void QTree::CollectLeaves(Node* subroot, vector<Node*>& leaves) const {
+	if (subroot == nullptr) {
+		return;
+	}
+
+	if (subroot -> NW == nullptr && 
+	subroot -> NE == nullptr && 
+	subroot -> SW == nullptr && 
+	subroot -> SE == nullptr) {
+		leaves.push_back(subroot);
+		return;
+	}
+
+	CollectLeaves(subroot -> NW, leaves);
+	CollectLeaves(subroot -> NE, leaves);
+	CollectLeaves(subroot -> SW, leaves);
+	CollectLeaves(subroot -> SE, leaves);
+}
+
+// Adds each new leaf color to palette; false once there are more than 256
+bool QTree::CollectPalette(Node* subroot, vector<RGBAPixel>& palette, map<unsigned int, unsigned char>& index) const {
+	if (subroot == nullptr) {
+		return true;
+	}
+
+	if (subroot -> NW == nullptr && 
+	subroot -> NE == nullptr && 
+	subroot -> SW == nullptr && 
+	subroot -> SE == nullptr) {
+		unsigned int key = PaletteKey(subroot -> avg);
+		if (index.find(key) == index.end()) {
+			if (palette.size() == 256) {
+				return false;
+			}
+			index[key] = palette.size();
+			palette.push_back(subroot -> avg);
+		}
+		return true;
+	}
+
+	return CollectPalette(subroot -> NW, palette, index) && 
+	CollectPalette(subroot -> NE, palette, index) && 
+	CollectPalette(subroot -> SW, palette, index) && 
+	CollectPalette(subroot -> SE, palette, index);
+}
+
+// Whether every leaf is written with alpha 255
+bool QTree::Opaque(Node* subroot) const {
+	if (subroot == nullptr) {
+		return true;
+	}
+
+	if (subroot -> NW == nullptr && 
+	subroot -> NE == nullptr && 
+	subroot -> SW == nullptr && 
+	subroot -> SE == nullptr) {
+		return (unsigned char)(subroot -> avg.a * 255) == 255;
+	}
+
+	return Opaque(subroot -> NW) && Opaque(subroot -> NE) && Opaque(subroot -> SW) && Opaque(subroot -> SE);
+}
+
+// Draws image row y of the subtree's leaves into row, scaled horizontally by scale
+void QTree::RenderRow(Node* subroot, unsigned int y, unsigned int scale, RGBAPixel* row) const {
+	if (subroot == nullptr || y < subroot -> upLeft.second || y > subroot -> lowRight.second) {
+		return;
+	}
+
+	if (subroot -> NW == nullptr && 
+	subroot -> NE == nullptr && 
+	subroot -> SW == nullptr && 
+	subroot -> SE == nullptr) {
+		CS221_COUNT(pixelsRendered, scale * (subroot -> lowRight.first - subroot -> upLeft.first + 1));
+		fill(row + scale * subroot -> upLeft.first, row + scale * (subroot -> lowRight.first + 1), subroot -> avg);
+	} else {
+		RenderRow(subroot -> NW, y, scale, row);
+		RenderRow(subroot -> NE, y, scale, row);
+		RenderRow(subroot -> SW, y, scale, row);
+		RenderRow(subroot -> SE, y, scale, row);
+	}
+}
+
+// Like RenderRow, but draws each leaf's palette index
+void QTree::RenderRow(Node* subroot, unsigned int y, unsigned int scale, const map<unsigned int, unsigned char>& index, unsigned char* row) const {
+	if (subroot == nullptr || y < subroot -> upLeft.second || y > subroot -> lowRight.second) {
+		return;
+	}
+
+	if (subroot -> NW == nullptr && 
+	subroot -> NE == nullptr && 
+	subroot -> SW == nullptr && 
+	subroot -> SE == nullptr) {
+		unsigned char i = index.find(PaletteKey(subroot -> avg)) -> second;
+		CS221_COUNT(pixelsRendered, scale * (subroot -> lowRight.first - subroot -> upLeft.first + 1));
+		fill(row + scale * subroot -> upLeft.first, row + scale * (subroot -> lowRight.first + 1), i);
+	} else {
+		RenderRow(subroot -> NW, y, scale, index, row);
+		RenderRow(subroot -> NE, y, scale, index, row);
+		RenderRow(subroot -> SW, y, scale, index, row);
+		RenderRow(subroot -> SE, y, scale, index, row);
+	}
+}
+
+// Save flags for how the subtree's odd-sized rectangles are split; known
+// collects the QTREE_WIDE_EAST/QTREE_TALL_SOUTH flags decided so far
+unsigned char QTree::SplitSides(Node* subroot, unsigned char& known) const {
+	if (subroot == nullptr || 
+	(subroot -> NW == nullptr && 
+	subroot -> NE == nullptr && 
+	subroot -> SW == nullptr && 
+	subroot -> SE == nullptr)) {
+		return 0;
+	}
+
+	unsigned char flags = 0;
+	unsigned int nodeWidth = subroot -> lowRight.first - subroot -> upLeft.first + 1;
+	unsigned int nodeHeight = subroot -> lowRight.second - subroot -> upLeft.second + 1;
+	Node* west = subroot -> NW != nullptr ? subroot -> NW : subroot -> SW;
+	Node* north = subroot -> NW != nullptr ? subroot -> NW : subroot -> NE;
+
+	if (!(known & QTREE_WIDE_EAST) && nodeWidth % 2 == 1) {
+		unsigned int westWidth = west == nullptr ? 0 : west -> lowRight.first - west -> upLeft.first + 1;
+		if (westWidth < (nodeWidth + 1) / 2) {
+			flags |= QTREE_WIDE_EAST;
+		}
+		known |= QTREE_WIDE_EAST;
+	}
+	if (!(known & QTREE_TALL_SOUTH) && nodeHeight % 2 == 1) {
+		unsigned int northHeight = north == nullptr ? 0 : north -> lowRight.second - north -> upLeft.second + 1;
+		if (northHeight < (nodeHeight + 1) / 2) {
+			flags |= QTREE_TALL_SOUTH;
+		}
+		known |= QTREE_TALL_SOUTH;
+	}
+
+	Node* children[4] = {subroot -> NW, subroot -> NE, subroot -> SW, subroot -> SE};
+	for (int i = 0; i < 4 && known != (QTREE_WIDE_EAST | QTREE_TALL_SOUTH); i++) {
+		flags |= SplitSides(children[i], known);
+	}
+	return flags;
+}
+
+// Appends the subtree's structure bits and leaf colors in preorder
+void QTree::SaveNode(Node* subroot, bool opaque, vector<unsigned char>& bits, size_t& bit, vector<unsigned char>& colors) const {
+	if (subroot == nullptr) {
+		return;
+	}
+
+	bool leaf = subroot -> NW == nullptr && 
+	subroot -> NE == nullptr && 
+	subroot -> SW == nullptr && 
+	subroot -> SE == nullptr;
+
+	if (subroot -> upLeft != subroot -> lowRight) {
+		if (bit % 8 == 0) {
+			bits.push_back(0);
+		}
+		if (!leaf) {
+			bits.back() |= 1 << (bit % 8);
+		}
+		bit++;
+	}
+
+	if (leaf) {
+		colors.push_back(subroot -> avg.r);
+		colors.push_back(subroot -> avg.g);
+		colors.push_back(subroot -> avg.b);
+		if (!opaque) {
+			colors.push_back(subroot -> avg.a * 255);
+		}
+	} else {
+		SaveNode(subroot -> NW, opaque, bits, bit, colors);
+		SaveNode(subroot -> NE, opaque, bits, bit, colors);
+		SaveNode(subroot -> SW, opaque, bits, bit, colors);
+		SaveNode(subroot -> SE, opaque, bits, bit, colors);
+	}
+}
+
+// Rebuilds the subtree over ul..lr from Save's structure bits and leaf colors;
+// nullptr if either runs out
+Node* QTree::LoadNode(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, unsigned char flags, const unsigned char* bits, size_t bitCount, size_t& bit, const unsigned char*& color, unsigned int& leaves) {
+	bool split = false;
+	if (ul != lr) {
+		if (bit == bitCount) {
+			return nullptr;
+		}
+		split = (bits[bit / 8] >> (bit % 8)) & 1;
+		bit++;
+	}
+
+	if (!split) {
+		if (leaves == 0) {
+			return nullptr;
+		}
+		leaves--;
+		bool opaque = flags & QTREE_OPAQUE;
+		Node* leaf = new Node(ul, lr, RGBAPixel(color[0], color[1], color[2], opaque ? 1.0 : color[3] / 255.));
+		color += opaque ? 3 : 4;
+		return leaf;
+	}
+
+	pair<unsigned int, unsigned int> childUL[4];
+	pair<unsigned int, unsigned int> childLR[4];
+	bool exists[4];
+	ChildRects(ul, lr, flags, childUL, childLR, exists);
+
+	Node* children[4] = {nullptr, nullptr, nullptr, nullptr};
+	bool valid = true;
+	for (int i = 0; i < 4 && valid; i++) {
+		if (exists[i]) {
+			children[i] = LoadNode(childUL[i], childLR[i], flags, bits, bitCount, bit, color, leaves);
+			valid = children[i] != nullptr;
+		}
+	}
+
+	if (!valid) {
+		for (int i = 0; i < 4; i++) {
+			Clear(children[i]);
+		}
+		return nullptr;
+	}
+
+	Node* newNode = new Node(ul, lr, GetAveragePixel(children[0], children[1], children[2], children[3]));
+
+	newNode -> NW = children[0];
+	newNode -> NE = children[1];
+	newNode -> SW = children[2];
+	newNode -> SE = children[3];
+
+	return newNode;
+}
+
+// Codes the subtree's split bits and leaf colors
+void QTree::EncodeNode(Node* subroot, unsigned int depth, StreamEncoder& encoder) const {
+	if (subroot == nullptr) {
+		return;
+	}
+
+	bool leaf = subroot -> NW == nullptr && 
+	subroot -> NE == nullptr && 
+	subroot -> SW == nullptr && 
+	subroot -> SE == nullptr;
+
+	if (subroot -> upLeft != subroot -> lowRight) {
+		encoder.EncodeSplit(depth, !leaf);
+	}
+
+	if (leaf) {
+		encoder.EncodeColor(subroot -> avg);
+	} else {
+		EncodeNode(subroot -> NW, depth + 1, encoder);
+		EncodeNode(subroot -> NE, depth + 1, encoder);
+		EncodeNode(subroot -> SW, depth + 1, encoder);
+		EncodeNode(subroot -> SE, depth + 1, encoder);
+	}
+}
+
+// Appends the subtree's view records in preorder
+void QTree::SaveViewNode(Node* subroot, vector<QTreeViewNode>& nodes) const {
+	size_t index = nodes.size();
+	RGBAPixel p = subroot -> avg;
+	QTreeViewNode record = {
+		{subroot -> upLeft.first, subroot -> upLeft.second},
+		{subroot -> lowRight.first, subroot -> lowRight.second},
+		{0, 0, 0, 0},
+		{p.r, p.g, p.b, (unsigned char)(p.a * 255)}
+	};
+	nodes.push_back(record);
+
+	Node* children[4] = {subroot -> NW, subroot -> NE, subroot -> SW, subroot -> SE};
+	for (int i = 0; i < 4; i++) {
+		if (children[i] != nullptr) {
+			nodes[index].child[i] = nodes.size() - index;
+			SaveViewNode(children[i], nodes);
+		}
+	}
+}
+
+// Rebuilds the subtree over ul..lr from EncodeNode's output; nullptr once
+// the coder has run out of input
+Node* QTree::DecodeNode(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, unsigned int depth, StreamDecoder& decoder) {
+	if (decoder.coder.overrun()) {
+		return nullptr;
+	}
+
+	if (ul == lr || !decoder.DecodeSplit(depth)) {
+		return new Node(ul, lr, decoder.DecodeColor());
+	}
+
+	pair<unsigned int, unsigned int> childUL[4];
+	pair<unsigned int, unsigned int> childLR[4];
+	bool exists[4];
+	ChildRects(ul, lr, decoder.flags, childUL, childLR, exists);
+
+	Node* children[4] = {nullptr, nullptr, nullptr, nullptr};
+	bool valid = true;
+	for (int i = 0; i < 4 && valid; i++) {
+		if (exists[i]) {
+			children[i] = DecodeNode(childUL[i], childLR[i], depth + 1, decoder);
+			valid = children[i] != nullptr;
+		}
+	}
+
+	if (!valid) {
+		for (int i = 0; i < 4; i++) {
+			Clear(children[i]);
+		}
+		return nullptr;
+	}
+
+	Node* newNode = new Node(ul, lr, GetAveragePixel(children[0], children[1], children[2], children[3]));
+
+	newNode -> NW = children[0];
+	newNode -> NE = children[1];
+	newNode -> SW = children[2];
+	newNode -> SE = children[3];
+
+	return newNode;
+}
+
+// Codes the subtree's nodes down to indexDepth as EncodeNode does, and
+// collects the split nodes at indexDepth, whose subtrees are coded separately
+void QTree::EncodeTop(Node* subroot, unsigned int depth, unsigned int indexDepth, StreamEncoder& encoder, vector<Node*>& subtrees) const {
+	if (subroot == nullptr) {
+		return;
+	}
+
+	bool leaf = subroot -> NW == nullptr && 
+	subroot -> NE == nullptr && 
+	subroot -> SW == nullptr && 
+	subroot -> SE == nullptr;
+
+	if (subroot -> upLeft != subroot -> lowRight) {
+		encoder.EncodeSplit(depth, !leaf);
+	}
+
+	if (leaf || depth == indexDepth) {
+		encoder.EncodeColor(subroot -> avg);
+		if (!leaf) {
+			subtrees.push_back(subroot);
+		}
+	} else {
+		EncodeTop(subroot -> NW, depth + 1, indexDepth, encoder, subtrees);
+		EncodeTop(subroot -> NE, depth + 1, indexDepth, encoder, subtrees);
+		EncodeTop(subroot -> SW, depth + 1, indexDepth, encoder, subtrees);
+		EncodeTop(subroot -> SE, depth + 1, indexDepth, encoder, subtrees);
+	}
+}
+
+// Rebuilds the nodes over ul..lr down to the index depth from EncodeTop's
+// output, and below them the indexed subtrees that overlap the reader's
+// window; nullptr if the file is damaged
+Node* QTree::DecodeTop(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, unsigned int depth, StreamDecoder& decoder, TileReader& reader) {
+	if (decoder.coder.overrun()) {
+		return nullptr;
+	}
+
+	bool split = ul != lr && decoder.DecodeSplit(depth);
+	if (!split || depth == reader.indexDepth) {
+		Node* newNode = new Node(ul, lr, decoder.DecodeColor());
+		if (split && (reader.next == reader.index.size() / QTREE_TILE_ENTRY_SIZE ||
+			(Overlaps(ul, lr, reader.ul, reader.lr) ? !LoadSubtree(newNode, depth, reader) : (reader.next++, false)))) {
+			Clear(newNode);
+			return nullptr;
+		}
+		return newNode;
+	}
+
+	pair<unsigned int, unsigned int> childUL[4];
+	pair<unsigned int, unsigned int> childLR[4];
+	bool exists[4];
+	ChildRects(ul, lr, decoder.flags, childUL, childLR, exists);
+
+	Node* children[4] = {nullptr, nullptr, nullptr, nullptr};
+	bool valid = true;
+	for (int i = 0; i < 4 && valid; i++) {
+		if (exists[i]) {
+			children[i] = DecodeTop(childUL[i], childLR[i], depth + 1, decoder, reader);
+			valid = children[i] != nullptr;
+		}
+	}
+
+	if (!valid) {
+		for (int i = 0; i < 4; i++) {
+			Clear(children[i]);
+		}
+		return nullptr;
+	}
+
+	Node* newNode = new Node(ul, lr, GetAveragePixel(children[0], children[1], children[2], children[3]));
+
+	newNode -> NW = children[0];
+	newNode -> NE = children[1];
+	newNode -> SW = children[2];
+	newNode -> SE = children[3];
+
+	return newNode;
+}
+
+// Reads and decodes the children of the indexed node subroot from the reader's
+// next subtree stream; false if the file is damaged
+bool QTree::LoadSubtree(Node* subroot, unsigned int depth, TileReader& reader) {
+	const unsigned char* entry = &reader.index[reader.next++ * QTREE_TILE_ENTRY_SIZE];
+	unsigned long long offset = GetU32(entry) | ((unsigned long long)GetU32(entry + 4) << 32);
+	unsigned int size = GetU32(entry + 8);
+	if (offset > reader.dataSize || size > reader.dataSize - offset) {
+		return false;
+	}
+
+	vector<unsigned char> stream(size);
+	reader.file.seekg(reader.dataStart + offset);
+	if (!reader.file.read((char*)stream.data(), size)) {
+		return false;
+	}
+
+	StreamDecoder decoder(stream.data(), size, reader.flags);
+	pair<unsigned int, unsigned int> childUL[4];
+	pair<unsigned int, unsigned int> childLR[4];
+	bool exists[4];
+	ChildRects(subroot -> upLeft, subroot -> lowRight, reader.flags, childUL, childLR, exists);
+
+	Node* children[4] = {nullptr, nullptr, nullptr, nullptr};
+	bool valid = true;
+	for (int i = 0; i < 4 && valid; i++) {
+		if (exists[i]) {
+			children[i] = DecodeNode(childUL[i], childLR[i], depth + 1, decoder);
+			valid = children[i] != nullptr;
+		}
+	}
+
+	if (!valid || decoder.coder.overrun()) {
+		for (int i = 0; i < 4; i++) {
+			Clear(children[i]);
+		}
+		return false;
+	}
+
+	subroot -> avg = GetAveragePixel(children[0], children[1], children[2], children[3]);
+	subroot -> NW = children[0];
+	subroot -> NE = children[1];
+	subroot -> SW = children[2];
+	subroot -> SE = children[3];
+	return true;
+}
+
+// Forgets the stream DecodeProgressive was decoding; its nodes stay in the tree
+void QTree::EndProgressive() {
+	delete progressive;
+	progressive = nullptr;
+}
+
+// Decodes the split bits and colors of level, the nodes of the tree at
+// state.depth, from in, collects the split ones in state.split and moves
+// state on to the next level; false if the level is damaged. level holds
+// four entries, null where a child does not exist, for each of parents
+bool QTree::DecodeLevel(const unsigned char* in, size_t size, const vector<Node*>& level, const vector<Node*>& parents, ProgressiveState& state) {
+	StreamDecoder decoder(in, size, state.flags);
+	decoder.probs.swap(state.probs);
+	decoder.cache = state.cache;
+
+	for (size_t n = 0; n < level.size(); n++) {
+		Node* node = level[n];
+		if (node != nullptr) {
+			bool split = node -> upLeft != node -> lowRight && decoder.DecodeSplit(state.depth);
+			node -> avg = decoder.DecodeColor(parents.empty() ? nullptr : &parents[n / 4] -> avg);
+			if (split) {
+				state.split.push_back(node);
+			}
+		}
+	}
+
+	state.probs.swap(decoder.probs);
+	state.cache = decoder.cache;
+	state.depth++;
+	return !decoder.coder.overrun();
+}
@@ -9,9 +9,13 @@
 #ifndef _QTREE_H_
 #define _QTREE_H_
 
+#include <map>
 #include <utility>
+#include <vector>
+#include "cs221util/Metrics.h"
 #include "cs221util/PNG.h"
 #include "cs221util/RGBAPixel.h"
+#include "qtreeview.h"
 
 using namespace std;
 using namespace cs221util;
@@ -25,6 +29,7 @@ using namespace cs221util;
 class Node {
 public:
     Node(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, RGBAPixel a); // Node constructor
+    ~Node(); // Node destructor; does not delete the children
 
     pair<unsigned int, unsigned int> upLeft;   // image coordinates of upper-left corner of node's rectangular region
     pair<unsigned int, unsigned int> lowRight; // image coordinates of lower-right corner of node's rectangular region
@@ -35,6 +40,42 @@ public:
     Node* SE; // lower-right child
 };
 
+/**
+ * What QTree::Tune prunes a tree towards: at most value leaves, at least
+ * value dB PSNR, or a PNG file of at most value bytes as EncodePNG writes
+ * it with scale and options.
+ */
+struct TuneTarget {
+    enum Kind { kLeaves, kPSNR, kBytes };
+    Kind kind = kLeaves;
+    double value = 0;
+    unsigned int scale = 1; // for kBytes
+    PNGWriteOptions options; // for kBytes
+};
+
+/**
+ * What QTree::Tune found.
+ */
+struct TuneResult {
+    double tolerance = 0; // tolerance the tree was pruned with
+    unsigned int leaves = 0; // leaves of the pruned tree
+    double psnr = 0; // PSNR of the pruned tree's image against the unpruned tree's, in dB; infinite if they are equal
+    size_t bytes = 0; // size of the PNG file, for kBytes; 0 otherwise
+    unsigned int encodes = 0; // PNG files encoded in the search, for kBytes
+    bool met = false; // whether the target was met; if not, the tree comes as close to it as pruning can
+};
+
+/**
+ * How far one leaf's color is from the pixels of its rectangle, as
+ * QTree::Compare measures it.
+ */
+struct LeafError {
+    pair<unsigned int, unsigned int> upLeft;   // image coordinates of upper-left corner of the leaf's rectangle
+    pair<unsigned int, unsigned int> lowRight; // image coordinates of lower-right corner of the leaf's rectangle
+    double mse; // mean squared error over the r, g and b channels of the rectangle's pixels
+    unsigned int maxError; // largest difference of any channel, alpha scaled to 0-255
+};
+
 /**
  * QTree: This is a structure used in decomposing an image
  * into rectangular regions.
@@ -117,6 +158,11 @@ public:
      */
     QTree(const PNG& imIn);
 
+    /**
+     * Default constructor: an empty 0x0 tree, e.g. to Load into.
+     */
+    QTree();
+
     /**
      * Overloaded assignment operator for QTrees.
      * Part of the Big Three that we must define because the class
@@ -191,6 +237,242 @@ public:
      */
     void RotateCCW();
 
+    /**
+     * WritePNG writes the image that Render(scale) would produce to a PNG file,
+     * without rendering it: each scanline is drawn from the leaf rectangles
+     * that cross it and compressed before the next one, so memory use does
+     * not grow with the (scaled) image size.
+     * When the leaves hold at most 256 distinct colors, the palette is taken
+     * from the leaves and palette indices are drawn instead of pixels, so
+     * the encoder writes PLTE/tRNS directly without examining each pixel.
+     * Otherwise the image is written as RGB, or RGBA if a leaf is translucent.
+     *
+     * @param fileName name of the file to be written
+     * @param scale multiplier for each horizontal/vertical dimension
+     * @param options encoder options, see PNGWriteOptions
+     * @pre scale > 0
+     * @return true, if the image was successfully written
+     */
+    bool WritePNG(const string& fileName, unsigned int scale, const PNGWriteOptions& options = PNGWriteOptions()) const;
+
+    /**
+     * EncodePNG encodes the image as WritePNG does, but stores the PNG file
+     * in out instead of writing it.
+     *
+     * @param out receives the bytes of the PNG file, replacing its contents
+     * @param scale multiplier for each horizontal/vertical dimension
+     * @param options encoder options, see PNGWriteOptions
+     * @pre scale > 0
+     * @return true, if the image was successfully encoded
+     */
+    bool EncodePNG(vector<unsigned char>& out, unsigned int scale, const PNGWriteOptions& options = PNGWriteOptions()) const;
+
+    /**
+     * WriteTreePNG writes the image as WritePNG does, and embeds the tree's
+     * Encode stream in a private ancillary chunk ahead of the image data, so
+     * that ReadPNG can reopen the file as this tree without decoding the image.
+     * PNG viewers and decoders skip the chunk. It adds the size of the stream
+     * to the file. The chunk is marked unsafe to copy, so editors that change
+     * the image drop it.
+     *
+     * @param fileName name of the file to be written
+     * @param scale multiplier for each horizontal/vertical dimension of the image;
+     *        the embedded tree is not scaled
+     * @param options encoder options, see PNGWriteOptions
+     * @pre scale > 0
+     * @return true, if the image was successfully written
+     */
+    bool WriteTreePNG(const string& fileName, unsigned int scale, const PNGWriteOptions& options = PNGWriteOptions()) const;
+
+    /**
+     * ReadPNG replaces the contents of this tree with the tree that WriteTreePNG
+     * embedded in a PNG file. It finds the chunk by skipping from chunk header
+     * to chunk header, without decompressing the image data. A PNG without the
+     * chunk, or whose chunk is damaged, is decoded instead, and the tree is
+     * built from its pixels as the constructor does. The tree is left
+     * unchanged if the file cannot be read.
+     *
+     * @param fileName name of the file to be read
+     * @return true, if the tree was successfully read
+     */
+    bool ReadPNG(const string& fileName);
+
+    /**
+     * Save writes the tree to a compact binary file: its dimensions, one
+     * bit per node in preorder telling whether it is split, and the leaf
+     * colors. Node rectangles are not stored; they follow from the
+     * constructor's split rule, and which children exist follows from
+     * the rectangles. Flipped and rotated trees are saved as well.
+     * Leaf alpha is kept at 8 bits, as in a PNG file, so a loaded tree
+     * renders exactly like this one.
+     *
+     * @param fileName name of the file to be written
+     * @return true, if the tree was successfully written
+     */
+    bool Save(const string& fileName) const;
+
+    /**
+     * Load replaces the contents of this tree with a tree written by Save.
+     * Non-leaf average colors are recomputed from their children as the
+     * constructor does. The tree is left unchanged if the file cannot be
+     * read or is not a valid tree file.
+     *
+     * @param fileName name of the file to be read
+     * @return true, if the tree was successfully read
+     */
+    bool Load(const string& fileName);
+
+    /**
+     * Encode writes the tree as an entropy-coded stream, smaller than Save's
+     * file: split bits are range coded in a context per depth, and each leaf's
+     * color is coded as its position among the most recently coded colors or,
+     * if it is not one of them, as its difference from the previous leaf's color.
+     * Non-leaf colors are not stored. Like Save, it keeps leaf alpha at 8 bits.
+     *
+     * @param out receives the stream, replacing its contents
+     */
+    void Encode(vector<unsigned char>& out) const;
+
+    /**
+     * Decode replaces the contents of this tree with a tree written by Encode.
+     * Non-leaf average colors are recomputed from their children as the
+     * constructor does. The tree is left unchanged if in is not a valid stream.
+     *
+     * @param in the stream
+     * @return true, if the tree was successfully decoded
+     */
+    bool Decode(const vector<unsigned char>& in);
+
+    /**
+     * SaveTiled writes the tree as Encode does, but cut at indexDepth: the nodes
+     * down to that depth are coded in one stream, and the subtree below each
+     * split node at that depth in a stream of its own, found through an index of
+     * file offsets. LoadRegion can then read and decode just the subtrees that a
+     * window of the image needs.
+     *
+     * @param fileName name of the file to be written
+     * @param indexDepth depth of the nodes whose subtrees are indexed; there are
+     *        up to 4^indexDepth of them
+     * @return true, if the tree was successfully written
+     */
+    bool SaveTiled(const string& fileName, unsigned int indexDepth = 4) const;
+
+    /**
+     * LoadRegion replaces the contents of this tree with the part of a tree
+     * written by SaveTiled that covers the image rectangle from ul to lr. The
+     * nodes down to the index depth are always decoded, but of the indexed
+     * subtrees only those overlapping the rectangle are read from the file;
+     * the others are left as leaves holding their average color. Loading the
+     * whole image gives the same tree as Decode. The tree is left unchanged if
+     * the file cannot be read or is not a valid tiled tree file.
+     *
+     * @param fileName name of the file to be read
+     * @param ul upper left corner of the rectangle, in image coordinates
+     * @param lr lower right corner of the rectangle, in image coordinates
+     * @pre ul <= lr
+     * @return true, if the tree was successfully read
+     */
+    bool LoadRegion(const string& fileName, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr);
+
+    /**
+     * EncodeProgressive writes the tree breadth-first, so that it can be shown
+     * while it arrives: the root's color comes first, then each level of the
+     * tree in turn. Every node's split bit and color are coded as in Encode,
+     * but colors as differences from the parent's color. Non-leaf colors are
+     * stored too, so the stream is larger than Encode's.
+     * Each level is a separately flushed chunk, so a level can be decoded as
+     * soon as its bytes have arrived.
+     *
+     * @param out receives the stream, replacing its contents
+     */
+    void EncodeProgressive(vector<unsigned char>& out) const;
+
+    /**
+     * DecodeProgressive decodes a stream written by EncodeProgressive as it
+     * arrives. in holds the bytes of the stream received so far. The first call
+     * replaces the contents of this tree with the root, once the header and
+     * the root's level have arrived. Each later call splits the leaves of the
+     * last level decoded with every following level that has arrived in full.
+     * Non-leaves keep their coded colors. Once the last level is decoded, the
+     * next call starts a new stream. Prune, FlipHorizontal, RotateCCW and
+     * anything that replaces the tree abandon a stream being decoded.
+     *
+     * @param in the stream received so far; later calls must pass the same
+     *        bytes, followed by any that have arrived since
+     * @param preview if not null, kept equal to Render(scale): the first call
+     *        renders the root into it, and later calls repaint only the
+     *        rectangles of the leaves they split
+     * @param scale multiplier for each horizontal/vertical dimension of preview
+     * @pre scale > 0
+     * @return false if in is not a valid stream; the levels already decoded
+     *         are kept, and the next call starts a new stream
+     */
+    bool DecodeProgressive(const vector<unsigned char>& in, PNG* preview = nullptr, unsigned int scale = 1);
+
+    /**
+     * ProgressiveComplete tells whether DecodeProgressive has decoded the
+     * whole of the last stream it was given.
+     */
+    bool ProgressiveComplete() const;
+
+    /**
+     * SaveView writes the tree in the layout QTreeView maps and reads in
+     * place: a header and one fixed-size record per node, holding its
+     * rectangle, color, and the distances to its children's records.
+     * The file is much larger than Save's, in exchange for needing no
+     * decoding. See qtreeview.h.
+     *
+     * @param fileName name of the file to be written
+     * @return true, if the tree was successfully written
+     */
+    bool SaveView(const string& fileName) const;
+
+    /**
+     * Tune finds the tolerance at which Prune meets target, and stores
+     * this tree pruned at that tolerance in pruned. This tree is left as
+     * it is, so it can be tuned again towards other targets.
+     *
+     * It does not try tolerances one by one. A node is pruned at every
+     * tolerance from the largest distance of its leaves to its color up, so
+     * one pass over the tree tells, for every tolerance, how many leaves
+     * the pruned tree has and how far its colors are from the pixels.
+     * Leaf counts and PSNR targets are looked up from that; the tolerance
+     * chosen is the smallest that meets a leaf count, and the largest that
+     * meets a PSNR. A file size is modelled from the same pass: the file
+     * costs about the same number of bytes per pixel of leaf edge (summed
+     * width plus height) at every tolerance. The model picks the tolerance,
+     * and an encode checks it and calibrates the model for the next pick.
+     * The search stops at the first file that fits and is at least 90% of
+     * the target, or that fits after 4 encodes, usually after 1 to 3.
+     * It assumes that files do not shrink as leaves are added; where they
+     * do, e.g. near the unpruned tree, it may not find the most leaves.
+     *
+     * PSNR is over the r, g and b channels of every pixel; alpha is not
+     * compared.
+     *
+     * @param target what to tune for, see TuneTarget
+     * @param pruned receives the pruned tree
+     * @pre this tree has not previously been pruned, nor is copied from a previously pruned tree.
+     * @return the tolerance chosen and what it gives, see TuneResult
+     */
+    TuneResult Tune(const TuneTarget& target, QTree& pruned) const;
+
+    /**
+     * Compare measures how far the image the tree renders at scale 1 is
+     * from original, as cs221util::compareImages does, but without
+     * rendering it: each leaf's color is compared with the pixels of its
+     * rectangle in original. SSIM is not measured and is left NaN.
+     * Flipped and rotated trees are compared with original as it is.
+     *
+     * @param original the image to compare with, e.g. the one the tree was built from
+     * @param metrics receives the figures for the whole image
+     * @param leafErrors if not null, receives the error of each leaf, in preorder
+     * @param threads number of threads to compare on; 1 compares on the calling thread only
+     * @return false, leaving metrics and leafErrors unchanged, if original's
+     *         size is not the tree's
+     */
+    bool Compare(const PNG& original, ImageMetrics& metrics, vector<LeafError>* leafErrors = nullptr, unsigned int threads = 1) const;
+
     /* =============== end of public PA3 FUNCTIONS =========================*/
 
 private:
@@ -0,0 +1,187 @@
+/**
+ * @file qtreeview.cpp
+ * @description implementation of the read-only QTreeView
+ *              CPSC 221 PA3
+ *
+ *              THIS FILE WILL NOT BE SUBMITTED
+ */
+
+#include "qtreeview.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+static_assert(sizeof(QTreeViewHeader) == 20 && sizeof(QTreeViewNode) == 36, "QTree view records must not be padded");
+
+static const char QTREEVIEW_MAGIC[4] = {'Q', 'T', 'R', 'V'};
+
+// Trees of images up to 2^32 x 2^32 are at most 33 levels deep; deeper
+// paths only come from damaged files
+static const unsigned int QTREEVIEW_MAX_DEPTH = 64;
+
+/**
+ * Constructs an empty view, with no nodes and 0x0 dimensions.
+ */
+QTreeView::QTreeView() {
+	mapping = nullptr;
+	mappingSize = 0;
+	header = nullptr;
+	nodes = nullptr;
+}
+
+/**
+ * Unmaps the file, if one is open.
+ */
+QTreeView::~QTreeView() {
+	Close();
+}
+
+/**
+ * Maps a file written by QTree::SaveView, replacing any file mapped before.
+ * Records are checked as they are visited, so a damaged file renders
+ * incompletely rather than reading outside the mapping.
+ *
+ * @param fileName name of the file to be mapped
+ * @return true, if the file was mapped and has a valid header
+ */
+bool QTreeView::Open(const string& fileName) {
+	int fd = open(fileName.c_str(), O_RDONLY);
+	if (fd < 0) {
+		cerr << "QTreeView::Open: could not open " << fileName << endl;
+		return false;
+	}
+
+	struct stat st;
+	size_t size = 0;
+	void* map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(QTreeViewHeader)) {
+		size = st.st_size;
+		map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (map == MAP_FAILED) {
+		cerr << "QTreeView::Open: could not map " << fileName << endl;
+		return false;
+	}
+
+	const QTreeViewHeader* h = (const QTreeViewHeader*)map;
+	size_t records = (size - sizeof(QTreeViewHeader)) / sizeof(QTreeViewNode);
+	if (memcmp(h -> magic, QTREEVIEW_MAGIC, 4) != 0 || (h -> width == 0) != (h -> height == 0) ||
+		(h -> width == 0) != (h -> nodeCount == 0) || h -> nodeCount > records) {
+		munmap(map, size);
+		cerr << "QTreeView::Open: " << fileName << " is not a QTree view file" << endl;
+		return false;
+	}
+
+	Close();
+	mapping = map;
+	mappingSize = size;
+	header = h;
+	nodes = (const QTreeViewNode*)(h + 1);
+	return true;
+}
+
+/**
+ * Width and height of the image represented by the tree
+ */
+unsigned int QTreeView::Width() const {
+	return header == nullptr ? 0 : header -> width;
+}
+
+unsigned int QTreeView::Height() const {
+	return header == nullptr ? 0 : header -> height;
+}
+
+/**
+ * Counts the number of leaves in the tree, as recorded by SaveView
+ */
+unsigned int QTreeView::CountLeaves() const {
+	return header == nullptr ? 0 : header -> leafCount;
+}
+
+/**
+ * Render returns the image QTree::Render would return for the saved tree.
+ *
+ * @param scale multiplier for each horizontal/vertical dimension
+ * @pre scale > 0
+ */
+PNG QTreeView::Render(unsigned int scale) const {
+	if (Width() == 0) {
+		return PNG(0, 0);
+	}
+	return RenderRegion(make_pair(0, 0), make_pair(Width() - 1, Height() - 1), scale);
+}
+
+/**
+ * RenderRegion returns the part of Render(scale) covering the image
+ * rectangle from ul to lr, inclusive. Only nodes overlapping the
+ * rectangle are visited.
+ *
+ * @param ul upper left corner of the rectangle, in image coordinates
+ * @param lr lower right corner of the rectangle, in image coordinates
+ * @param scale multiplier for each horizontal/vertical dimension
+ * @pre scale > 0, ul <= lr and lr lies inside the image
+ */
+PNG QTreeView::RenderRegion(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, unsigned int scale) const {
+	PNG output = PNG((lr.first - ul.first + 1) * scale, (lr.second - ul.second + 1) * scale);
+	if (header != nullptr && header -> nodeCount > 0) {
+		RenderRegion(0, 0, ul, lr, scale, output);
+	}
+	return output;
+}
+
+/**
+ * Unmaps the file, if one is open, leaving an empty view.
+ */
+void QTreeView::Close() {
+	if (mapping != nullptr) {
+		munmap(mapping, mappingSize);
+	}
+	mapping = nullptr;
+	mappingSize = 0;
+	header = nullptr;
+	nodes = nullptr;
+}
+
+/**
+ * Draws the leaves of the subtree at record index that overlap ul..lr into img,
+ * whose upper left pixel is ul scaled.
+ */
+void QTreeView::RenderRegion(size_t index, unsigned int depth, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, unsigned int scale, PNG& img) const {
+	const QTreeViewNode& nd = nodes[index];
+	if (nd.lowRight[0] < ul.first || nd.upLeft[0] > lr.first || nd.lowRight[1] < ul.second || nd.upLeft[1] > lr.second) {
+		return;
+	}
+
+	bool leaf = true;
+	for (int i = 0; i < 4; i++) {
+		if (nd.child[i] != 0) {
+			leaf = false;
+			// children follow their parent, inside the file
+			if (depth < QTREEVIEW_MAX_DEPTH && nd.child[i] < header -> nodeCount - index) {
+				RenderRegion(index + nd.child[i], depth + 1, ul, lr, scale, img);
+			}
+		}
+	}
+	if (!leaf) {
+		return;
+	}
+
+	// the leaf's rectangle clipped to the region, in output pixels
+	unsigned int x0 = (max(nd.upLeft[0], ul.first) - ul.first) * scale;
+	unsigned int x1 = (min(nd.lowRight[0], lr.first) - ul.first + 1) * scale;
+	unsigned int y0 = (max(nd.upLeft[1], ul.second) - ul.second) * scale;
+	unsigned int y1 = (min(nd.lowRight[1], lr.second) - ul.second + 1) * scale;
+	RGBAPixel color(nd.avg[0], nd.avg[1], nd.avg[2], nd.avg[3] / 255.);
+	for (unsigned int y = y0; y < y1; y++) {
+		for (unsigned int x = x0; x < x1; x++) {
+			*img.getPixel(x, y) = color;
+		}
+	}
+}
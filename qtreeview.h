@@ -0,0 +1,123 @@
+/**
+ * @file qtreeview.h
+ * @description read-only view of a QTree file written by QTree::SaveView
+ *              CPSC 221 PA3
+ *
+ *              THIS FILE WILL NOT BE SUBMITTED
+ */
+
+#ifndef _QTREEVIEW_H_
+#define _QTREEVIEW_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include "cs221util/PNG.h"
+
+using namespace std;
+using namespace cs221util;
+
+/**
+ * Layout of a QTree view file, used in place through mmap: a header, then
+ * one fixed-size record per node in preorder, the root first. Children are
+ * found by their distance in records from their parent, so the file needs
+ * no fixing up after it is mapped. Integers are in host byte order.
+ */
+struct QTreeViewHeader {
+    char magic[4];          // "QTRV"
+    uint32_t width;         // width of the image represented by the tree
+    uint32_t height;        // height of the image represented by the tree
+    uint32_t nodeCount;     // number of node records following the header
+    uint32_t leafCount;     // number of those that are leaves
+};
+
+struct QTreeViewNode {
+    uint32_t upLeft[2];     // image coordinates of upper-left corner of node's rectangle
+    uint32_t lowRight[2];   // image coordinates of lower-right corner of node's rectangle
+    uint32_t child[4];      // NW, NE, SW, SE: records from this node to the child, 0 if none
+    unsigned char avg[4];   // average color: r, g, b, alpha*255
+};
+
+/**
+ * QTreeView: a read-only QTree, mapped from a file written by QTree::SaveView.
+ * Opening a view only maps the file and checks its header, so it takes the
+ * same time for any size of tree; nodes are read from the mapping as they are
+ * visited, and no Node objects are allocated.
+ */
+class QTreeView {
+public:
+
+    /**
+     * Constructs an empty view, with no nodes and 0x0 dimensions.
+     */
+    QTreeView();
+
+    /**
+     * Unmaps the file, if one is open.
+     */
+    ~QTreeView();
+
+    /**
+     * Maps a file written by QTree::SaveView, replacing any file mapped before.
+     * Records are checked as they are visited, so a damaged file renders
+     * incompletely rather than reading outside the mapping.
+     *
+     * @param fileName name of the file to be mapped
+     * @return true, if the file was mapped and has a valid header
+     */
+    bool Open(const string& fileName);
+
+    /**
+     * Width and height of the image represented by the tree
+     */
+    unsigned int Width() const;
+    unsigned int Height() const;
+
+    /**
+     * Counts the number of leaves in the tree, as recorded by SaveView
+     */
+    unsigned int CountLeaves() const;
+
+    /**
+     * Render returns the image QTree::Render would return for the saved tree.
+     *
+     * @param scale multiplier for each horizontal/vertical dimension
+     * @pre scale > 0
+     */
+    PNG Render(unsigned int scale) const;
+
+    /**
+     * RenderRegion returns the part of Render(scale) covering the image
+     * rectangle from ul to lr, inclusive. Only nodes overlapping the
+     * rectangle are visited.
+     *
+     * @param ul upper left corner of the rectangle, in image coordinates
+     * @param lr lower right corner of the rectangle, in image coordinates
+     * @param scale multiplier for each horizontal/vertical dimension
+     * @pre scale > 0, ul <= lr and lr lies inside the image
+     */
+    PNG RenderRegion(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, unsigned int scale) const;
+
+private:
+    QTreeView(const QTreeView& other);            // not copyable: owns the mapping
+    QTreeView& operator=(const QTreeView& rhs);
+
+    /**
+     * Unmaps the file, if one is open, leaving an empty view.
+     */
+    void Close();
+
+    /**
+     * Draws the leaves of the subtree at record index that overlap ul..lr into img,
+     * whose upper left pixel is ul scaled.
+     */
+    void RenderRegion(size_t index, unsigned int depth, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, unsigned int scale, PNG& img) const;
+
+    void* mapping;                  // the mapped file, or nullptr
+    size_t mappingSize;             // its size in bytes
+    const QTreeViewHeader* header;  // start of the mapping
+    const QTreeViewNode* nodes;     // the node records, after the header
+};
+
+#endif